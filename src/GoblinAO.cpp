@@ -17,25 +17,46 @@ Color AORenderer::Li(const ScenePtr& scene,
     float epsilon;
     Intersection intersection;
     if (scene->intersect(ray, &epsilon, &intersection)) {
-        const Fragment& fragment = intersection.fragment;
-        uint32_t samplesNum = mAOSampleIndex.sampleNum;
-        uint32_t occludedNum = 0;
-        for (uint32_t n = 0; n < samplesNum; ++n) {
-            Vector3 sampleDir = uniformSampleHemisphere(
-                sample.u2D[mAOSampleIndex.offset][2 * n],
-                sample.u2D[mAOSampleIndex.offset][2 * n + 1]);
-            Matrix3 shadeToWorld = fragment.getWorldToShade().transpose();
-            Vector3 occludeRayDir = shadeToWorld * sampleDir;
-            Ray occludeRay(fragment.getPosition(), occludeRayDir, epsilon);
-            if (scene->occluded(occludeRay)) {
-                occludedNum++;
-            }
-        }
-        Li = Color((float)(samplesNum - occludedNum) / (float)samplesNum);
+        Li = ambientOcclusion(scene, intersection, epsilon, sample);
     }
     return Li;
 }
 
+void AORenderer::batchLi(const ScenePtr& scene,
+    const RayDifferential* rays, const Sample* samples, int raysNum,
+    const RNG& rng, RenderingTLS* tls, Color* L) const {
+    std::vector<Ray> cameraRays(rays, rays + raysNum);
+    std::vector<float> epsilons(raysNum);
+    std::vector<Intersection> intersections(raysNum);
+    std::unique_ptr<bool[]> hits(new bool[raysNum]);
+    scene->intersect(&cameraRays[0], raysNum, &epsilons[0],
+        &intersections[0], hits.get());
+    for (int i = 0; i < raysNum; ++i) {
+        L[i] = hits[i] ? ambientOcclusion(scene, intersections[i],
+            epsilons[i], samples[i]) : Color::Black;
+    }
+}
+
+Color AORenderer::ambientOcclusion(const ScenePtr& scene,
+    const Intersection& intersection, float epsilon,
+    const Sample& sample) const {
+    const Fragment& fragment = intersection.fragment;
+    uint32_t samplesNum = mAOSampleIndex.sampleNum;
+    uint32_t occludedNum = 0;
+    for (uint32_t n = 0; n < samplesNum; ++n) {
+        Vector3 sampleDir = uniformSampleHemisphere(
+            sample.u2D[mAOSampleIndex.offset][2 * n],
+            sample.u2D[mAOSampleIndex.offset][2 * n + 1]);
+        Matrix3 shadeToWorld = fragment.getWorldToShade().transpose();
+        Vector3 occludeRayDir = shadeToWorld * sampleDir;
+        Ray occludeRay(fragment.getPosition(), occludeRayDir, epsilon);
+        if (scene->occluded(occludeRay)) {
+            occludedNum++;
+        }
+    }
+    return Color((float)(samplesNum - occludedNum) / (float)samplesNum);
+}
+
 void AORenderer::querySampleQuota(const ScenePtr& scene,
         SampleQuota* sampleQuota) {
     mAOSampleIndex = sampleQuota->requestTwoDQuota(mAOSampleNum);
@@ -15,10 +15,20 @@ public:
 		const Sample& sample, const RNG& rng,
 		RenderingTLS* tls) const override;
 
+	// the camera rays of a pixel are coherent and traced as one ray
+	// stream, the hemisphere rays spread out too much to share nodes
+	void batchLi(const ScenePtr& scene, const RayDifferential* rays,
+		const Sample* samples, int raysNum, const RNG& rng,
+		RenderingTLS* tls, Color* L) const override;
+
 private:
     void querySampleQuota(const ScenePtr& scene,
         SampleQuota* sampleQuota) override;
 
+    Color ambientOcclusion(const ScenePtr& scene,
+        const Intersection& intersection, float epsilon,
+        const Sample& sample) const;
+
 private:
     int mAOSampleNum;
     SampleIndex mAOSampleIndex;
@@ -87,4 +87,9 @@ int BBox::longestAxis() const {
     }
 }
 
+float BBox::surfaceArea() const {
+    Vector3 delta = pMax - pMin;
+    return 2.0f * (delta.x * delta.y + delta.y * delta.z + delta.z * delta.x);
+}
+
 } // namespace Goblin
\ No newline at end of file
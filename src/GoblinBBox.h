@@ -36,6 +36,8 @@ public:
 
     int longestAxis() const;
 
+    float surfaceArea() const;
+
 	Vector3 center() const {
 		return 0.5f * (pMin + pMax);
 	}
@@ -12,7 +12,8 @@ public:
     BDPTTask(BDPT* bdpt, const CameraPtr& camera, const ScenePtr& scene,
         const SampleRange& sampleRange,
         const SampleQuota& sampleQuota, int samplePerPixel,
-        int maxPathLength, RenderProgress* renderProgress);
+        int maxPathLength, RenderProgress* renderProgress,
+        SplatFilm* splatFilm);
 
     void run(TLSPtr& tls);
 private:
@@ -20,47 +21,58 @@ private:
     std::vector<PathVertex> mLightPath;
     std::vector<PathVertex> mEyePath;
     std::vector<BDPTMISNode> mMISNodes;
+    // nullptr for the per thread full frame tiles
+    SplatFilm* mSplatFilm;
 };
 
 BDPTTask::BDPTTask(BDPT* bdpt, const CameraPtr& camera,
     const ScenePtr& scene, const SampleRange& sampleRange,
     const SampleQuota& sampleQuota, int samplePerPixel,
-    int maxPathLength, RenderProgress* renderProgress):
+    int maxPathLength, RenderProgress* renderProgress,
+    SplatFilm* splatFilm):
     RenderTask(bdpt, camera, scene, sampleRange, sampleQuota,
     samplePerPixel, renderProgress),
     mBDPT(bdpt),
     mLightPath(maxPathLength + 1),
     mEyePath(maxPathLength + 1),
-    mMISNodes(maxPathLength + 1) {}
+    mMISNodes(maxPathLength + 1),
+    mSplatFilm(splatFilm) {}
 
 void BDPTTask::run(TLSPtr& tls) {
     RenderingTLS* renderingTLS =
         static_cast<RenderingTLS*>(tls.get());
-    ImageTile* tile = renderingTLS->getTile();
+    SampleSplatter* splatter = mSplatFilm ?
+        static_cast<SampleSplatter*>(mSplatFilm) : renderingTLS->getTile();
 
-    Sampler sampler(mSampleRange, mSamplePerPixel, mSampleQuota, mRNG);
+    Sampler sampler(mSampleRange, mSamplePerPixel, mSampleQuota, &mRNG);
+    sampler.setSampleIndexOffset(mSampleIndexOffset);
+    sampler.setSeed(mRenderer->getSeed());
     int batchAmount = sampler.maxSamplesPerRequest();
     Sample* samples = sampler.allocateSampleBuffer(batchAmount);
+    RayCounts raysBefore = threadRayCounts();
     int sampleNum = 0;
     uint64_t totalSampleCount = 0;
     while ((sampleNum = sampler.requestSamples(samples)) > 0) {
         for (int s = 0; s <sampleNum; ++s) {
-            mBDPT->evalContribution(mScene, samples[s], *mRNG,
-                mLightPath, mEyePath, mMISNodes, tile);
+            mBDPT->evalContribution(mScene, samples[s], mRNG,
+                mLightPath, mEyePath, mMISNodes, splatter);
         }
         totalSampleCount += sampleNum;
     }
     renderingTLS->addSampleCount(totalSampleCount);
     delete [] samples;
-    mRenderProgress->update();
+    mRenderProgress->update(totalSampleCount,
+        threadRayCounts() - raysBefore);
 }
 
 BDPT::BDPT(int samplePerPixel, int threadNum,
-    int maxPathLength, int debugS, int debugT, bool debugNoMIS):
+    int maxPathLength, int debugS, int debugT, bool debugNoMIS,
+    SplatFilmMode splatFilmMode):
     Renderer(samplePerPixel, threadNum),
     mTotalSamplesNum(0), mMaxPathLength(maxPathLength),
     mLightPathSampleIndexes(nullptr), mEyePathSampleIndexes(nullptr),
-    mDebugS(debugS), mDebugT(debugT), mDebugNoMIS(debugNoMIS)
+    mDebugS(debugS), mDebugT(debugT), mDebugNoMIS(debugNoMIS),
+    mSplatFilmMode(splatFilmMode)
     {}
 
 BDPT::~BDPT() {
@@ -86,7 +98,7 @@ void BDPT::evalContribution(const ScenePtr& scene,
     std::vector<PathVertex>& lightPath,
     std::vector<PathVertex>& eyePath,
     std::vector<BDPTMISNode>& misNodes,
-    ImageTile* tile) const {
+    SampleSplatter* splatter) const {
     // construct path randomwalk from light
     const std::vector<Light*>& lights = scene->getLights();
     if (lights.size() == 0) {
@@ -150,7 +162,7 @@ void BDPT::evalContribution(const ScenePtr& scene,
                 1.0f :
                 evalMIS(scene, camera, lightPath, s, eyePath, t,
                 Gconnect, misNodes);
-            tile->addSample(filmPixel.x, filmPixel.y,
+            splatter->addSample(filmPixel.x, filmPixel.y,
                 weight * unweightedContribution);
         }
     }
@@ -533,29 +545,33 @@ void BDPT::render(const ScenePtr& scene) {
 
     std::vector<SampleRange> sampleRanges;
     getSampleRanges(film, sampleRanges);
-    std::vector<Task*> bdptTasks;
-    RenderProgress progress(static_cast<int>(sampleRanges.size()));
-    for (size_t i = 0; i < sampleRanges.size(); ++i) {
-        bdptTasks.push_back(new BDPTTask(this,
-            camera, scene, sampleRanges[i], sampleQuota, mSamplePerPixel,
-            mMaxPathLength, &progress));
+    std::unique_ptr<SplatFilm> splatFilm;
+    if (mSplatFilmMode == SplatFilmShared) {
+        ImageRect filmRect;
+        film->getImageRect(filmRect);
+        splatFilm.reset(new SplatFilm(filmRect, film->getFilterTable()));
     }
-
-    RenderingTLSManager tlsManager(film);
+    RenderProgress progress(mProgressReport, getExpectedSampleNum(film));
+    auto splatStart = std::chrono::steady_clock::now();
+    RenderingTLSManager tlsManager(film, !splatFilm);
     ThreadPool threadPool(mThreadNum, &tlsManager);
-    threadPool.enqueue(bdptTasks);
-    threadPool.waitForAll();
-    //clean up
-    for (size_t i = 0; i < bdptTasks.size(); ++i) {
-        delete bdptTasks[i];
-    }
-    bdptTasks.clear();
+    renderSplatPasses(scene, "bdpt", threadPool, tlsManager, progress,
+        sampleRanges, splatFilm.get(),
+        [&](const SampleRange& sampleRange, int samplePerPixel,
+        RenderProgress* renderProgress) -> RenderTask* {
+        return new BDPTTask(this, camera, scene, sampleRange, sampleQuota,
+            samplePerPixel, mMaxPathLength, renderProgress, splatFilm.get());
+    });
+    reportSplatFilm(film, splatFilm.get(), std::chrono::duration<double>(
+        std::chrono::steady_clock::now() - splatStart).count());
     ImageRect filmRect;
     film->getImageRect(filmRect);
     float filmArea = (float)(filmRect.xCount * filmRect.yCount);
+    film->writePartialFilm(tlsManager.getTotalSampleCount(), false);
     film->scaleImage(filmArea / tlsManager.getTotalSampleCount());
     drawDebugData(tlsManager.getDebugData(), camera);
     film->writeImage(false);
+    tlsManager.reportTraversalStats();
 }
 
 void BDPT::querySampleQuota(const ScenePtr& scene,
@@ -622,7 +638,7 @@ Renderer* createBDPT(const ParamSet& params) {
     int debugT = params.getInt("debug_t", -1);
     bool debugNoMIS = params.getBool("debug_no_mis", false);
     return new BDPT(samplePerPixel, threadNum, maxPathLength,
-        debugS, debugT, debugNoMIS);
+        debugS, debugT, debugNoMIS, getSplatFilmMode(params));
 }
 
 } // namespace Goblin
\ No newline at end of file
@@ -11,7 +11,8 @@ class BDPT : public Renderer {
 public:
     BDPT(int samplePerPixel, int threadNum,
         int maxPathLength, int debugS = -1, int debugT = -1,
-        bool debugNoMIS = false);
+        bool debugNoMIS = false,
+        SplatFilmMode splatFilmMode = SplatFilmTile);
 
 	~BDPT();
 
@@ -26,7 +27,7 @@ public:
         std::vector<PathVertex>& lightPath,
         std::vector<PathVertex>& eyePath,
         std::vector<BDPTMISNode>& misNodes,
-        ImageTile* tile) const;
+        SampleSplatter* splatter) const;
 
     void querySampleQuota(const ScenePtr& scene,
         SampleQuota* sampleQuota);
@@ -65,6 +66,7 @@ private:
     int mDebugS;
     int mDebugT;
     bool mDebugNoMIS;
+    SplatFilmMode mSplatFilmMode;
 };
 
 Renderer* createBDPT(const ParamSet &params);
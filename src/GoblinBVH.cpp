@@ -1,10 +1,132 @@
 #include "GoblinBVH.h"
+#include "GoblinMappedFile.h"
+#include "GoblinParamSet.h"
+#include "GoblinPolygonMesh.h"
 #include "GoblinRay.h"
+#include "GoblinThreadPool.h"
+#include "GoblinTraversalStats.h"
 #include "GoblinUtils.h"
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
 #include <iostream>
+#include <sstream>
+
+#ifdef GOBLIN_BVH_FETCH_STATS
+#include <atomic>
+#endif
+
+#if defined(__SSE__) || defined(_M_X64) || \
+    (defined(_M_IX86_FP) && _M_IX86_FP >= 1)
+#define GOBLIN_BVH_SSE
+#include <xmmintrin.h>
+#endif
+
+#if defined(__SSE2__) || defined(_M_X64) || \
+    (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define GOBLIN_BVH_SSE2
+#include <emmintrin.h>
+#endif
 
 namespace Goblin {
 
+// relative cost of one bbox traversal step compare to one primitive
+// intersection test, used by the surface area heuristic cost model
+static const float sTraversalCost = 0.125f;
+static const float sIntersectCost = 1.0f;
+static const int sSAHBucketsNum = 12;
+// primitives number below which parallel build doesn't pay off
+static const uint32_t sParallelBuildThreshold = 4096;
+static const uint32_t sMinSubtreePrimitivesNum = 1024;
+// spatial split is only tried when the object split children overlap
+// more than this fraction of the root surface area
+static const float sSpatialSplitAlpha = 1e-5f;
+static const int sSpatialBinsNum = 32;
+// sibling pairs per treelet, 64 pairs of 2 32 byte nodes fill a 4KB page
+static const int sTreeletPairsNum = 64;
+// bump the version whenever the node/triangle layout or the build
+// result for the same settings changes, stale cache files get rebuilt
+static const char sBVHCacheMagic[4] = {'G', 'B', 'V', 'H'};
+static const uint32_t sBVHCacheVersion = 2;
+
+// the cache file is this header followed by the CompactBVHNode array
+// and the FlatTriangle array, both in the in memory layout. the header
+// is 32 bytes so the mapped nodes line up like the NodeAllocator ones
+struct BVHCacheHeader {
+    char magic[4];
+    uint32_t version;
+    uint64_t key;
+    uint32_t nodesNum;
+    uint32_t trianglesNum;
+    uint32_t nodeSize;
+    uint32_t triangleSize;
+};
+
+#ifdef GOBLIN_BVH_FETCH_STATS
+// set associative LRU model of a 256KB 8 way cache with 64 byte lines,
+// fed with the node loads only so the misses show how far apart the
+// traversal working set sits in memory
+static const int sFetchCacheSetsNum = 512;
+static const int sFetchCacheWays = 8;
+static std::atomic<uint64_t> sNodeFetches(0);
+static std::atomic<uint64_t> sNodeFetchMisses(0);
+
+struct NodeFetchCache {
+    NodeFetchCache(): fetches(0), misses(0) {
+        memset(tags, 0, sizeof(tags));
+    }
+
+    // flush on thread exit, the render threads quit after each pass
+    ~NodeFetchCache() {
+        sNodeFetches += fetches;
+        sNodeFetchMisses += misses;
+    }
+
+    // count one fetch per node and one miss per line it spans that
+    // is not cached yet
+    void fetch(const void* address, size_t size) {
+        ++fetches;
+        uintptr_t begin = reinterpret_cast<uintptr_t>(address);
+        for (uintptr_t line = begin >> 6; line <= (begin + size - 1) >> 6;
+            ++line) {
+            touch(line);
+        }
+    }
+
+    void touch(uintptr_t address) {
+        // tag 0 marks an empty way, line addresses are offset by 1
+        uint64_t line = static_cast<uint64_t>(address) + 1;
+        uint64_t* set = tags[line % sFetchCacheSetsNum];
+        int way = 0;
+        while (way < sFetchCacheWays - 1 && set[way] != line) {
+            ++way;
+        }
+        if (set[way] != line) {
+            ++misses;
+        }
+        // move to the most recently used slot
+        for (; way > 0; --way) {
+            set[way] = set[way - 1];
+        }
+        set[0] = line;
+    }
+
+    uint64_t tags[sFetchCacheSetsNum][sFetchCacheWays];
+    uint64_t fetches;
+    uint64_t misses;
+};
+
+static thread_local NodeFetchCache sNodeFetchCache;
+#endif
+
+static inline void recordNodeFetch(const void* node, size_t size) {
+    countNodeVisit();
+#ifdef GOBLIN_BVH_FETCH_STATS
+    sNodeFetchCache.fetch(node, size);
+#endif
+}
+
 struct BVHPrimitiveInfo {
     BVHPrimitiveInfo(const BBox& b, int i):
         bbox(b), primitiveIndexNum(i), center(0.5f * (b.pMin + b.pMax)) {}
@@ -22,6 +144,84 @@ struct MidComparator {
     }
 };
 
+struct SAHBucket {
+    SAHBucket(): count(0) {}
+    uint32_t count;
+    BBox bbox;
+};
+
+struct SpatialBin {
+    SpatialBin(): enter(0), exit(0) {}
+    BBox bbox;
+    uint32_t enter;
+    uint32_t exit;
+};
+
+static bool isEmpty(const BBox& b) {
+    return b.pMin.x > b.pMax.x || b.pMin.y > b.pMax.y || b.pMin.z > b.pMax.z;
+}
+
+static BBox overlap(const BBox& a, const BBox& b) {
+    BBox rv;
+    for (int i = 0; i < 3; ++i) {
+        rv.pMin[i] = std::max(a.pMin[i], b.pMin[i]);
+        rv.pMax[i] = std::min(a.pMax[i], b.pMax[i]);
+    }
+    return rv;
+}
+
+struct BucketComparator {
+    BucketComparator(int d, int s, const BBox& c):
+        dim(d), splitBucket(s), centersUnion(c) {}
+    int dim;
+    int splitBucket;
+    const BBox& centersUnion;
+    bool operator()(const BVHPrimitiveInfo& b) const {
+        return bucketIndex(b.center, centersUnion, dim) <= splitBucket;
+    }
+
+    static int bucketIndex(const Vector3& center,
+        const BBox& centersUnion, int dim) {
+        int b = (int)(sSAHBucketsNum *
+            ((center[dim] - centersUnion.pMin[dim]) /
+            (centersUnion.pMax[dim] - centersUnion.pMin[dim])));
+        return clamp(b, 0, sSAHBucketsNum - 1);
+    }
+};
+
+// the top levels of a parallel build, the subtrees below them are built
+// by BVHBuildTask and stitched back in DFS order
+struct BVHTopLevelNode {
+    BVHTopLevelNode(): secondChild(0), axis(0), subtreeTask(-1) {}
+    BBox bbox;
+    uint32_t secondChild;
+    int axis;
+    int subtreeTask;
+};
+
+class BVHBuildTask : public Task {
+public:
+    BVHBuildTask(const BVH* bvh, std::vector<BVHPrimitiveInfo>& buildData,
+        uint32_t start, uint32_t end):
+        mBVH(bvh), mBuildData(buildData), mStart(start), mEnd(end) {}
+
+    void run(TLSPtr& tls) {
+        mNodes.reserve(2 * (mEnd - mStart) - 1);
+        mOrderedIndices.reserve(mEnd - mStart);
+        mBVH->buildLinearBVH(mBuildData, mStart, mEnd,
+            mNodes, mOrderedIndices);
+    }
+
+    CompactBVHNodeList mNodes;
+    std::vector<uint32_t> mOrderedIndices;
+
+private:
+    const BVH* mBVH;
+    std::vector<BVHPrimitiveInfo>& mBuildData;
+    uint32_t mStart;
+    uint32_t mEnd;
+};
+
 struct PointsComparator {
     PointsComparator(int d): dim(d) {}
     int dim;
@@ -31,10 +231,122 @@ struct PointsComparator {
     }
 };
 
+WideBVHNode::WideBVHNode() {
+    for (int axis = 0; axis < 3; ++axis) {
+        for (int i = 0; i < 4; ++i) {
+            bounds[axis * 2][i] = INFINITY;
+            bounds[axis * 2 + 1][i] = -INFINITY;
+        }
+    }
+    for (int i = 0; i < 4; ++i) {
+        child[i].firstPrimIndex = 0;
+        primitivesNum[i] = 0;
+    }
+    memset(pad, 0, sizeof(pad));
+}
+
+void WideBVHNode::setChild(int i, const CompactBVHNode& node) {
+    for (int axis = 0; axis < 3; ++axis) {
+        bounds[axis * 2][i] = node.bbox.pMin[axis];
+        bounds[axis * 2 + 1][i] = node.bbox.pMax[axis];
+    }
+    primitivesNum[i] = node.primitivesNum;
+    if (node.primitivesNum > 0) {
+        child[i].firstPrimIndex = node.firstPrimIndex;
+    }
+}
+
+QuantizedBVHNode::QuantizedBVHNode(): childrenNum(0) {
+    for (int axis = 0; axis < 3; ++axis) {
+        origin[axis] = 0.0f;
+        scaleExponent[axis] = 127;
+        for (int i = 0; i < 4; ++i) {
+            quantizedMin[axis][i] = 0;
+            quantizedMax[axis][i] = 0;
+        }
+    }
+    for (int i = 0; i < 4; ++i) {
+        child[i].firstPrimIndex = 0;
+        primitivesNum[i] = 0;
+    }
+    memset(pad, 0, sizeof(pad));
+}
+
+static inline float exponentToScale(uint8_t exponent) {
+    uint32_t bits = static_cast<uint32_t>(exponent) << 23;
+    float scale;
+    memcpy(&scale, &bits, sizeof(scale));
+    return scale;
+}
+
+float QuantizedBVHNode::decode(int axis, int isMax, int i) const {
+    uint8_t q = isMax ? quantizedMax[axis][i] : quantizedMin[axis][i];
+    return origin[axis] + (float)q * exponentToScale(scaleExponent[axis]);
+}
+
+void QuantizedBVHNode::setBounds(const BBox childBounds[4], int n) {
+    childrenNum = static_cast<uint8_t>(n);
+    BBox nodeBound;
+    for (int i = 0; i < n; ++i) {
+        nodeBound.expand(childBounds[i]);
+    }
+    for (int axis = 0; axis < 3; ++axis) {
+        origin[axis] = nodeBound.pMin[axis];
+        // smallest power of 2 step that still reaches the node max
+        float extent = nodeBound.pMax[axis] - nodeBound.pMin[axis];
+        int exponent = extent > 0.0f ?
+            (int)std::ceil(std::log2(extent / 255.0f)) : -126;
+        exponent = clamp(exponent, -126, 127);
+        while (exponent < 127 && origin[axis] + 255.0f *
+            exponentToScale(exponent + 127) < nodeBound.pMax[axis]) {
+            ++exponent;
+        }
+        scaleExponent[axis] = static_cast<uint8_t>(exponent + 127);
+        float scale = exponentToScale(scaleExponent[axis]);
+        for (int i = 0; i < 4; ++i) {
+            if (i >= n) {
+                quantizedMin[axis][i] = 0;
+                quantizedMax[axis][i] = 0;
+                continue;
+            }
+            // round outward, then fix up the float rounding of the
+            // decode so the child bound is never shrunk
+            float lo = (childBounds[i].pMin[axis] - origin[axis]) / scale;
+            float hi = (childBounds[i].pMax[axis] - origin[axis]) / scale;
+            int qMin = clamp((int)std::floor(lo), 0, 255);
+            int qMax = clamp((int)std::ceil(hi), 0, 255);
+            quantizedMin[axis][i] = static_cast<uint8_t>(qMin);
+            quantizedMax[axis][i] = static_cast<uint8_t>(qMax);
+            while (qMin > 0 &&
+                decode(axis, 0, i) > childBounds[i].pMin[axis]) {
+                quantizedMin[axis][i] = static_cast<uint8_t>(--qMin);
+            }
+            while (qMax < 255 &&
+                decode(axis, 1, i) < childBounds[i].pMax[axis]) {
+                quantizedMax[axis][i] = static_cast<uint8_t>(++qMax);
+            }
+        }
+    }
+}
+
+void QuantizedBVHNode::setChild(int i, const CompactBVHNode& node) {
+    primitivesNum[i] = node.primitivesNum;
+    if (node.primitivesNum > 0) {
+        child[i].firstPrimIndex = node.firstPrimIndex;
+    }
+}
+
 BVH::BVH(const PrimitiveList& primitives, int maxPrimitivesNum,
-    const std::string& splitMethod):
-	mSplitMethod(EqualCount),
-    mMaxPrimitivesNum(maxPrimitivesNum) {
+    const std::string& splitMethod, int threadNum,
+    const std::string& layout, float spatialSplitBudget,
+    const std::string& nodeOrder):
+    mMaxPrimitivesNum(maxPrimitivesNum), mSplitMethod(EqualCount),
+    mLayout(layout == "wide" ? Wide :
+        (layout == "quantized" ? Quantized : Binary)),
+    mNodeOrder(nodeOrder == "dfs" ? DepthFirst : Treelet),
+    mSpatialSplitBudget(spatialSplitBudget), mMesh(nullptr),
+    mNodes(nullptr), mNodesNum(0),
+    mFlatTriangles(nullptr), mFlatTrianglesNum(0) {
 
 	for (size_t i = 0; i < primitives.size(); ++i) {
 		const Primitive* primitive = primitives[i];
@@ -52,13 +364,6 @@ BVH::BVH(const PrimitiveList& primitives, int maxPrimitivesNum,
     if (mRefinedPrimitives.size() == 0) {
         return;
     }
-    if (splitMethod == "middle") {
-        mSplitMethod = Middle;
-    } else if (splitMethod == "equal_count") {
-        mSplitMethod = EqualCount;
-    } else {
-        mSplitMethod = EqualCount;
-    }
     // collect BVHPrimitiveInfo list for the recusive BVH construction
     std::vector<BVHPrimitiveInfo> buildInfoList;
     buildInfoList.reserve(mRefinedPrimitives.size());
@@ -66,87 +371,1074 @@ BVH::BVH(const PrimitiveList& primitives, int maxPrimitivesNum,
         BBox b = mRefinedPrimitives[i]->getAABB();
         buildInfoList.push_back(BVHPrimitiveInfo(b, static_cast<int>(i)));
     }
-    //buildDataSummary(buildInfoList);
-    PrimitiveList orderedPrims;
-    orderedPrims.reserve(mRefinedPrimitives.size());
-    mBVHNodes.reserve(2 * mRefinedPrimitives.size() - 1);
-    uint32_t offset = 0;
-    buildLinearBVH(buildInfoList, 0, static_cast<uint32_t>(buildInfoList.size()),
-        &offset, orderedPrims);
+    std::vector<uint32_t> orderedIndices;
+    build(buildInfoList, splitMethod, threadNum, orderedIndices);
+    PrimitiveList orderedPrims(orderedIndices.size());
+    for (size_t i = 0; i < orderedIndices.size(); ++i) {
+        orderedPrims[i] = mRefinedPrimitives[orderedIndices[i]];
+    }
     mRefinedPrimitives.swap(orderedPrims);
-    //compactSummary();
+    bindStorage();
+    computeReport(static_cast<uint32_t>(mRefinedPrimitives.size()));
+    buildLayout();
+}
+
+BVH::BVH(const PolygonMesh* mesh, int maxPrimitivesNum,
+    const std::string& splitMethod, int threadNum,
+    const std::string& layout, float spatialSplitBudget,
+    const std::string& cacheDir, const std::string& nodeOrder):
+    mMaxPrimitivesNum(maxPrimitivesNum), mSplitMethod(EqualCount),
+    mLayout(layout == "wide" ? Wide :
+        (layout == "quantized" ? Quantized : Binary)),
+    mNodeOrder(nodeOrder == "dfs" ? DepthFirst : Treelet),
+    mSpatialSplitBudget(spatialSplitBudget), mMesh(mesh),
+    mNodes(nullptr), mNodesNum(0),
+    mFlatTriangles(nullptr), mFlatTrianglesNum(0) {
+    size_t trianglesNum = mMesh->getTrianglesNum();
+    if (trianglesNum == 0) {
+        return;
+    }
+    std::string cacheFile;
+    uint64_t key = 0;
+    if (!cacheDir.empty()) {
+        key = hashMesh(splitMethod);
+        std::stringstream ss;
+        ss << cacheDir << "/" << std::hex << std::setw(16) <<
+            std::setfill('0') << key << ".bvh";
+        cacheFile = ss.str();
+        if (loadCache(cacheFile, key)) {
+            computeReport(static_cast<uint32_t>(trianglesNum));
+            buildLayout();
+            return;
+        }
+    }
+    std::vector<BVHPrimitiveInfo> buildInfoList;
+    buildInfoList.reserve(trianglesNum);
+    for (size_t i = 0; i < trianglesNum; ++i) {
+        const TriangleIndex* ti = mMesh->getFacePtr(i);
+        BBox b;
+        for (int j = 0; j < 3; ++j) {
+            b.expand(mMesh->getVertexPtr(ti->v[j])->position);
+        }
+        mAABB.expand(b);
+        buildInfoList.push_back(BVHPrimitiveInfo(b, static_cast<int>(i)));
+    }
+    std::vector<uint32_t> orderedIndices;
+    build(buildInfoList, splitMethod, threadNum, orderedIndices);
+    // store the triangles in BVH order so a leaf reads one contiguous
+    // block instead of chasing index buffer and vertex buffer
+    mTriangles.resize(orderedIndices.size());
+    for (size_t i = 0; i < orderedIndices.size(); ++i) {
+        const TriangleIndex* ti = mMesh->getFacePtr(orderedIndices[i]);
+        const Vector3& p0 = mMesh->getVertexPtr(ti->v[0])->position;
+        const Vector3& p1 = mMesh->getVertexPtr(ti->v[1])->position;
+        const Vector3& p2 = mMesh->getVertexPtr(ti->v[2])->position;
+        mTriangles[i].p0 = p0;
+        mTriangles[i].e1 = p1 - p0;
+        mTriangles[i].e2 = p2 - p0;
+        mTriangles[i].triangleIndex = orderedIndices[i];
+    }
+    bindStorage();
+    // saved before the layout, the quantized one drops the binary nodes
+    if (!cacheFile.empty()) {
+        saveCache(cacheFile, key);
+    }
+    computeReport(static_cast<uint32_t>(trianglesNum));
+    buildLayout();
+}
+
+BVH::~BVH() {}
+
+TraversalStats& threadTraversalStats() {
+    static thread_local TraversalStats stats;
+    return stats;
+}
+
+RayCounts& threadRayCounts() {
+    static thread_local RayCounts counts;
+    return counts;
+}
+
+void BVH::getNodeFetchStats(uint64_t* fetches, uint64_t* misses) {
+#ifdef GOBLIN_BVH_FETCH_STATS
+    // the calling thread is still alive, add what it has not flushed
+    *fetches = sNodeFetches + sNodeFetchCache.fetches;
+    *misses = sNodeFetchMisses + sNodeFetchCache.misses;
+#else
+    *fetches = 0;
+    *misses = 0;
+#endif
+}
+
+void BVH::build(std::vector<BVHPrimitiveInfo>& buildInfoList,
+    const std::string& splitMethod, int threadNum,
+    std::vector<uint32_t>& orderedIndices) {
+    // leaf primitives number is stored in an uint8_t
+    mMaxPrimitivesNum = clamp(mMaxPrimitivesNum, 1, 255);
+    if (splitMethod == "middle") {
+        mSplitMethod = Middle;
+    } else if (splitMethod == "equal_count") {
+        mSplitMethod = EqualCount;
+    } else if (splitMethod == "sah") {
+        mSplitMethod = SAH;
+    } else if (splitMethod == "sbvh") {
+        mSplitMethod = SBVH;
+    } else {
+        mSplitMethod = EqualCount;
+    }
+    orderedIndices.reserve(buildInfoList.size());
+    mBVHNodes.reserve(2 * buildInfoList.size() - 1);
+    uint32_t primitivesNum = static_cast<uint32_t>(buildInfoList.size());
+    if (mSplitMethod == SBVH) {
+        // references get duplicated so the in place range partition
+        // the parallel build relies on doesn't apply, build serially
+        BBox rootBBox;
+        for (uint32_t i = 0; i < primitivesNum; ++i) {
+            rootBBox.expand(buildInfoList[i].bbox);
+        }
+        uint32_t duplicateBudget = static_cast<uint32_t>(
+            mSpatialSplitBudget * primitivesNum);
+        buildSpatialBVH(buildInfoList, rootBBox.surfaceArea(),
+            &duplicateBudget, mBVHNodes, orderedIndices);
+    } else if (threadNum <= 1 || primitivesNum < sParallelBuildThreshold) {
+        buildLinearBVH(buildInfoList, 0, primitivesNum,
+            mBVHNodes, orderedIndices);
+    } else {
+        // split up the top levels serially till there are a few
+        // subtrees per thread, build the subtrees in parallel, then
+        // stitch them back to the flatten DFS array
+        int depth = 0;
+        while ((1 << depth) < 4 * threadNum) {
+            depth++;
+        }
+        std::vector<BVHTopLevelNode> topNodes;
+        std::vector<Task*> subtreeTasks;
+        buildTopLevels(buildInfoList, 0, primitivesNum, depth,
+            topNodes, subtreeTasks);
+        ThreadPool threadPool(threadNum);
+        threadPool.enqueue(subtreeTasks);
+        threadPool.waitForAll();
+        stitchTopLevels(topNodes, 0, subtreeTasks, orderedIndices);
+        for (size_t i = 0; i < subtreeTasks.size(); ++i) {
+            delete subtreeTasks[i];
+        }
+        subtreeTasks.clear();
+    }
+    reorderNodes();
+}
+
+uint32_t BVH::placeChildren(uint32_t nodeNum,
+    CompactBVHNodeList& ordered, uint32_t parent,
+    uint32_t* nextOffset) const {
+    // ordered[parent] is the copy of the DFS node nodeNum
+    uint32_t offset = *nextOffset;
+    *nextOffset += 2;
+    ordered[offset] = mBVHNodes[nodeNum + 1];
+    ordered[offset + 1] = mBVHNodes[mBVHNodes[nodeNum].secondChildOffset];
+    ordered[parent].secondChildOffset = offset + 1;
+    return offset;
+}
+
+void BVH::reorderDepthFirst(uint32_t nodeNum,
+    CompactBVHNodeList& ordered, uint32_t orderedNum,
+    uint32_t* nextOffset) const {
+    const CompactBVHNode& node = mBVHNodes[nodeNum];
+    if (node.primitivesNum > 0) {
+        return;
+    }
+    uint32_t offset = placeChildren(nodeNum, ordered, orderedNum,
+        nextOffset);
+    reorderDepthFirst(nodeNum + 1, ordered, offset, nextOffset);
+    reorderDepthFirst(node.secondChildOffset, ordered, offset + 1,
+        nextOffset);
+}
+
+void BVH::reorderNodes() {
+    if (mBVHNodes.size() <= 1) {
+        return;
+    }
+    // root goes alone, the pairs start at 1 and NodeAllocator lines
+    // them up with the cache lines
+    CompactBVHNodeList ordered(mBVHNodes.size());
+    ordered[0] = mBVHNodes[0];
+    uint32_t nextOffset = 1;
+    if (mNodeOrder == DepthFirst) {
+        reorderDepthFirst(0, ordered, 0, &nextOffset);
+        mBVHNodes.swap(ordered);
+        return;
+    }
+    // (DFS index, ordered index) of the interior nodes whose children
+    // are not placed yet
+    typedef std::pair<uint32_t, uint32_t> NodeSlot;
+    std::vector<NodeSlot> treeletRoots;
+    treeletRoots.push_back(NodeSlot(0, 0));
+    std::vector<std::pair<float, NodeSlot> > frontier;
+    while (!treeletRoots.empty()) {
+        NodeSlot root = treeletRoots.back();
+        treeletRoots.pop_back();
+        if (mBVHNodes[root.first].primitivesNum > 0) {
+            continue;
+        }
+        // grow the treelet from the root, the children of the node with
+        // the largest surface area are the most likely to be fetched
+        frontier.clear();
+        frontier.push_back(std::make_pair(
+            mBVHNodes[root.first].bbox.surfaceArea(), root));
+        int pairsNum = 0;
+        while (!frontier.empty() && pairsNum < sTreeletPairsNum) {
+            std::pop_heap(frontier.begin(), frontier.end());
+            NodeSlot slot = frontier.back().second;
+            frontier.pop_back();
+            uint32_t offset = placeChildren(slot.first, ordered, slot.second,
+                &nextOffset);
+            ++pairsNum;
+            uint32_t children[2] = {slot.first + 1,
+                mBVHNodes[slot.first].secondChildOffset};
+            for (int i = 0; i < 2; ++i) {
+                const CompactBVHNode& child = mBVHNodes[children[i]];
+                if (child.primitivesNum == 0) {
+                    frontier.push_back(std::make_pair(
+                        child.bbox.surfaceArea(),
+                        NodeSlot(children[i], offset + i)));
+                    std::push_heap(frontier.begin(), frontier.end());
+                }
+            }
+        }
+        // whatever is left on the frontier roots the next treelets,
+        // pushed smallest first so the largest one follows right after
+        std::sort(frontier.begin(), frontier.end());
+        for (size_t i = 0; i < frontier.size(); ++i) {
+            treeletRoots.push_back(frontier[i].second);
+        }
+    }
+    mBVHNodes.swap(ordered);
+}
+
+void BVH::computeReport(uint32_t primitivesNum) {
+    mReport = BVHReport();
+    mReport.primitivesNum = primitivesNum;
+    if (mNodesNum == 0) {
+        return;
+    }
+    float rootArea = mNodes[0].bbox.surfaceArea();
+    float invRootArea = rootArea > 0.0f ? 1.0f / rootArea : 0.0f;
+    double overlapSum = 0.0;
+    // (node, depth) pairs still to visit
+    std::vector<std::pair<uint32_t, uint32_t> > todo;
+    todo.push_back(std::make_pair(0u, 0u));
+    while (!todo.empty()) {
+        uint32_t nodeNum = todo.back().first;
+        uint32_t depth = todo.back().second;
+        todo.pop_back();
+        const CompactBVHNode& node = mNodes[nodeNum];
+        float area = node.bbox.surfaceArea() * invRootArea;
+        mReport.maxDepth = std::max(mReport.maxDepth, depth);
+        if (node.primitivesNum > 0) {
+            ++mReport.leavesNum;
+            mReport.referencesNum += node.primitivesNum;
+            mReport.sahCost += sIntersectCost * node.primitivesNum * area;
+            if (mReport.leafSizeHistogram.size() <= node.primitivesNum) {
+                mReport.leafSizeHistogram.resize(node.primitivesNum + 1, 0);
+            }
+            ++mReport.leafSizeHistogram[node.primitivesNum];
+            if (mReport.leafDepthHistogram.size() <= depth) {
+                mReport.leafDepthHistogram.resize(depth + 1, 0);
+            }
+            ++mReport.leafDepthHistogram[depth];
+            continue;
+        }
+        ++mReport.interiorNodesNum;
+        mReport.sahCost += sTraversalCost * area;
+        const BBox& b0 = mNodes[node.secondChildOffset - 1].bbox;
+        const BBox& b1 = mNodes[node.secondChildOffset].bbox;
+        BBox overlap;
+        bool isEmpty = false;
+        for (int i = 0; i < 3; ++i) {
+            overlap.pMin[i] = std::max(b0.pMin[i], b1.pMin[i]);
+            overlap.pMax[i] = std::min(b0.pMax[i], b1.pMax[i]);
+            isEmpty |= overlap.pMin[i] > overlap.pMax[i];
+        }
+        float parentArea = node.bbox.surfaceArea();
+        if (!isEmpty && parentArea > 0.0f) {
+            float ratio = overlap.surfaceArea() / parentArea;
+            overlapSum += ratio;
+            mReport.maxOverlap = std::max(mReport.maxOverlap, ratio);
+        }
+        todo.push_back(std::make_pair(node.secondChildOffset - 1, depth + 1));
+        todo.push_back(std::make_pair(node.secondChildOffset, depth + 1));
+    }
+    if (mReport.interiorNodesNum > 0) {
+        mReport.meanOverlap =
+            static_cast<float>(overlapSum / mReport.interiorNodesNum);
+    }
+}
+
+BVHReport BVH::getReport() const {
+    BVHReport report = mReport;
+    report.binaryNodesBytes = mNodesNum * sizeof(CompactBVHNode);
+    report.wideNodesBytes = mWideBVHNodes.size() * sizeof(WideBVHNode) +
+        mQuantizedBVHNodes.size() * sizeof(QuantizedBVHNode);
+    report.trianglesBytes = mFlatTrianglesNum * sizeof(FlatTriangle);
+    report.primitivesBytes = mRefinedPrimitives.size() * sizeof(Primitive*);
+    report.mappedFromCache = mCacheFile != nullptr;
+    return report;
+}
+
+void BVH::bindStorage() {
+    mNodes = mBVHNodes.empty() ? nullptr : &mBVHNodes[0];
+    mNodesNum = mBVHNodes.size();
+    mFlatTriangles = mTriangles.empty() ? nullptr : &mTriangles[0];
+    mFlatTrianglesNum = mTriangles.size();
+}
+
+uint64_t BVH::hashMesh(const std::string& splitMethod) const {
+    // 64 bit FNV-1a
+    uint64_t hash = 14695981039346656037ULL;
+    auto hashBytes = [&hash](const void* data, size_t size) {
+        const unsigned char* bytes = static_cast<const unsigned char*>(data);
+        for (size_t i = 0; i < size; ++i) {
+            hash ^= bytes[i];
+            hash *= 1099511628211ULL;
+        }
+    };
+    size_t trianglesNum = mMesh->getTrianglesNum();
+    hashBytes(&trianglesNum, sizeof(trianglesNum));
+    for (size_t i = 0; i < trianglesNum; ++i) {
+        const TriangleIndex* ti = mMesh->getFacePtr(i);
+        hashBytes(ti->v, sizeof(ti->v));
+        for (int j = 0; j < 3; ++j) {
+            const Vector3& p = mMesh->getVertexPtr(ti->v[j])->position;
+            hashBytes(&p.x, 3 * sizeof(float));
+        }
+    }
+    // thread number is left out since the parallel build gives the
+    // same tree as the serial one, layout is derived after loading
+    hashBytes(splitMethod.c_str(), splitMethod.size());
+    hashBytes(&mMaxPrimitivesNum, sizeof(mMaxPrimitivesNum));
+    hashBytes(&mSpatialSplitBudget, sizeof(mSpatialSplitBudget));
+    hashBytes(&mNodeOrder, sizeof(mNodeOrder));
+    return hash;
+}
+
+bool BVH::loadCache(const std::string& filename, uint64_t key) {
+    std::unique_ptr<MappedFile> file(new MappedFile());
+    if (!file->open(filename)) {
+        return false;
+    }
+    const BVHCacheHeader* header =
+        reinterpret_cast<const BVHCacheHeader*>(file->getData());
+    if (file->getSize() < sizeof(BVHCacheHeader) ||
+        memcmp(header->magic, sBVHCacheMagic, sizeof(sBVHCacheMagic)) != 0 ||
+        header->version != sBVHCacheVersion ||
+        header->nodeSize != sizeof(CompactBVHNode) ||
+        header->triangleSize != sizeof(FlatTriangle)) {
+        std::cerr << "BVH cache " << filename <<
+            " is in an unknown format, rebuild\n";
+        return false;
+    }
+    size_t expectedSize = sizeof(BVHCacheHeader) +
+        header->nodesNum * sizeof(CompactBVHNode) +
+        header->trianglesNum * sizeof(FlatTriangle);
+    if (header->key != key || header->nodesNum == 0 ||
+        file->getSize() != expectedSize) {
+        std::cerr << "BVH cache " << filename << " is stale, rebuild\n";
+        return false;
+    }
+    // used in place, nothing is copied out of the mapping
+    mNodes = reinterpret_cast<const CompactBVHNode*>(
+        file->getData() + sizeof(BVHCacheHeader));
+    mNodesNum = header->nodesNum;
+    mFlatTriangles = reinterpret_cast<const FlatTriangle*>(
+        mNodes + mNodesNum);
+    mFlatTrianglesNum = header->trianglesNum;
+    mAABB = mNodes[0].bbox;
+    mCacheFile = std::move(file);
+    std::cout << "load BVH cache " << filename << std::endl;
+    return true;
+}
+
+void BVH::saveCache(const std::string& filename, uint64_t key) const {
+    BVHCacheHeader header;
+    memcpy(header.magic, sBVHCacheMagic, sizeof(sBVHCacheMagic));
+    header.version = sBVHCacheVersion;
+    header.key = key;
+    header.nodesNum = static_cast<uint32_t>(mNodesNum);
+    header.trianglesNum = static_cast<uint32_t>(mFlatTrianglesNum);
+    header.nodeSize = sizeof(CompactBVHNode);
+    header.triangleSize = sizeof(FlatTriangle);
+    // write aside and rename so a concurrent run never maps a partial
+    // file, the content for the same key is always the same anyway
+    std::string tmpFilename = filename + ".tmp";
+    std::ofstream stream(tmpFilename.c_str(),
+        std::ios::out | std::ios::binary);
+    if (!stream.is_open()) {
+        std::cerr << "fail to write BVH cache " << filename << std::endl;
+        return;
+    }
+    stream.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    stream.write(reinterpret_cast<const char*>(mNodes),
+        mNodesNum * sizeof(CompactBVHNode));
+    stream.write(reinterpret_cast<const char*>(mFlatTriangles),
+        mFlatTrianglesNum * sizeof(FlatTriangle));
+    stream.close();
+    if (stream.fail()) {
+        std::cerr << "fail to write BVH cache " << filename << std::endl;
+        std::remove(tmpFilename.c_str());
+        return;
+    }
+    replaceFile(tmpFilename, filename);
+}
+
+void BVH::buildLayout() {
+    if (mLayout == Wide) {
+        mWideBVHNodes.clear();
+        mWideBVHNodes.reserve(mNodesNum / 2 + 1);
+        if (mNodes[0].primitivesNum > 0) {
+            // single leaf tree, hang it under a wide root anyway
+            mWideBVHNodes.push_back(WideBVHNode());
+            mWideBVHNodes[0].setChild(0, mNodes[0]);
+        } else {
+            buildWideBVH(0);
+        }
+    } else if (mLayout == Quantized) {
+        mQuantizedBVHNodes.clear();
+        mQuantizedBVHNodes.reserve(mNodesNum / 2 + 1);
+        if (mNodes[0].primitivesNum > 0) {
+            mQuantizedBVHNodes.push_back(QuantizedBVHNode());
+            mQuantizedBVHNodes[0].setBounds(&mNodes[0].bbox, 1);
+            mQuantizedBVHNodes[0].setChild(0, mNodes[0]);
+        } else {
+            buildQuantizedBVH(0);
+        }
+        mQuantizedBVHNodes.shrink_to_fit();
+        CompactBVHNodeList().swap(mBVHNodes);
+        mNodes = nullptr;
+        mNodesNum = 0;
+    }
+}
+
+void BVH::refit() {
+    if (mCacheFile) {
+        // the mapped cache is read only, refit a private copy of it
+        if (mNodes) {
+            mBVHNodes.assign(mNodes, mNodes + mNodesNum);
+        }
+        mTriangles.assign(mFlatTriangles,
+            mFlatTriangles + mFlatTrianglesNum);
+        bindStorage();
+        mCacheFile.reset();
+    }
+    if (mMesh) {
+        for (size_t i = 0; i < mTriangles.size(); ++i) {
+            const TriangleIndex* ti =
+                mMesh->getFacePtr(mTriangles[i].triangleIndex);
+            const Vector3& p0 = mMesh->getVertexPtr(ti->v[0])->position;
+            const Vector3& p1 = mMesh->getVertexPtr(ti->v[1])->position;
+            const Vector3& p2 = mMesh->getVertexPtr(ti->v[2])->position;
+            mTriangles[i].p0 = p0;
+            mTriangles[i].e1 = p1 - p0;
+            mTriangles[i].e2 = p2 - p0;
+        }
+    }
+    if (mLayout == Quantized) {
+        if (!mQuantizedBVHNodes.empty()) {
+            mAABB = refitQuantized(0);
+        }
+        return;
+    }
+    if (mNodesNum == 0) {
+        return;
+    }
+    // children always sit after their parent in the DFS order, so one
+    // backward sweep updates the whole tree bottom up
+    for (size_t i = mBVHNodes.size(); i-- > 0;) {
+        CompactBVHNode& node = mBVHNodes[i];
+        BBox bbox;
+        if (node.primitivesNum > 0) {
+            // spatial split leaves get the full primitive bounds back
+            bbox = leafBound(node.firstPrimIndex, node.primitivesNum);
+        } else {
+            bbox = mBVHNodes[node.secondChildOffset - 1].bbox;
+            bbox.expand(mBVHNodes[node.secondChildOffset].bbox);
+        }
+        node.bbox = bbox;
+    }
+    mAABB = mBVHNodes[0].bbox;
+    buildLayout();
 }
 
 uint32_t BVH::buildLinearBVH(std::vector<BVHPrimitiveInfo> &buildData,
-    uint32_t start, uint32_t end, uint32_t* offset,
-    PrimitiveList& orderedPrims) {
-    mBVHNodes.push_back(CompactBVHNode());
-    uint32_t nodeOffset = (*offset)++;
-    CompactBVHNode& node = mBVHNodes[nodeOffset];
+    uint32_t start, uint32_t end, CompactBVHNodeList& nodes,
+    std::vector<uint32_t>& orderedIndices) const {
+    nodes.push_back(CompactBVHNode());
+    uint32_t nodeOffset = static_cast<uint32_t>(nodes.size() - 1);
 
     BBox bbox;
     for (uint32_t i = start; i < end; ++i) {
         bbox.expand(buildData[i].bbox);
     }
+    uint32_t mid;
+    int dim;
+    if (!splitNode(buildData, start, end, bbox, &mid, &dim)) {
+        initLeaf(buildData, start, end, bbox, nodes[nodeOffset],
+            orderedIndices);
+        return nodeOffset;
+    }
+    buildLinearBVH(buildData, start, mid, nodes, orderedIndices);
+    uint32_t secondChildOffset = buildLinearBVH(buildData,
+        mid, end, nodes, orderedIndices);
+    nodes[nodeOffset].initInteror(bbox, secondChildOffset, dim);
+    return nodeOffset;
+}
+
+bool BVH::splitNode(std::vector<BVHPrimitiveInfo> &buildData,
+    uint32_t start, uint32_t end, const BBox& bbox,
+    uint32_t* mid, int* dim) const {
     uint32_t primitivesNum = end - start;
-    // leaf node case
-    if (primitivesNum == 1) {
-        uint32_t firstPrimIndex = static_cast<uint32_t>(orderedPrims.size());
-        //leafSummary(buildData, start, end, firstPrimIndex, primitivesNum);
-        for (uint32_t i = start; i < end; ++i) {
-            uint32_t pIndex = buildData[i].primitiveIndexNum;
-            orderedPrims.push_back(mRefinedPrimitives[pIndex]);
+    // leaf node case, SAH lets its cost model decide the leaf size
+    // instead of forcing it here
+    if (primitivesNum == 1 ||
+        (mSplitMethod != SAH && primitivesNum <= (uint32_t)mMaxPrimitivesNum)) {
+        return false;
+    }
+    BBox centersUnion;
+    for (uint32_t i = start; i < end; ++i) {
+        centersUnion.expand(buildData[i].center);
+    }
+    // pick the axis with largest variant to split
+    *dim = centersUnion.longestAxis();
+    // all primitives clutter in one point... should be a rare case
+    // just make this a leaf node then
+    bool sameCenters = centersUnion.pMin[*dim] == centersUnion.pMax[*dim];
+    if (sameCenters && primitivesNum <= 255) {
+        return false;
+    }
+    *mid = (start + end) / 2;
+    // split interior node by specified split method
+    switch (mSplitMethod) {
+    case SAH: {
+        if (sameCenters) {
+            // no way to bucket these, chop them with equal count
+            std::nth_element(&buildData[start], &buildData[*mid],
+                &buildData[end - 1] + 1, PointsComparator(*dim));
+            break;
         }
-        node.initLeaf(bbox, firstPrimIndex, primitivesNum);
-    } else {
-        BBox centersUnion;
-        for (uint32_t i = start; i < end; ++i) {
-            centersUnion.expand(buildData[i].center);
-        }
-        // pick the axis with largest variant to split
-        int dim = centersUnion.longestAxis();
-        // all primitives clutter in one point... should be a rare case
-        // just make this a leaf node then
-        if (centersUnion.pMin[dim] == centersUnion.pMax[dim]) {
-            uint32_t firstPrimIndex = static_cast<uint32_t>(orderedPrims.size());
-            //leafSummary(buildData, start, end,
-            //    firstPrimIndex, primitivesNum);
-            for (uint32_t i = start; i < end; ++i) {
-                uint32_t pIndex = buildData[i].primitiveIndexNum;
-                orderedPrims.push_back(mRefinedPrimitives[pIndex]);
-            }
-            node.initLeaf(bbox, firstPrimIndex, primitivesNum);
-            return nodeOffset;
-        }
-        uint32_t mid = (start + end) / 2;
-        // split interior node by specified split method
-        switch (mSplitMethod) {
-        case Middle: {
-            float midPoint = 0.5f * (centersUnion.pMin[dim] +
-                centersUnion.pMax[dim]);
-            BVHPrimitiveInfo* midPtr = std::partition(&buildData[start],
-                &buildData[end - 1] + 1, MidComparator(dim, midPoint));
-            mid = (uint32_t)(midPtr - &buildData[0]);
-            // can't split down further with middle method, let the
-            // following split methods handle this case then
-            if (start!= mid && end != mid) {
-                break;
+        if (!splitSAH(buildData, start, end, bbox, centersUnion,
+            *dim, mid)) {
+            return false;
+        }
+        break;
+    }
+    case Middle: {
+        float midPoint = 0.5f * (centersUnion.pMin[*dim] +
+            centersUnion.pMax[*dim]);
+        BVHPrimitiveInfo* midPtr = std::partition(&buildData[start],
+            &buildData[end - 1] + 1, MidComparator(*dim, midPoint));
+        *mid = (uint32_t)(midPtr - &buildData[0]);
+        // can't split down further with middle method, let the
+        // following split methods handle this case then
+        if (start != *mid && end != *mid) {
+            break;
+        }
+    }
+    case EqualCount: default: {
+        *mid = (start + end) / 2;
+        std::nth_element(&buildData[start], &buildData[*mid],
+            &buildData[end - 1] + 1, PointsComparator(*dim));
+        break;
+    }
+    }
+    return true;
+}
+
+void BVH::buildTopLevels(std::vector<BVHPrimitiveInfo> &buildData,
+    uint32_t start, uint32_t end, int depth,
+    std::vector<BVHTopLevelNode>& topNodes,
+    std::vector<Task*>& subtreeTasks) const {
+    uint32_t topOffset = static_cast<uint32_t>(topNodes.size());
+    topNodes.push_back(BVHTopLevelNode());
+    if (depth == 0 || end - start < sMinSubtreePrimitivesNum) {
+        topNodes[topOffset].subtreeTask =
+            static_cast<int>(subtreeTasks.size());
+        subtreeTasks.push_back(
+            new BVHBuildTask(this, buildData, start, end));
+        return;
+    }
+    BBox bbox;
+    for (uint32_t i = start; i < end; ++i) {
+        bbox.expand(buildData[i].bbox);
+    }
+    uint32_t mid;
+    int dim;
+    if (!splitNode(buildData, start, end, bbox, &mid, &dim)) {
+        // let the subtree task make this leaf, it comes up with the
+        // exact same decision
+        topNodes[topOffset].subtreeTask =
+            static_cast<int>(subtreeTasks.size());
+        subtreeTasks.push_back(
+            new BVHBuildTask(this, buildData, start, end));
+        return;
+    }
+    buildTopLevels(buildData, start, mid, depth - 1,
+        topNodes, subtreeTasks);
+    topNodes[topOffset].secondChild =
+        static_cast<uint32_t>(topNodes.size());
+    buildTopLevels(buildData, mid, end, depth - 1,
+        topNodes, subtreeTasks);
+    topNodes[topOffset].bbox = bbox;
+    topNodes[topOffset].axis = dim;
+}
+
+uint32_t BVH::stitchTopLevels(const std::vector<BVHTopLevelNode>& topNodes,
+    uint32_t topOffset, const std::vector<Task*>& subtreeTasks,
+    std::vector<uint32_t>& orderedIndices) {
+    const BVHTopLevelNode& topNode = topNodes[topOffset];
+    if (topNode.subtreeTask >= 0) {
+        // append the subtree in place and relocate its offsets, subtree
+        // is in DFS order itself so the result is the same as a
+        // serial build
+        const BVHBuildTask* task = static_cast<const BVHBuildTask*>(
+            subtreeTasks[topNode.subtreeTask]);
+        uint32_t nodeBase = static_cast<uint32_t>(mBVHNodes.size());
+        uint32_t primBase = static_cast<uint32_t>(orderedIndices.size());
+        for (size_t i = 0; i < task->mNodes.size(); ++i) {
+            CompactBVHNode node = task->mNodes[i];
+            if (node.primitivesNum > 0) {
+                node.firstPrimIndex += primBase;
+            } else {
+                node.secondChildOffset += nodeBase;
             }
+            mBVHNodes.push_back(node);
         }
-        case EqualCount: default: {
-            mid = (start + end) / 2;
-            std::nth_element(&buildData[start], &buildData[mid],
-                &buildData[end - 1] + 1, PointsComparator(dim));
+        orderedIndices.insert(orderedIndices.end(),
+            task->mOrderedIndices.begin(), task->mOrderedIndices.end());
+        return nodeBase;
+    }
+    mBVHNodes.push_back(CompactBVHNode());
+    uint32_t nodeOffset = static_cast<uint32_t>(mBVHNodes.size() - 1);
+    stitchTopLevels(topNodes, topOffset + 1, subtreeTasks, orderedIndices);
+    uint32_t secondChildOffset = stitchTopLevels(topNodes,
+        topNode.secondChild, subtreeTasks, orderedIndices);
+    mBVHNodes[nodeOffset].initInteror(topNode.bbox, secondChildOffset,
+        topNode.axis);
+    return nodeOffset;
+}
+
+BBox BVH::leafBound(uint32_t first, uint32_t num) const {
+    BBox bbox;
+    for (uint32_t j = first; j < first + num; ++j) {
+        if (mMesh) {
+            const FlatTriangle& t = mFlatTriangles[j];
+            bbox.expand(t.p0);
+            bbox.expand(t.p0 + t.e1);
+            bbox.expand(t.p0 + t.e2);
+        } else {
+            bbox.expand(mRefinedPrimitives[j]->getAABB());
+        }
+    }
+    return bbox;
+}
+
+BBox BVH::refitQuantized(uint32_t offset) {
+    BBox childBounds[4];
+    int childrenNum = mQuantizedBVHNodes[offset].childrenNum;
+    for (int i = 0; i < childrenNum; ++i) {
+        const QuantizedBVHNode& node = mQuantizedBVHNodes[offset];
+        if (node.primitivesNum[i] > 0) {
+            childBounds[i] = leafBound(node.child[i].firstPrimIndex,
+                node.primitivesNum[i]);
+        } else {
+            childBounds[i] = refitQuantized(node.child[i].wideChildOffset);
+        }
+    }
+    mQuantizedBVHNodes[offset].setBounds(childBounds, childrenNum);
+    BBox bbox;
+    for (int i = 0; i < childrenNum; ++i) {
+        bbox.expand(childBounds[i]);
+    }
+    return bbox;
+}
+
+uint32_t BVH::buildQuantizedBVH(uint32_t nodeNum) {
+    uint32_t offset = static_cast<uint32_t>(mQuantizedBVHNodes.size());
+    mQuantizedBVHNodes.push_back(QuantizedBVHNode());
+    uint32_t children[4];
+    int childrenNum = collectWideChildren(nodeNum, children);
+    BBox childBounds[4];
+    for (int i = 0; i < childrenNum; ++i) {
+        childBounds[i] = mNodes[children[i]].bbox;
+        mQuantizedBVHNodes[offset].setChild(i, mNodes[children[i]]);
+    }
+    mQuantizedBVHNodes[offset].setBounds(childBounds, childrenNum);
+    for (int i = 0; i < childrenNum; ++i) {
+        if (mNodes[children[i]].primitivesNum == 0) {
+            uint32_t childOffset = buildQuantizedBVH(children[i]);
+            mQuantizedBVHNodes[offset].child[i].wideChildOffset =
+                childOffset;
+        }
+    }
+    return offset;
+}
+
+int BVH::collectWideChildren(uint32_t nodeNum, uint32_t children[4]) const {
+    int childrenNum = 0;
+    children[childrenNum++] = mNodes[nodeNum].secondChildOffset - 1;
+    children[childrenNum++] = mNodes[nodeNum].secondChildOffset;
+    while (childrenNum < 4) {
+        int openIndex = -1;
+        float maxArea = -1.0f;
+        for (int i = 0; i < childrenNum; ++i) {
+            const CompactBVHNode& child = mNodes[children[i]];
+            if (child.primitivesNum == 0 &&
+                child.bbox.surfaceArea() > maxArea) {
+                maxArea = child.bbox.surfaceArea();
+                openIndex = i;
+            }
+        }
+        if (openIndex == -1) {
             break;
         }
+        uint32_t opened = children[openIndex];
+        children[openIndex] = mNodes[opened].secondChildOffset - 1;
+        children[childrenNum++] = mNodes[opened].secondChildOffset;
+    }
+    return childrenNum;
+}
+
+uint32_t BVH::buildWideBVH(uint32_t nodeNum) {
+    uint32_t wideOffset = static_cast<uint32_t>(mWideBVHNodes.size());
+    mWideBVHNodes.push_back(WideBVHNode());
+    uint32_t children[4];
+    int childrenNum = collectWideChildren(nodeNum, children);
+    for (int i = 0; i < childrenNum; ++i) {
+        const CompactBVHNode& child = mNodes[children[i]];
+        mWideBVHNodes[wideOffset].setChild(i, child);
+        if (child.primitivesNum == 0) {
+            uint32_t wideChildOffset = buildWideBVH(children[i]);
+            mWideBVHNodes[wideOffset].child[i].wideChildOffset =
+                wideChildOffset;
+        }
+    }
+    return wideOffset;
+}
+
+void BVH::initLeaf(const std::vector<BVHPrimitiveInfo> &buildData,
+    uint32_t start, uint32_t end, const BBox& bbox,
+    CompactBVHNode& node, std::vector<uint32_t>& orderedIndices) const {
+    uint32_t firstPrimIndex = static_cast<uint32_t>(orderedIndices.size());
+    uint32_t primitivesNum = end - start;
+    for (uint32_t i = start; i < end; ++i) {
+        orderedIndices.push_back(buildData[i].primitiveIndexNum);
+    }
+    node.initLeaf(bbox, firstPrimIndex, primitivesNum);
+}
+
+// bucket the primitive centers along dim, evaluate the split cost
+// on each bucket boundary:
+// cost = traversal + (SA(A) * N(A) + SA(B) * N(B)) / SA(node) * intersect
+// return the cheapest cost, INFINITY if there is no valid boundary
+float BVH::evalSAH(const std::vector<BVHPrimitiveInfo> &buildData,
+    uint32_t start, uint32_t end, const BBox& bbox,
+    const BBox& centersUnion, int dim, int* splitBucket,
+    BBox* below, BBox* above) const {
+    SAHBucket buckets[sSAHBucketsNum];
+    for (uint32_t i = start; i < end; ++i) {
+        int b = BucketComparator::bucketIndex(buildData[i].center,
+            centersUnion, dim);
+        buckets[b].count++;
+        buckets[b].bbox.expand(buildData[i].bbox);
+    }
+    // sweep from both sides so each boundary cost is O(1)
+    uint32_t countBelow[sSAHBucketsNum - 1];
+    float areaBelow[sSAHBucketsNum - 1];
+    BBox boxBelow[sSAHBucketsNum - 1];
+    BBox b0;
+    uint32_t count0 = 0;
+    for (int i = 0; i < sSAHBucketsNum - 1; ++i) {
+        b0.expand(buckets[i].bbox);
+        count0 += buckets[i].count;
+        countBelow[i] = count0;
+        areaBelow[i] = count0 == 0 ? 0.0f : b0.surfaceArea();
+        boxBelow[i] = b0;
+    }
+    float invArea = 1.0f / bbox.surfaceArea();
+    float minCost = INFINITY;
+    *splitBucket = -1;
+    BBox b1;
+    uint32_t count1 = 0;
+    for (int i = sSAHBucketsNum - 1; i > 0; --i) {
+        b1.expand(buckets[i].bbox);
+        count1 += buckets[i].count;
+        if (count1 == 0 || countBelow[i - 1] == 0) {
+            continue;
+        }
+        float cost = sTraversalCost + sIntersectCost * invArea *
+            (countBelow[i - 1] * areaBelow[i - 1] +
+            count1 * b1.surfaceArea());
+        if (cost < minCost) {
+            minCost = cost;
+            *splitBucket = i - 1;
+            if (above) {
+                *above = b1;
+            }
+        }
+    }
+    if (below && *splitBucket != -1) {
+        *below = boxBelow[*splitBucket];
+    }
+    return minCost;
+}
+
+// compare the cheapest SAH bucket split with the cost of making
+// [start, end) a leaf: N * intersect
+bool BVH::splitSAH(std::vector<BVHPrimitiveInfo> &buildData,
+    uint32_t start, uint32_t end, const BBox& bbox,
+    const BBox& centersUnion, int dim, uint32_t* mid) const {
+    int minCostBucket;
+    float minCost = evalSAH(buildData, start, end, bbox, centersUnion,
+        dim, &minCostBucket);
+    uint32_t primitivesNum = end - start;
+    float leafCost = sIntersectCost * primitivesNum;
+    if (minCost >= leafCost && primitivesNum <= (uint32_t)mMaxPrimitivesNum) {
+        return false;
+    }
+    // degenerated node bounding box, none of the bucket costs make sense
+    if (minCostBucket == -1) {
+        *mid = (start + end) / 2;
+        std::nth_element(&buildData[start], &buildData[*mid],
+            &buildData[end - 1] + 1, PointsComparator(dim));
+        return true;
+    }
+    BVHPrimitiveInfo* midPtr = std::partition(&buildData[start],
+        &buildData[end - 1] + 1,
+        BucketComparator(dim, minCostBucket, centersUnion));
+    *mid = (uint32_t)(midPtr - &buildData[0]);
+    return true;
+}
+
+// chop the reference by the axis aligned plane at pos, mesh triangles
+// get their edges clipped so the pieces hug the actual geometry, other
+// primitives only have their bbox cut
+void BVH::splitReference(const BVHPrimitiveInfo& ref, int dim, float pos,
+    BBox* left, BBox* right) const {
+    *left = BBox();
+    *right = BBox();
+    if (mMesh) {
+        const TriangleIndex* ti = mMesh->getFacePtr(ref.primitiveIndexNum);
+        for (int i = 0; i < 3; ++i) {
+            const Vector3& v0 = mMesh->getVertexPtr(ti->v[i])->position;
+            const Vector3& v1 =
+                mMesh->getVertexPtr(ti->v[(i + 1) % 3])->position;
+            float p0 = v0[dim];
+            float p1 = v1[dim];
+            if (p0 <= pos) {
+                left->expand(v0);
+            }
+            if (p0 >= pos) {
+                right->expand(v0);
+            }
+            // edge crosses the plane
+            if ((p0 < pos && pos < p1) || (p1 < pos && pos < p0)) {
+                Vector3 p = v0 + ((pos - p0) / (p1 - p0)) * (v1 - v0);
+                p[dim] = pos;
+                left->expand(p);
+                right->expand(p);
+            }
+        }
+    } else {
+        *left = ref.bbox;
+        *right = ref.bbox;
+    }
+    left->pMax[dim] = pos;
+    right->pMin[dim] = pos;
+    *left = overlap(*left, ref.bbox);
+    *right = overlap(*right, ref.bbox);
+}
+
+// bin the references by chopping them into every bin they span along
+// dim, the sweep then counts a straddling reference on both sides:
+// left by the bin it enters, right by the bin it exits
+float BVH::evalSpatialSplit(const std::vector<BVHPrimitiveInfo>& refs,
+    const BBox& bbox, int dim, float* splitPos,
+    uint32_t* countBelow, uint32_t* countAbove) const {
+    float origin = bbox.pMin[dim];
+    float binWidth = (bbox.pMax[dim] - origin) / sSpatialBinsNum;
+    if (binWidth <= 0.0f) {
+        return INFINITY;
+    }
+    float invBinWidth = 1.0f / binWidth;
+    SpatialBin bins[sSpatialBinsNum];
+    for (size_t i = 0; i < refs.size(); ++i) {
+        const BVHPrimitiveInfo& ref = refs[i];
+        int first = clamp((int)((ref.bbox.pMin[dim] - origin) * invBinWidth),
+            0, sSpatialBinsNum - 1);
+        int last = clamp((int)((ref.bbox.pMax[dim] - origin) * invBinWidth),
+            first, sSpatialBinsNum - 1);
+        BVHPrimitiveInfo piece = ref;
+        for (int b = first; b < last; ++b) {
+            BBox left, right;
+            splitReference(piece, dim, origin + (b + 1) * binWidth,
+                &left, &right);
+            bins[b].bbox.expand(left);
+            piece.bbox = right;
+        }
+        bins[last].bbox.expand(piece.bbox);
+        bins[first].enter++;
+        bins[last].exit++;
+    }
+    uint32_t enterBelow[sSpatialBinsNum - 1];
+    BBox boxBelow[sSpatialBinsNum - 1];
+    BBox b0;
+    uint32_t count0 = 0;
+    for (int i = 0; i < sSpatialBinsNum - 1; ++i) {
+        b0.expand(bins[i].bbox);
+        count0 += bins[i].enter;
+        enterBelow[i] = count0;
+        boxBelow[i] = b0;
+    }
+    float invArea = 1.0f / bbox.surfaceArea();
+    float minCost = INFINITY;
+    uint32_t primitivesNum = static_cast<uint32_t>(refs.size());
+    BBox b1;
+    uint32_t count1 = 0;
+    for (int i = sSpatialBinsNum - 1; i > 0; --i) {
+        b1.expand(bins[i].bbox);
+        count1 += bins[i].exit;
+        uint32_t count = enterBelow[i - 1];
+        // a split that doesn't cut down either side only adds depth
+        if (count == 0 || count1 == 0 ||
+            count == primitivesNum || count1 == primitivesNum) {
+            continue;
+        }
+        float cost = sTraversalCost + sIntersectCost * invArea *
+            (count * boxBelow[i - 1].surfaceArea() +
+            count1 * b1.surfaceArea());
+        if (cost < minCost) {
+            minCost = cost;
+            *splitPos = origin + i * binWidth;
+            *countBelow = count;
+            *countAbove = count1;
+        }
+    }
+    return minCost;
+}
+
+uint32_t BVH::buildSpatialBVH(std::vector<BVHPrimitiveInfo>& refs,
+    float rootArea, uint32_t* duplicateBudget,
+    CompactBVHNodeList& nodes,
+    std::vector<uint32_t>& orderedIndices) const {
+    nodes.push_back(CompactBVHNode());
+    uint32_t nodeOffset = static_cast<uint32_t>(nodes.size() - 1);
+    uint32_t primitivesNum = static_cast<uint32_t>(refs.size());
+    BBox bbox;
+    BBox centersUnion;
+    for (uint32_t i = 0; i < primitivesNum; ++i) {
+        bbox.expand(refs[i].bbox);
+        centersUnion.expand(refs[i].center);
+    }
+    if (primitivesNum == 1) {
+        initLeaf(refs, 0, primitivesNum, bbox, nodes[nodeOffset],
+            orderedIndices);
+        return nodeOffset;
+    }
+    // object split first, same as the SAH build
+    int dim = centersUnion.longestAxis();
+    int objectBucket = -1;
+    float objectCost = INFINITY;
+    BBox objectBelow, objectAbove;
+    if (centersUnion.pMin[dim] != centersUnion.pMax[dim]) {
+        objectCost = evalSAH(refs, 0, primitivesNum, bbox, centersUnion,
+            dim, &objectBucket, &objectBelow, &objectAbove);
+    }
+    // spatial split only pays off when the object split children
+    // overlap noticeably, and as long as there is budget to duplicate
+    int spatialDim = -1;
+    float spatialCost = INFINITY;
+    float spatialPos = 0.0f;
+    uint32_t countBelow = 0, countAbove = 0;
+    BBox objectOverlap = overlap(objectBelow, objectAbove);
+    bool trySpatial = objectBucket == -1 || (!isEmpty(objectOverlap) &&
+        objectOverlap.surfaceArea() > sSpatialSplitAlpha * rootArea);
+    if (trySpatial && *duplicateBudget > 0) {
+        // chopping every reference into bins is the expensive part of
+        // the build, only do it along the longest node axis
+        int axis = bbox.longestAxis();
+        float cost = evalSpatialSplit(refs, bbox, axis, &spatialPos,
+            &countBelow, &countAbove);
+        if (cost < INFINITY &&
+            countBelow + countAbove - primitivesNum <= *duplicateBudget) {
+            spatialCost = cost;
+            spatialDim = axis;
+        }
+    }
+    float leafCost = sIntersectCost * primitivesNum;
+    float minCost = std::min(objectCost, spatialCost);
+    if ((minCost >= leafCost || minCost == INFINITY) &&
+        primitivesNum <= (uint32_t)mMaxPrimitivesNum) {
+        initLeaf(refs, 0, primitivesNum, bbox, nodes[nodeOffset],
+            orderedIndices);
+        return nodeOffset;
+    }
+    std::vector<BVHPrimitiveInfo> belowRefs, aboveRefs;
+    bool useSpatial = spatialCost < objectCost;
+    if (useSpatial) {
+        belowRefs.reserve(countBelow);
+        aboveRefs.reserve(countAbove);
+        for (uint32_t i = 0; i < primitivesNum; ++i) {
+            const BVHPrimitiveInfo& ref = refs[i];
+            if (ref.bbox.pMax[spatialDim] <= spatialPos) {
+                belowRefs.push_back(ref);
+            } else if (ref.bbox.pMin[spatialDim] >= spatialPos) {
+                aboveRefs.push_back(ref);
+            } else {
+                BBox left, right;
+                splitReference(ref, spatialDim, spatialPos, &left, &right);
+                if (!isEmpty(left)) {
+                    belowRefs.push_back(BVHPrimitiveInfo(left,
+                        ref.primitiveIndexNum));
+                }
+                if (!isEmpty(right)) {
+                    aboveRefs.push_back(BVHPrimitiveInfo(right,
+                        ref.primitiveIndexNum));
+                }
+            }
+        }
+        if (belowRefs.empty() || aboveRefs.empty()) {
+            // clipping disagreed with the binning, nothing got split
+            useSpatial = false;
+            belowRefs.clear();
+            aboveRefs.clear();
+        } else {
+            dim = spatialDim;
+            uint32_t duplicates = static_cast<uint32_t>(
+                belowRefs.size() + aboveRefs.size()) - primitivesNum;
+            *duplicateBudget -= std::min(duplicates, *duplicateBudget);
+        }
+    }
+    if (!useSpatial) {
+        uint32_t mid;
+        if (objectBucket == -1) {
+            // nothing to bucket and no spatial split either, chop
+            // them with equal count
+            mid = primitivesNum / 2;
+            std::nth_element(refs.begin(), refs.begin() + mid,
+                refs.end(), PointsComparator(dim));
+        } else {
+            mid = (uint32_t)(std::partition(refs.begin(), refs.end(),
+                BucketComparator(dim, objectBucket, centersUnion)) -
+                refs.begin());
         }
-        //splitSummary(buildData, start, end, mid, dim);
-        buildLinearBVH(buildData,
-            start, mid, offset, orderedPrims);
-        uint32_t secondChildOffset = buildLinearBVH(buildData,
-            mid, end, offset, orderedPrims);
-        node.initInteror(bbox, secondChildOffset, dim);
+        belowRefs.assign(refs.begin(), refs.begin() + mid);
+        aboveRefs.assign(refs.begin() + mid, refs.end());
     }
+    // the references are split into the children now, free them
+    // before going deeper
+    std::vector<BVHPrimitiveInfo>().swap(refs);
+    buildSpatialBVH(belowRefs, rootArea, duplicateBudget, nodes,
+        orderedIndices);
+    uint32_t secondChildOffset = buildSpatialBVH(aboveRefs, rootArea,
+        duplicateBudget, nodes, orderedIndices);
+    nodes[nodeOffset].initInteror(bbox, secondChildOffset, dim);
     return nodeOffset;
 }
 
@@ -186,8 +1478,376 @@ static inline bool intersect(const BBox& bbox, const Ray& ray,
     return (tMin < ray.maxt) && (tMax > ray.mint);
 }
 
+// slab test the ray against all 4 children of a wide node in one go,
+// return the bit mask of the hit children and the entry distances
+static inline int intersectBounds(const float bounds[6][4], const Ray& ray,
+    const Vector3& invDir, const uint32_t dirIsNeg[3], float tNear[4]) {
+#ifdef GOBLIN_BVH_SSE
+    __m128 t0 = _mm_set1_ps(ray.mint);
+    __m128 t1 = _mm_set1_ps(ray.maxt);
+    for (int axis = 0; axis < 3; ++axis) {
+        __m128 o = _mm_set1_ps(ray.o[axis]);
+        __m128 inv = _mm_set1_ps(invDir[axis]);
+        __m128 tMin = _mm_mul_ps(_mm_sub_ps(
+            _mm_loadu_ps(bounds[axis * 2 + dirIsNeg[axis]]), o), inv);
+        __m128 tMax = _mm_mul_ps(_mm_sub_ps(
+            _mm_loadu_ps(bounds[axis * 2 + 1 - dirIsNeg[axis]]), o), inv);
+        t0 = _mm_max_ps(tMin, t0);
+        t1 = _mm_min_ps(tMax, t1);
+    }
+    _mm_storeu_ps(tNear, t0);
+    return _mm_movemask_ps(_mm_cmple_ps(t0, t1));
+#else
+    int mask = 0;
+    for (int i = 0; i < 4; ++i) {
+        float t0 = ray.mint;
+        float t1 = ray.maxt;
+        for (int axis = 0; axis < 3; ++axis) {
+            float tMin = (bounds[axis * 2 + dirIsNeg[axis]][i] -
+                ray.o[axis]) * invDir[axis];
+            float tMax = (bounds[axis * 2 + 1 - dirIsNeg[axis]][i] -
+                ray.o[axis]) * invDir[axis];
+            t0 = tMin > t0 ? tMin : t0;
+            t1 = tMax < t1 ? tMax : t1;
+        }
+        tNear[i] = t0;
+        if (t0 <= t1) {
+            mask |= 1 << i;
+        }
+    }
+    return mask;
+#endif
+}
+
+static inline int intersect(const WideBVHNode& node, const Ray& ray,
+    const Vector3& invDir, const uint32_t dirIsNeg[3], float tNear[4]) {
+    return intersectBounds(node.bounds, ray, invDir, dirIsNeg, tNear);
+}
+
+// decode the children bounds to the WideBVHNode layout first, unused
+// child slots are masked off since their bounds are not inverted
+static inline int intersect(const QuantizedBVHNode& node, const Ray& ray,
+    const Vector3& invDir, const uint32_t dirIsNeg[3], float tNear[4]) {
+    float bounds[6][4];
+    for (int axis = 0; axis < 3; ++axis) {
+        float scale = exponentToScale(node.scaleExponent[axis]);
+#ifdef GOBLIN_BVH_SSE2
+        __m128 origin = _mm_set1_ps(node.origin[axis]);
+        __m128 step = _mm_set1_ps(scale);
+        __m128i zero = _mm_setzero_si128();
+        int32_t packed[2];
+        memcpy(&packed[0], node.quantizedMin[axis], 4);
+        memcpy(&packed[1], node.quantizedMax[axis], 4);
+        for (int m = 0; m < 2; ++m) {
+            __m128i q = _mm_unpacklo_epi16(_mm_unpacklo_epi8(
+                _mm_cvtsi32_si128(packed[m]), zero), zero);
+            _mm_storeu_ps(bounds[axis * 2 + m], _mm_add_ps(origin,
+                _mm_mul_ps(_mm_cvtepi32_ps(q), step)));
+        }
+#else
+        for (int i = 0; i < 4; ++i) {
+            bounds[axis * 2][i] = node.origin[axis] +
+                (float)node.quantizedMin[axis][i] * scale;
+            bounds[axis * 2 + 1][i] = node.origin[axis] +
+                (float)node.quantizedMax[axis][i] * scale;
+        }
+#endif
+    }
+    return intersectBounds(bounds, ray, invDir, dirIsNeg, tNear) &
+        ((1 << node.childrenNum) - 1);
+}
+
+// packet rays in SoA layout so the slab test runs 4 rays per SSE lane
+// group, inactive lanes are zeroed and masked off anyway
+struct PacketRays {
+    PacketRays(const Ray* rays, uint32_t activeMask): lanesNum(0) {
+        // only the lane groups up to the last active ray are touched
+        while (lanesNum < RAY_PACKET_SIZE && (activeMask >> lanesNum) != 0) {
+            lanesNum += 4;
+        }
+        for (int i = 0; i < lanesNum; ++i) {
+            bool active = (activeMask & (1u << i)) != 0;
+            for (int axis = 0; axis < 3; ++axis) {
+                o[axis][i] = active ? rays[i].o[axis] : 0.0f;
+                invDir[axis][i] = active ? 1.0f / rays[i].d[axis] : 0.0f;
+            }
+            mint[i] = active ? rays[i].mint : 1.0f;
+            maxt[i] = active ? rays[i].maxt : 0.0f;
+        }
+    }
+
+    // return the rays in mask that hit bbox, the direction sign differs
+    // between rays so the slabs are sorted with min/max per lane
+    uint32_t intersect(const BBox& bbox, uint32_t mask) const {
+        uint32_t hitMask = 0;
+        for (int g = 0; g < lanesNum; g += 4) {
+            uint32_t groupMask = (mask >> g) & 0xf;
+            if (groupMask == 0) {
+                continue;
+            }
+#ifdef GOBLIN_BVH_SSE
+            __m128 t0 = _mm_loadu_ps(&mint[g]);
+            __m128 t1 = _mm_loadu_ps(&maxt[g]);
+            for (int axis = 0; axis < 3; ++axis) {
+                __m128 origin = _mm_loadu_ps(&o[axis][g]);
+                __m128 inv = _mm_loadu_ps(&invDir[axis][g]);
+                __m128 tA = _mm_mul_ps(_mm_sub_ps(
+                    _mm_set1_ps(bbox.pMin[axis]), origin), inv);
+                __m128 tB = _mm_mul_ps(_mm_sub_ps(
+                    _mm_set1_ps(bbox.pMax[axis]), origin), inv);
+                t0 = _mm_max_ps(_mm_min_ps(tA, tB), t0);
+                t1 = _mm_min_ps(_mm_max_ps(tA, tB), t1);
+            }
+            hitMask |= (_mm_movemask_ps(_mm_cmple_ps(t0, t1)) &
+                groupMask) << g;
+#else
+            for (int i = g; i < g + 4; ++i) {
+                if ((groupMask & (1u << (i - g))) == 0) {
+                    continue;
+                }
+                float t0 = mint[i];
+                float t1 = maxt[i];
+                for (int axis = 0; axis < 3; ++axis) {
+                    float tA = (bbox.pMin[axis] - o[axis][i]) * invDir[axis][i];
+                    float tB = (bbox.pMax[axis] - o[axis][i]) * invDir[axis][i];
+                    t0 = std::max(std::min(tA, tB), t0);
+                    t1 = std::min(std::max(tA, tB), t1);
+                }
+                if (t0 <= t1) {
+                    hitMask |= 1u << i;
+                }
+            }
+#endif
+        }
+        return hitMask;
+    }
+
+    float o[3][RAY_PACKET_SIZE];
+    float invDir[3][RAY_PACKET_SIZE];
+    float mint[RAY_PACKET_SIZE];
+    float maxt[RAY_PACKET_SIZE];
+    int lanesNum;
+};
+
+static inline int lowestBit(uint32_t mask) {
+    int i = 0;
+    while ((mask & 1u) == 0) {
+        mask >>= 1;
+        ++i;
+    }
+    return i;
+}
+
+// same Moller-Trumbore test as Triangle::intersect on the precomputed
+// edges, see the derivation over there
+static inline bool intersect(const FlatTriangle& triangle, const Ray& ray,
+    float* tHit, float* b1Hit, float* b2Hit) {
+    Vector3 s1 = cross(ray.d, triangle.e2);
+    float divisor = dot(s1, triangle.e1);
+    if (divisor == 0.0f) {
+        return false;
+    }
+    float invDivisor = 1.0f / divisor;
+    float fEpsilon = 1e-7f;
+    Vector3 s = ray.o - triangle.p0;
+    float b1 = dot(s, s1) * invDivisor;
+    if (b1 + fEpsilon < 0.0f || b1 - fEpsilon > 1.0f) {
+        return false;
+    }
+    Vector3 s2 = cross(s, triangle.e1);
+    float b2 = dot(ray.d, s2) * invDivisor;
+    if (b2 + fEpsilon < 0.0f || b1 + b2 - fEpsilon > 1.0f) {
+        return false;
+    }
+    float t = dot(triangle.e2, s2) * invDivisor;
+    if (t < ray.mint || t > ray.maxt) {
+        return false;
+    }
+    *tHit = t;
+    *b1Hit = b1;
+    *b2Hit = b2;
+    return true;
+}
+
+bool BVH::intersectLeaf(const Ray& ray, uint32_t first, uint32_t num,
+    float* epsilon, Intersection* intersection, IntersectFilter f,
+    uint32_t* hitIndex, float* b1, float* b2) const {
+    bool hit = false;
+    countPrimitivesTested(num);
+    if (mMesh == nullptr) {
+        for (uint32_t i = first; i < first + num; ++i) {
+            if (mRefinedPrimitives[i]->intersectDeferred(ray,
+                epsilon, intersection, f)) {
+                countClosestHitUpdate();
+                hit = true;
+            }
+        }
+        return hit;
+    }
+    for (uint32_t i = first; i < first + num; ++i) {
+        float t;
+        if (Goblin::intersect(mFlatTriangles[i], ray, &t, b1, b2)) {
+            countClosestHitUpdate();
+            ray.maxt = t;
+            *hitIndex = i;
+            hit = true;
+        }
+    }
+    return hit;
+}
+
+bool BVH::occludedLeaf(const Ray& ray, uint32_t first, uint32_t num,
+    IntersectFilter f) const {
+    if (mMesh == nullptr) {
+        for (uint32_t i = first; i < first + num; ++i) {
+            countPrimitivesTested(1);
+            if (mRefinedPrimitives[i]->occluded(ray, f)) {
+                return true;
+            }
+        }
+        return false;
+    }
+    for (uint32_t i = first; i < first + num; ++i) {
+        float t, b1, b2;
+        countPrimitivesTested(1);
+        if (Goblin::intersect(mFlatTriangles[i], ray, &t, &b1, &b2)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void BVH::resolveHit(const Ray& ray, uint32_t hitIndex, float b1, float b2,
+    float* epsilon, Intersection* intersection) const {
+    *epsilon = 1e-3f * ray.maxt;
+    HitRecord& hitRecord = intersection->hitRecord;
+    hitRecord.mesh = mMesh;
+    hitRecord.toWorld = nullptr;
+    hitRecord.triangleIndex = mFlatTriangles[hitIndex].triangleIndex;
+    hitRecord.t = ray.maxt;
+    hitRecord.b1 = b1;
+    hitRecord.b2 = b2;
+}
+
+template<typename WideNode>
+bool BVH::occludedWide(const std::vector<WideNode>& nodes, const Ray& ray,
+    IntersectFilter f) const {
+    if (nodes.empty()) {
+        return false;
+    }
+    Vector3 invDir(1.0f / ray.d.x, 1.0f / ray.d.y, 1.0f / ray.d.z);
+    uint32_t dirIsNeg[3] = {
+        ray.d.x < 0.0f,
+        ray.d.y < 0.0f,
+        ray.d.z < 0.0f};
+    uint32_t todoOffset = 0;
+    uint32_t todo[256];
+    todo[todoOffset++] = 0;
+    float tNear[4];
+    while (todoOffset > 0) {
+        const WideNode& node = nodes[todo[--todoOffset]];
+        recordNodeFetch(&node, sizeof(node));
+        int hitMask = Goblin::intersect(node, ray, invDir, dirIsNeg, tNear);
+        countBoxesHit(hitMask);
+        for (int i = 0; i < 4; ++i) {
+            if ((hitMask & (1 << i)) == 0) {
+                continue;
+            }
+            if (node.primitivesNum[i] == 0) {
+                todo[todoOffset++] = node.child[i].wideChildOffset;
+                continue;
+            }
+            if (occludedLeaf(ray, node.child[i].firstPrimIndex,
+                node.primitivesNum[i], f)) {
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+template<typename WideNode>
+bool BVH::intersectWide(const std::vector<WideNode>& nodes, const Ray& ray,
+    float* epsilon, Intersection* intersection, IntersectFilter f) const {
+    if (nodes.empty()) {
+        return false;
+    }
+    Vector3 invDir(1.0f / ray.d.x, 1.0f / ray.d.y, 1.0f / ray.d.z);
+    uint32_t dirIsNeg[3] = {
+        ray.d.x < 0.0f,
+        ray.d.y < 0.0f,
+        ray.d.z < 0.0f};
+    // todo stack also keeps the entry distance so the nodes behind
+    // the closest hit so far can be culled when they pop up
+    uint32_t todoOffset = 0;
+    uint32_t todo[256];
+    float todoTNear[256];
+    todo[todoOffset] = 0;
+    todoTNear[todoOffset++] = ray.mint;
+    float tNear[4];
+    bool hit = false;
+    uint32_t hitIndex = 0;
+    float b1 = 0.0f, b2 = 0.0f;
+    while (todoOffset > 0) {
+        --todoOffset;
+        if (todoTNear[todoOffset] > ray.maxt) {
+            continue;
+        }
+        const WideNode& node = nodes[todo[todoOffset]];
+        recordNodeFetch(&node, sizeof(node));
+        int hitMask = Goblin::intersect(node, ray, invDir, dirIsNeg, tNear);
+        countBoxesHit(hitMask);
+        if (hitMask == 0) {
+            continue;
+        }
+        // sort hit children front to back
+        int order[4];
+        int hitNum = 0;
+        for (int i = 0; i < 4; ++i) {
+            if ((hitMask & (1 << i)) == 0) {
+                continue;
+            }
+            int j = hitNum++;
+            while (j > 0 && tNear[order[j - 1]] > tNear[i]) {
+                order[j] = order[j - 1];
+                --j;
+            }
+            order[j] = i;
+        }
+        // leaves get tested right away in order, interior children get
+        // pushed back to front so the nearest one pops up first
+        for (int k = 0; k < hitNum; ++k) {
+            int i = order[k];
+            if (node.primitivesNum[i] == 0 || tNear[i] > ray.maxt) {
+                continue;
+            }
+            if (intersectLeaf(ray, node.child[i].firstPrimIndex,
+                node.primitivesNum[i], epsilon, intersection, f,
+                &hitIndex, &b1, &b2)) {
+                hit = true;
+            }
+        }
+        for (int k = hitNum - 1; k >= 0; --k) {
+            int i = order[k];
+            if (node.primitivesNum[i] == 0 && tNear[i] <= ray.maxt) {
+                todo[todoOffset] = node.child[i].wideChildOffset;
+                todoTNear[todoOffset++] = tNear[i];
+            }
+        }
+    }
+    if (hit && mMesh) {
+        resolveHit(ray, hitIndex, b1, b2, epsilon, intersection);
+    }
+    return hit;
+}
+
 bool BVH::occluded(const Ray& ray, IntersectFilter f) const {
-    if (mBVHNodes.size() == 0) {
+    if (mLayout == Wide) {
+        return occludedWide(mWideBVHNodes, ray, f);
+    } else if (mLayout == Quantized) {
+        return occludedWide(mQuantizedBVHNodes, ray, f);
+    }
+    if (mNodesNum == 0) {
         return false;
     }
     Vector3 invDir(1.0f / ray.d.x, 1.0f / ray.d.y, 1.0f / ray.d.z);
@@ -199,14 +1859,14 @@ bool BVH::occluded(const Ray& ray, IntersectFilter f) const {
     uint32_t todoOffset = 0;
     uint32_t todo[64];
     while(true) {
-        const CompactBVHNode& node = mBVHNodes[nodeNum];
+        const CompactBVHNode& node = mNodes[nodeNum];
+        recordNodeFetch(&node, sizeof(node));
         if (Goblin::intersect(node.bbox, ray, invDir, dirIsNeg)) {
+            countBoxesHit(1);
             if (node.primitivesNum > 0) {
-                for (uint32_t i = 0; i < node.primitivesNum; ++i) {
-                    uint32_t index = node.firstPrimIndex + i;
-                    if (mRefinedPrimitives[index]->occluded(ray, f)) {
-                        return true;
-                    }
+                if (occludedLeaf(ray, node.firstPrimIndex,
+                    node.primitivesNum, f)) {
+                    return true;
                 }
                 if (todoOffset == 0) {
                     break;
@@ -214,11 +1874,11 @@ bool BVH::occluded(const Ray& ray, IntersectFilter f) const {
                 nodeNum = todo[--todoOffset];
             } else {
                 if (dirIsNeg[node.axis]) {
-                    todo[todoOffset++] = nodeNum + 1;
+                    todo[todoOffset++] = node.secondChildOffset - 1;
                     nodeNum = node.secondChildOffset;
                 } else {
                     todo[todoOffset++] = node.secondChildOffset;
-                    nodeNum = nodeNum + 1;
+                    nodeNum = node.secondChildOffset - 1;
                 }
             }
         } else {
@@ -233,7 +1893,22 @@ bool BVH::occluded(const Ray& ray, IntersectFilter f) const {
 
 bool BVH::intersect(const Ray& ray, float* epsilon,
     Intersection* intersection, IntersectFilter f) const {
-    if (mBVHNodes.size() == 0) {
+    bool hit = intersectDeferred(ray, epsilon, intersection, f);
+    if (hit) {
+        intersection->resolve(ray);
+    }
+    return hit;
+}
+
+bool BVH::intersectDeferred(const Ray& ray, float* epsilon,
+    Intersection* intersection, IntersectFilter f) const {
+    if (mLayout == Wide) {
+        return intersectWide(mWideBVHNodes, ray, epsilon, intersection, f);
+    } else if (mLayout == Quantized) {
+        return intersectWide(mQuantizedBVHNodes, ray, epsilon,
+            intersection, f);
+    }
+    if (mNodesNum == 0) {
         return false;
     }
     Vector3 invDir(1.0f / ray.d.x, 1.0f / ray.d.y, 1.0f / ray.d.z);
@@ -245,16 +1920,18 @@ bool BVH::intersect(const Ray& ray, float* epsilon,
     uint32_t todoOffset = 0;
     uint32_t todo[64];
     bool hit = false;
+    uint32_t hitIndex = 0;
+    float b1 = 0.0f, b2 = 0.0f;
     while(true) {
-        const CompactBVHNode& node = mBVHNodes[nodeNum];
+        const CompactBVHNode& node = mNodes[nodeNum];
+        recordNodeFetch(&node, sizeof(node));
         if (Goblin::intersect(node.bbox, ray, invDir, dirIsNeg)) {
+            countBoxesHit(1);
             if (node.primitivesNum > 0) {
-                for (uint32_t i = 0; i < node.primitivesNum; ++i) {
-                    uint32_t index = node.firstPrimIndex + i;
-                    if (mRefinedPrimitives[index]->intersect(ray,
-                        epsilon, intersection, f)) {
-                        hit = true;
-                    }
+                if (intersectLeaf(ray, node.firstPrimIndex,
+                    node.primitivesNum, epsilon, intersection, f,
+                    &hitIndex, &b1, &b2)) {
+                    hit = true;
                 }
                 if (todoOffset == 0) {
                     break;
@@ -262,11 +1939,11 @@ bool BVH::intersect(const Ray& ray, float* epsilon,
                 nodeNum = todo[--todoOffset];
             } else {
                 if (dirIsNeg[node.axis]) {
-                    todo[todoOffset++] = nodeNum + 1;
+                    todo[todoOffset++] = node.secondChildOffset - 1;
                     nodeNum = node.secondChildOffset;
                 } else {
                     todo[todoOffset++] = node.secondChildOffset;
-                    nodeNum = nodeNum + 1;
+                    nodeNum = node.secondChildOffset - 1;
                 }
             }
         } else {
@@ -276,74 +1953,243 @@ bool BVH::intersect(const Ray& ray, float* epsilon,
             nodeNum = todo[--todoOffset];
         }
     }
+    if (hit && mMesh) {
+        resolveHit(ray, hitIndex, b1, b2, epsilon, intersection);
+    }
     return hit;
 }
 
-
-void BVH::buildDataSummary(
-        const std::vector<BVHPrimitiveInfo> &buildData) const {
-    std::cout << "--------------------------------\n";
-    for (size_t i = 0; i < buildData.size(); ++i) {
-        std::cout <<
-            buildData[i].primitiveIndexNum <<
-            " c " <<buildData[i].center <<
-            " pMin " <<buildData[i].bbox.pMin <<
-            " pMax " <<buildData[i].bbox.pMax << std::endl;
+uint32_t BVH::intersectPacket(const Ray* rays, uint32_t activeMask,
+    float* epsilons, Intersection* intersections, IntersectFilter f) const {
+    if (mNodes == nullptr || (activeMask & (activeMask - 1)) == 0) {
+        // a lone ray is cheaper down the single ray path, the quantized
+        // layout has no binary nodes left to walk a packet through
+        uint32_t hitMask = 0;
+        for (uint32_t mask = activeMask; mask; mask &= mask - 1) {
+            int i = lowestBit(mask);
+            if (intersectDeferred(rays[i], &epsilons[i], &intersections[i],
+                f)) {
+                hitMask |= 1u << i;
+            }
+        }
+        return hitMask;
     }
-}
-
-void BVH::leafSummary(const std::vector<BVHPrimitiveInfo> &buildData,
-    int start, int end, int firstPrimIndex, int primitivesNum) const {
-    std::cout << "--------------------------------\n";
-    std::cout << "leaf push in :";
-    for (int i = start; i < end; ++i) {
-        int pIndex = buildData[i].primitiveIndexNum;
-        std::cout << pIndex << " ";
+    if (mNodesNum == 0) {
+        return 0;
     }
-    std::cout << " first " << firstPrimIndex << " num " <<
-        primitivesNum << std::endl;
+    // packets always walk the binary nodes, the wide layout already
+    // spends its SIMD lanes on the children of a single ray
+    PacketRays packet(rays, activeMask);
+    uint32_t hitMask = 0;
+    uint32_t hitIndex[RAY_PACKET_SIZE];
+    float b1[RAY_PACKET_SIZE], b2[RAY_PACKET_SIZE];
+    uint32_t nodeNum = 0;
+    uint32_t mask = activeMask;
+    uint32_t todoOffset = 0;
+    uint32_t todo[64];
+    uint32_t todoMask[64];
+    while (true) {
+        const CompactBVHNode& node = mNodes[nodeNum];
+        recordNodeFetch(&node, sizeof(node));
+        mask = packet.intersect(node.bbox, mask);
+        countBoxesHit(mask);
+        if (mask != 0) {
+            if (node.primitivesNum > 0) {
+                uint32_t first = node.firstPrimIndex;
+                uint32_t end = first + node.primitivesNum;
+                uint32_t leafHitMask = 0;
+                if (mMesh == nullptr) {
+                    countPrimitivesTested(node.primitivesNum, mask);
+                    for (uint32_t j = first; j < end; ++j) {
+                        uint32_t m = mRefinedPrimitives[j]->intersectPacket(
+                            rays, mask, epsilons, intersections, f);
+                        countClosestHitUpdate(m);
+                        leafHitMask |= m;
+                    }
+                } else {
+                    for (int i = 0; i < RAY_PACKET_SIZE; ++i) {
+                        if ((mask & (1u << i)) && intersectLeaf(rays[i],
+                            first, node.primitivesNum, &epsilons[i],
+                            &intersections[i], f, &hitIndex[i],
+                            &b1[i], &b2[i])) {
+                            leafHitMask |= 1u << i;
+                        }
+                    }
+                }
+                for (int i = 0; i < RAY_PACKET_SIZE; ++i) {
+                    if (leafHitMask & (1u << i)) {
+                        packet.maxt[i] = rays[i].maxt;
+                    }
+                }
+                hitMask |= leafHitMask;
+            } else {
+                // visit order follows the first ray, coherent rays mostly
+                // agree on the direction sign anyway
+                int lead = lowestBit(mask);
+                todoMask[todoOffset] = mask;
+                if (rays[lead].d[node.axis] < 0.0f) {
+                    todo[todoOffset++] = node.secondChildOffset - 1;
+                    nodeNum = node.secondChildOffset;
+                } else {
+                    todo[todoOffset++] = node.secondChildOffset;
+                    nodeNum = node.secondChildOffset - 1;
+                }
+                continue;
+            }
+        }
+        if (todoOffset == 0) {
+            break;
+        }
+        --todoOffset;
+        nodeNum = todo[todoOffset];
+        mask = todoMask[todoOffset];
+    }
+    if (mMesh) {
+        for (int i = 0; i < RAY_PACKET_SIZE; ++i) {
+            if (hitMask & (1u << i)) {
+                resolveHit(rays[i], hitIndex[i], b1[i], b2[i],
+                    &epsilons[i], &intersections[i]);
+            }
+        }
+    }
+    return hitMask;
 }
 
-void BVH::splitSummary(const std::vector<BVHPrimitiveInfo> &buildData,
-    int start, int end, int mid, int dim) const {
-    std::cout << "--------------------------------\n";
-    std::cout << "split summary \n";
-    std::cout << "split axes " << (char)('x' + dim) << std::endl;
-    std::cout << "start " << start << " end " <<
-		end  << " mid " << mid << std::endl;
-    std::cout << "left child: ";
-    for (int i = start; i < mid; ++i) {
-        std::cout << buildData[i].primitiveIndexNum << " ";
+uint32_t BVH::occludedPacket(const Ray* rays, uint32_t activeMask,
+    IntersectFilter f) const {
+    if (mNodes == nullptr || (activeMask & (activeMask - 1)) == 0) {
+        uint32_t occludedMask = 0;
+        for (uint32_t mask = activeMask; mask; mask &= mask - 1) {
+            int i = lowestBit(mask);
+            if (occluded(rays[i], f)) {
+                occludedMask |= 1u << i;
+            }
+        }
+        return occludedMask;
     }
-    std::cout << std::endl;
-
-    std::cout << "right child: ";
-    for (int i = mid; i < end; ++i) {
-        std::cout << buildData[i].primitiveIndexNum << " ";
+    if (mNodesNum == 0) {
+        return 0;
     }
-    std::cout << std::endl;
+    PacketRays packet(rays, activeMask);
+    uint32_t occludedMask = 0;
+    uint32_t nodeNum = 0;
+    uint32_t mask = activeMask;
+    uint32_t todoOffset = 0;
+    uint32_t todo[64];
+    uint32_t todoMask[64];
+    while (true) {
+        const CompactBVHNode& node = mNodes[nodeNum];
+        recordNodeFetch(&node, sizeof(node));
+        // rays occluded in an earlier leaf drop out of the packet
+        mask = packet.intersect(node.bbox, mask & ~occludedMask);
+        countBoxesHit(mask);
+        if (mask != 0) {
+            if (node.primitivesNum > 0) {
+                uint32_t first = node.firstPrimIndex;
+                uint32_t end = first + node.primitivesNum;
+                if (mMesh == nullptr) {
+                    for (uint32_t j = first; j < end && mask != 0; ++j) {
+                        countPrimitivesTested(1, mask);
+                        uint32_t m = mRefinedPrimitives[j]->occludedPacket(
+                            rays, mask, f);
+                        occludedMask |= m;
+                        mask &= ~m;
+                    }
+                } else {
+                    for (int i = 0; i < RAY_PACKET_SIZE; ++i) {
+                        if ((mask & (1u << i)) && occludedLeaf(rays[i],
+                            first, node.primitivesNum, f)) {
+                            occludedMask |= 1u << i;
+                        }
+                    }
+                }
+                if (occludedMask == activeMask) {
+                    break;
+                }
+            } else {
+                int lead = lowestBit(mask);
+                todoMask[todoOffset] = mask;
+                if (rays[lead].d[node.axis] < 0.0f) {
+                    todo[todoOffset++] = node.secondChildOffset - 1;
+                    nodeNum = node.secondChildOffset;
+                } else {
+                    todo[todoOffset++] = node.secondChildOffset;
+                    nodeNum = node.secondChildOffset - 1;
+                }
+                continue;
+            }
+        }
+        if (todoOffset == 0) {
+            break;
+        }
+        --todoOffset;
+        nodeNum = todo[todoOffset];
+        mask = todoMask[todoOffset];
+    }
+    return occludedMask;
 }
 
-void BVH::compactSummary() const {
-    std::cout << "--------------------------------\n";
-    for (size_t i = 0; i < mRefinedPrimitives.size(); ++i) {
-        BBox b = mRefinedPrimitives[i]->getAABB();
-        std::cout << i <<
-            " c " << 0.5f * (b.pMin + b.pMax) <<
-            " pMin " <<b.pMin <<
-            " pMax " <<b.pMax << std::endl;
+static inline uint32_t streamPacketMask(size_t raysNum) {
+    return raysNum >= RAY_PACKET_SIZE ?
+        0xffffffffu : (1u << raysNum) - 1u;
+}
+
+void BVH::intersect(const Ray* rays, size_t raysNum, float* epsilons,
+    Intersection* intersections, bool* hits, IntersectFilter f) const {
+    for (size_t start = 0; start < raysNum; start += RAY_PACKET_SIZE) {
+        size_t n = std::min(raysNum - start, (size_t)RAY_PACKET_SIZE);
+        uint32_t hitMask = intersectPacket(rays + start,
+            streamPacketMask(n), epsilons + start, intersections + start, f);
+        for (size_t i = 0; i < n; ++i) {
+            hits[start + i] = (hitMask & (1u << i)) != 0;
+            if (hits[start + i]) {
+                intersections[start + i].resolve(rays[start + i]);
+            }
+        }
     }
+}
 
-    for (size_t i = 0; i < mBVHNodes.size(); ++ i) {
-        const CompactBVHNode& node = mBVHNodes[i];
-        if (node.primitivesNum == 0) {
-            std::cout << i << " axis " << (int)node.axis <<
-                " secondChild " << node.secondChildOffset << std::endl;
-        } else {
-            std::cout << i << " first " << node.firstPrimIndex <<
-                " primNum " << (int)node.primitivesNum << std::endl;
+void BVH::occluded(const Ray* rays, size_t raysNum, bool* occluded,
+    IntersectFilter f) const {
+    for (size_t start = 0; start < raysNum; start += RAY_PACKET_SIZE) {
+        size_t n = std::min(raysNum - start, (size_t)RAY_PACKET_SIZE);
+        uint32_t occludedMask = occludedPacket(rays + start,
+            streamPacketMask(n), f);
+        for (size_t i = 0; i < n; ++i) {
+            occluded[start + i] = (occludedMask & (1u << i)) != 0;
         }
     }
 }
 
+BVH* createBVH(const PrimitiveList& primitives, const ParamSet& params) {
+    std::string splitMethod = params.getString("split_method", "equal_count");
+    // SAH decides the leaf size with its cost model, give it some room
+    bool useSAH = splitMethod == "sah" || splitMethod == "sbvh";
+    int maxPrimitivesNum = params.getInt("max_primitives_num",
+        useSAH ? 8 : 1);
+    int threadNum = params.getInt("thread_num", getMaxThreadNum());
+    std::string layout = params.getString("layout", "binary");
+    // extra references spatial splits may add, fraction of input size
+    float spatialSplitBudget = params.getFloat("spatial_split_budget", 0.3f);
+    // "dfs" keeps the build order, only pairs up the siblings
+    std::string nodeOrder = params.getString("node_order", "treelet");
+    return new BVH(primitives, maxPrimitivesNum, splitMethod, threadNum,
+        layout, spatialSplitBudget, nodeOrder);
+}
+
+BVH* createBVH(const PolygonMesh* mesh, const ParamSet& params) {
+    std::string splitMethod = params.getString("split_method", "equal_count");
+    bool useSAH = splitMethod == "sah" || splitMethod == "sbvh";
+    int maxPrimitivesNum = params.getInt("max_primitives_num",
+        useSAH ? 8 : 1);
+    int threadNum = params.getInt("thread_num", getMaxThreadNum());
+    std::string layout = params.getString("layout", "binary");
+    float spatialSplitBudget = params.getFloat("spatial_split_budget", 0.3f);
+    // empty to disable the on disk cache
+    std::string cacheDir = params.getString("cache_dir", "");
+    std::string nodeOrder = params.getString("node_order", "treelet");
+    return new BVH(mesh, maxPrimitivesNum, splitMethod, threadNum, layout,
+        spatialSplitBudget, cacheDir, nodeOrder);
+}
+
 } // namespace Goblin
\ No newline at end of file
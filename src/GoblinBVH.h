@@ -1,15 +1,26 @@
 #ifndef GOBLIN_BVH_H
 #define GOBLIN_BVH_H
 #include "GoblinPrimitive.h"
+
+// uncomment to count the BVH node fetches against a simulated cache,
+// for comparing the node orders, it slows down the traversal a lot
+//#define GOBLIN_BVH_FETCH_STATS
+
 namespace Goblin {
+class MappedFile;
+class ParamSet;
+class PolygonMesh;
+class Task;
 struct BVHPrimitiveInfo;
-struct BVHTreeNode;
+struct BVHTopLevelNode;
 
 struct CompactBVHNode {
     BBox bbox;
     union {
         uint32_t firstPrimIndex; // leaf
-        uint32_t secondChildOffset; // interior
+        // interior, siblings are stored in pairs so the first child
+        // sits right before the second one
+        uint32_t secondChildOffset;
     };
     uint8_t primitivesNum;
     uint8_t axis;
@@ -29,53 +40,398 @@ struct CompactBVHNode {
     }
 };
 
+// puts element 0 in the second half of a 64 byte line, with the root
+// there every CompactBVHNode sibling pair after it fills exactly one line
+template<typename T>
+class NodeAllocator {
+public:
+    typedef T value_type;
+
+    NodeAllocator() {}
+
+    template<typename U>
+    NodeAllocator(const NodeAllocator<U>&) {}
+
+    T* allocate(size_t n) {
+        // the raw pointer is stashed right before the returned block
+        size_t slack = sizeof(void*) + 64 + 32;
+        char* raw = static_cast<char*>(::operator new(n * sizeof(T) + slack));
+        uintptr_t aligned = (reinterpret_cast<uintptr_t>(raw) +
+            sizeof(void*) + 32 + 63) & ~static_cast<uintptr_t>(63);
+        char* p = reinterpret_cast<char*>(aligned - 32);
+        reinterpret_cast<void**>(p)[-1] = raw;
+        return reinterpret_cast<T*>(p);
+    }
+
+    void deallocate(T* p, size_t) {
+        ::operator delete(reinterpret_cast<void**>(p)[-1]);
+    }
+};
+
+template<typename T, typename U>
+bool operator==(const NodeAllocator<T>&, const NodeAllocator<U>&) {
+    return true;
+}
+
+template<typename T, typename U>
+bool operator!=(const NodeAllocator<T>&, const NodeAllocator<U>&) {
+    return false;
+}
+
+typedef std::vector<CompactBVHNode, NodeAllocator<CompactBVHNode> >
+    CompactBVHNodeList;
+
+// 4 wide node collapsed from the binary tree, the child bounds are
+// stored in SoA layout so one SIMD slab test covers all the children
+struct WideBVHNode {
+    WideBVHNode();
+
+    void setChild(int i, const CompactBVHNode& node);
+
+    // bounds[axis * 2] is min, bounds[axis * 2 + 1] is max, child slots
+    // not in use have an inverted bounds that never got hit
+    float bounds[6][4];
+    union {
+        uint32_t firstPrimIndex; // leaf child
+        uint32_t wideChildOffset; // interior child
+    } child[4];
+    // 0 for interior child
+    uint8_t primitivesNum[4];
+    uint8_t pad[12];
+};
+
+// 4 wide node in one 64 byte cache line: the child bounds are 8 bit
+// offsets from the node origin in steps of a power of 2 scale per axis,
+// rounded outward so the decoded bounds always contain the real ones
+struct QuantizedBVHNode {
+    QuantizedBVHNode();
+
+    // quantize the children bounds against their union
+    void setBounds(const BBox childBounds[4], int n);
+
+    void setChild(int i, const CompactBVHNode& node);
+
+    // decode child i bound along axis, min if isMax is 0
+    float decode(int axis, int isMax, int i) const;
+
+    float origin[3];
+    // IEEE exponent bits of the scale, so the decode multiply is exact
+    uint8_t scaleExponent[3];
+    uint8_t childrenNum;
+    uint8_t quantizedMin[3][4];
+    uint8_t quantizedMax[3][4];
+    union {
+        uint32_t firstPrimIndex; // leaf child
+        uint32_t wideChildOffset; // interior child
+    } child[4];
+    // 0 for interior child
+    uint8_t primitivesNum[4];
+    uint8_t pad[4];
+};
+
+// triangle stored in leaf order with the edges precomputed, the full
+// Fragment is only resolved from the mesh for the closest hit
+struct FlatTriangle {
+    Vector3 p0;
+    Vector3 e1;
+    Vector3 e2;
+    uint32_t triangleIndex;
+};
+// tree quality numbers gathered once the build is done, for checking
+// a scene before spending the render time on it
+struct BVHReport {
+    BVHReport(): primitivesNum(0), referencesNum(0), interiorNodesNum(0),
+        leavesNum(0), maxDepth(0), sahCost(0.0f), meanOverlap(0.0f),
+        maxOverlap(0.0f), binaryNodesBytes(0), wideNodesBytes(0),
+        trianglesBytes(0), primitivesBytes(0), mappedFromCache(false) {}
+
+    uint32_t primitivesNum;
+    // leaf references, more than primitivesNum with spatial splits
+    uint32_t referencesNum;
+    uint32_t interiorNodesNum;
+    uint32_t leavesNum;
+    uint32_t maxDepth;
+    // expected cost of a ray hitting the root with the build cost model
+    float sahCost;
+    // surface area of the children bounds overlap over the parent one
+    float meanOverlap;
+    float maxOverlap;
+    // leafSizeHistogram[n] leaves hold n primitives
+    std::vector<uint32_t> leafSizeHistogram;
+    // leafDepthHistogram[d] leaves sit d levels below the root
+    std::vector<uint32_t> leafDepthHistogram;
+    // memory of the traversal data as it is after the layout build
+    size_t binaryNodesBytes;
+    // wide or quantized nodes
+    size_t wideNodesBytes;
+    size_t trianglesBytes;
+    size_t primitivesBytes;
+    bool mappedFromCache;
+};
+
 class BVH {
 public:
     BVH(const PrimitiveList& primitives, int maxPrimitivesNum,
-        const std::string& splitMethod);
+        const std::string& splitMethod, int threadNum = 1,
+        const std::string& layout = "binary",
+        float spatialSplitBudget = 0.3f,
+        const std::string& nodeOrder = "treelet");
+
+    // build directly on the mesh triangles without refining them into
+    // Triangle primitives, leaves reference mTriangles instead. with a
+    // cacheDir the built tree is saved there and mapped back next time
+    // the same mesh is built with the same settings
+    BVH(const PolygonMesh* mesh, int maxPrimitivesNum,
+        const std::string& splitMethod, int threadNum = 1,
+        const std::string& layout = "binary",
+        float spatialSplitBudget = 0.3f,
+        const std::string& cacheDir = "",
+        const std::string& nodeOrder = "treelet");
 
-	~BVH() = default;
+	~BVH();
 
 	bool intersect(const Ray& ray, float* epsilon,
 		Intersection* intersection, IntersectFilter f) const;
 
+	// closest hit only, mesh hits are left in intersection->hitRecord
+	// for the caller to resolve once the outer traversal is done
+	bool intersectDeferred(const Ray& ray, float* epsilon,
+		Intersection* intersection, IntersectFilter f) const;
+
 	bool occluded(const Ray& ray, IntersectFilter f) const;
 
+    // coherent rays (camera rays of one pixel, shadow rays toward one
+    // point) traced together, each node bound is fetched once and slab
+    // tested against all the rays still active in the packet
+    template<int N>
+    void intersect(RayPacket<N>& packet, IntersectFilter f = nullptr) const {
+        intersect(packet.rays, packet.raysNum, packet.epsilons,
+            packet.intersections, packet.hits, f);
+    }
+
+    template<int N>
+    void occluded(RayPacket<N>& packet, IntersectFilter f = nullptr) const {
+        occluded(packet.rays, packet.raysNum, packet.hits, f);
+    }
+
+    // ray stream of any size, cut into packets of RAY_PACKET_SIZE rays
+    void intersect(const Ray* rays, size_t raysNum, float* epsilons,
+        Intersection* intersections, bool* hits,
+        IntersectFilter f = nullptr) const;
+
+    void occluded(const Ray* rays, size_t raysNum, bool* occluded,
+        IntersectFilter f = nullptr) const;
+
+    // packet hit stage, mesh hits are left pending like intersectDeferred,
+    // return the mask of rays in activeMask that found a closer hit
+    uint32_t intersectPacket(const Ray* rays, uint32_t activeMask,
+        float* epsilons, Intersection* intersections,
+        IntersectFilter f) const;
+
+    // return the mask of the occluded rays
+    uint32_t occludedPacket(const Ray* rays, uint32_t activeMask,
+        IntersectFilter f) const;
+
+    // node fetches and simulated cache line misses of all the traversals
+    // so far, both stay 0 unless GOBLIN_BVH_FETCH_STATS is defined
+    static void getNodeFetchStats(uint64_t* fetches, uint64_t* misses);
+
+    // the build report with the memory numbers of the current storage
+    BVHReport getReport() const;
+
 	BBox getAABB() const {
 		return mAABB;
 	}
 
+    // recompute the node bounds bottom up in the existing topology,
+    // for primitives that moved without changing the tree much (ex.
+    // instance transform updates), tree quality degrades as they drift
+    void refit();
+
 private:
+    friend class BVHBuildTask;
+    // shared by both constructors, output the primitive indexes in
+    // leaf order for the caller to reorder its own primitive storage
+    void build(std::vector<BVHPrimitiveInfo>& buildInfoList,
+        const std::string& splitMethod, int threadNum,
+        std::vector<uint32_t>& orderedIndices);
+
+    // turn the DFS array the build outputs (first child right after its
+    // parent) into sibling pairs, each pair is one 64 byte line. treelet
+    // order packs the pairs most likely to be visited after each other
+    // in page sized blocks, parents always stay before their children
+    void reorderNodes();
+
+    // place the children pair of the interior node, return its offset
+    uint32_t placeChildren(uint32_t nodeNum,
+        CompactBVHNodeList& ordered, uint32_t parent,
+        uint32_t* nextOffset) const;
+
+    void reorderDepthFirst(uint32_t nodeNum,
+        CompactBVHNodeList& ordered, uint32_t orderedNum,
+        uint32_t* nextOffset) const;
+
+    // point the traversal at the in memory mBVHNodes/mTriangles
+    void bindStorage();
+
+    // fill the tree part of mReport, has to run while the binary
+    // nodes are still around
+    void computeReport(uint32_t primitivesNum);
+
+    // key of the on disk cache, covers the mesh positions, faces and
+    // the settings that change the tree topology
+    uint64_t hashMesh(const std::string& splitMethod) const;
+
+    // map the cached nodes and triangles, return false if the file is
+    // missing, from another format version or built for another key
+    bool loadCache(const std::string& filename, uint64_t key);
+
+    void saveCache(const std::string& filename, uint64_t key) const;
+
     //the BVH we build is a flatten binary tree in DFS order, the node
     //is defined as a compact 32byte class for cache line friendly access
     uint32_t buildLinearBVH(std::vector<BVHPrimitiveInfo> &buildData,
-        uint32_t start, uint32_t end, uint32_t* offset,
-        PrimitiveList& orderedPrims);
+        uint32_t start, uint32_t end, CompactBVHNodeList& nodes,
+        std::vector<uint32_t>& orderedIndices) const;
+
+    // return false if [start, end) should be a leaf, otherwise partition
+    // buildData and output the split position and axis
+    bool splitNode(std::vector<BVHPrimitiveInfo> &buildData,
+        uint32_t start, uint32_t end, const BBox& bbox,
+        uint32_t* mid, int* dim) const;
+
+    // parallel build: split the top levels serially and spawn a build
+    // task for each subtree below them
+    void buildTopLevels(std::vector<BVHPrimitiveInfo> &buildData,
+        uint32_t start, uint32_t end, int depth,
+        std::vector<BVHTopLevelNode>& topNodes,
+        std::vector<Task*>& subtreeTasks) const;
+
+    uint32_t stitchTopLevels(const std::vector<BVHTopLevelNode>& topNodes,
+        uint32_t topOffset, const std::vector<Task*>& subtreeTasks,
+        std::vector<uint32_t>& orderedIndices);
+
+    // regenerate the traversal layout derived from mNodes
+    void buildLayout();
 
-    // these are all just temp debug logging, should find a better verify process
-    void buildDataSummary(
-        const std::vector<BVHPrimitiveInfo> &buildData) const;
+    // collapse the binary interior node into a wide node by opening up
+    // its largest interior descendants till there are 4 children
+    uint32_t buildWideBVH(uint32_t nodeNum);
 
-    void leafSummary(const std::vector<BVHPrimitiveInfo> &buildData,
-        int start, int end, int firstPrimIndex, int primitivesNum) const ;
+    uint32_t buildQuantizedBVH(uint32_t nodeNum);
 
-    void splitSummary(const std::vector<BVHPrimitiveInfo> &buildData,
-        int start, int end, int mid, int dim) const;
+    // pick the 4 (or less) descendants of an interior node that become
+    // the children of its wide node, return the children number
+    int collectWideChildren(uint32_t nodeNum, uint32_t children[4]) const;
 
-    void compactSummary() const;
+    // full precision bound of the primitives in a leaf
+    BBox leafBound(uint32_t first, uint32_t num) const;
+
+    // refit the quantized tree in place, there is no binary tree left
+    // to sweep, return the bound of the node
+    BBox refitQuantized(uint32_t offset);
+
+    // shared by the wide and the quantized layout
+    template<typename WideNode>
+    bool intersectWide(const std::vector<WideNode>& nodes, const Ray& ray,
+        float* epsilon, Intersection* intersection, IntersectFilter f) const;
+
+    template<typename WideNode>
+    bool occludedWide(const std::vector<WideNode>& nodes, const Ray& ray,
+        IntersectFilter f) const;
+
+    // test the leaf primitives, record the closest hit in hitIndex and
+    // shrink ray.maxt, the Fragment is not touched for mesh leaves and
+    // primitive leaves only run their hit stage
+    bool intersectLeaf(const Ray& ray, uint32_t first, uint32_t num,
+        float* epsilon, Intersection* intersection, IntersectFilter f,
+        uint32_t* hitIndex, float* b1, float* b2) const;
+
+    bool occludedLeaf(const Ray& ray, uint32_t first, uint32_t num,
+        IntersectFilter f) const;
+
+    // record the closest mesh triangle in intersection->hitRecord
+    void resolveHit(const Ray& ray, uint32_t hitIndex, float b1, float b2,
+        float* epsilon, Intersection* intersection) const;
+
+    void initLeaf(const std::vector<BVHPrimitiveInfo> &buildData,
+        uint32_t start, uint32_t end, const BBox& bbox,
+        CompactBVHNode& node, std::vector<uint32_t>& orderedIndices) const;
+
+    // binned surface area heuristic split, return false if creating
+    // a leaf for [start, end) is cheaper than any of the bucket splits
+    bool splitSAH(std::vector<BVHPrimitiveInfo> &buildData,
+        uint32_t start, uint32_t end, const BBox& bbox,
+        const BBox& centersUnion, int dim, uint32_t* mid) const;
+
+    float evalSAH(const std::vector<BVHPrimitiveInfo> &buildData,
+        uint32_t start, uint32_t end, const BBox& bbox,
+        const BBox& centersUnion, int dim, int* splitBucket,
+        BBox* below = nullptr, BBox* above = nullptr) const;
+
+    // spatial split BVH: pick the cheaper one between the binned object
+    // split and a binned spatial split that clips the primitives
+    // straddling the plane into both children, refs are consumed
+    uint32_t buildSpatialBVH(std::vector<BVHPrimitiveInfo>& refs,
+        float rootArea, uint32_t* duplicateBudget,
+        CompactBVHNodeList& nodes,
+        std::vector<uint32_t>& orderedIndices) const;
+
+    float evalSpatialSplit(const std::vector<BVHPrimitiveInfo>& refs,
+        const BBox& bbox, int dim, float* splitPos,
+        uint32_t* countBelow, uint32_t* countAbove) const;
+
+    void splitReference(const BVHPrimitiveInfo& ref, int dim, float pos,
+        BBox* left, BBox* right) const;
 
 private:
     enum SplitMethod {
         Middle,
-        EqualCount
+        EqualCount,
+        SAH,
+        SBVH
+    };
+
+    enum NodeOrder {
+        DepthFirst,
+        Treelet
+    };
+
+    enum Layout {
+        Binary,
+        Wide,
+        // wide tree with compressed nodes, the binary nodes are dropped
+        // after the build to save memory
+        Quantized
     };
 
     int mMaxPrimitivesNum;
     SplitMethod mSplitMethod;
-    std::vector<CompactBVHNode> mBVHNodes;
+    Layout mLayout;
+    NodeOrder mNodeOrder;
+    // SBVH only, max duplicated references as a fraction of input size
+    float mSpatialSplitBudget;
+    CompactBVHNodeList mBVHNodes;
+    std::vector<WideBVHNode> mWideBVHNodes;
+    std::vector<QuantizedBVHNode> mQuantizedBVHNodes;
 	PrimitiveList mRefinedPrimitives;
+    const PolygonMesh* mMesh;
+    std::vector<FlatTriangle> mTriangles;
+    // what traversal reads, either the vectors above or a mapped cache
+    const CompactBVHNode* mNodes;
+    size_t mNodesNum;
+    const FlatTriangle* mFlatTriangles;
+    size_t mFlatTrianglesNum;
+    std::unique_ptr<MappedFile> mCacheFile;
 	BBox mAABB;
+    BVHReport mReport;
 };
+
+typedef std::shared_ptr<BVH> BVHPtr;
+
+BVH* createBVH(const PrimitiveList& primitives, const ParamSet& params);
+
+BVH* createBVH(const PolygonMesh* mesh, const ParamSet& params);
 }
 
 #endif //GOBLIN_BVH_H
\ No newline at end of file
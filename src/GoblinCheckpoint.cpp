@@ -0,0 +1,143 @@
+#include "GoblinCheckpoint.h"
+#include "GoblinMappedFile.h"
+#include "GoblinUtils.h"
+
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+
+namespace Goblin {
+
+static const char sCheckpointMagic[4] = {'G', 'C', 'K', 'P'};
+static const uint32_t sCheckpointVersion = 2;
+static const size_t sCheckpointTagSize = 16;
+
+// followed by the payload
+struct CheckpointHeader {
+    char magic[4];
+    uint32_t version;
+    char tag[sCheckpointTagSize];
+    uint64_t payloadSize;
+};
+
+CheckpointWriter::CheckpointWriter(const std::string& filename):
+    mFilename(filename), mHasPending(false), mWriting(false),
+    mExit(false) {
+    mThread = std::thread(&CheckpointWriter::writerEntry, this);
+}
+
+CheckpointWriter::~CheckpointWriter() {
+    {
+        std::lock_guard<std::mutex> lk(mMutex);
+        mExit = true;
+    }
+    mCondition.notify_all();
+    mThread.join();
+}
+
+void CheckpointWriter::submit(const std::string& tag,
+    CheckpointBuffer& buffer) {
+    CheckpointHeader header;
+    memcpy(header.magic, sCheckpointMagic, sizeof(sCheckpointMagic));
+    header.version = sCheckpointVersion;
+    memset(header.tag, 0, sizeof(header.tag));
+    memcpy(header.tag, tag.c_str(),
+        std::min(tag.size(), sCheckpointTagSize - 1));
+    std::vector<char>& payload = buffer.getData();
+    header.payloadSize = payload.size();
+    const char* headerBytes = reinterpret_cast<const char*>(&header);
+    payload.insert(payload.begin(), headerBytes,
+        headerBytes + sizeof(header));
+    {
+        std::lock_guard<std::mutex> lk(mMutex);
+        mPending.swap(payload);
+        mHasPending = true;
+    }
+    mCondition.notify_all();
+}
+
+void CheckpointWriter::flush() {
+    std::unique_lock<std::mutex> lk(mMutex);
+    while (mHasPending || mWriting) {
+        mCondition.wait(lk);
+    }
+}
+
+void CheckpointWriter::writerEntry() {
+    std::vector<char> data;
+    while (true) {
+        {
+            std::unique_lock<std::mutex> lk(mMutex);
+            mWriting = false;
+            mCondition.notify_all();
+            while (!mHasPending && !mExit) {
+                mCondition.wait(lk);
+            }
+            // the queued one still goes out on exit
+            if (!mHasPending) {
+                break;
+            }
+            data.swap(mPending);
+            mHasPending = false;
+            mWriting = true;
+        }
+        if (writeFile(data)) {
+            std::cout << "\nwrite checkpoint to : " << mFilename <<
+                std::endl;
+        }
+    }
+}
+
+bool CheckpointWriter::writeFile(const std::vector<char>& data) const {
+    // write aside and rename, a preemption mid write leaves the last
+    // complete checkpoint in place
+    std::string tmpFilename = mFilename + ".tmp";
+    std::ofstream stream(tmpFilename.c_str(),
+        std::ios::out | std::ios::binary);
+    if (!stream.is_open()) {
+        std::cerr << "fail to write checkpoint " << mFilename << std::endl;
+        return false;
+    }
+    stream.write(data.data(), data.size());
+    stream.close();
+    if (stream.fail()) {
+        std::cerr << "fail to write checkpoint " << mFilename << std::endl;
+        std::remove(tmpFilename.c_str());
+        return false;
+    }
+    return replaceFile(tmpFilename, mFilename);
+}
+
+bool readCheckpoint(const std::string& filename, const std::string& tag,
+    CheckpointBuffer& buffer) {
+    MappedFile file;
+    // a writer that has to remove before it renames can leave only the
+    // complete tmp file behind
+    if (!file.open(filename) && !file.open(filename + ".tmp")) {
+        return false;
+    }
+    const CheckpointHeader* header =
+        reinterpret_cast<const CheckpointHeader*>(file.getData());
+    if (file.getSize() < sizeof(CheckpointHeader) ||
+        memcmp(header->magic, sCheckpointMagic,
+        sizeof(sCheckpointMagic)) != 0 ||
+        header->version != sCheckpointVersion ||
+        file.getSize() != sizeof(CheckpointHeader) + header->payloadSize) {
+        std::cerr << "checkpoint " << filename <<
+            " is in an unknown format" << std::endl;
+        return false;
+    }
+    if (strncmp(header->tag, tag.c_str(), sCheckpointTagSize) != 0) {
+        std::cerr << "checkpoint " << filename << " is from " <<
+            header->tag << " not " << tag << std::endl;
+        return false;
+    }
+    buffer.getData().clear();
+    buffer.putBytes(file.getData() + sizeof(CheckpointHeader),
+        header->payloadSize);
+    std::cout << "resume from checkpoint " << filename << std::endl;
+    return true;
+}
+
+}
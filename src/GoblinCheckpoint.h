@@ -0,0 +1,92 @@
+#ifndef GOBLIN_CHECKPOINT_H
+#define GOBLIN_CHECKPOINT_H
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstring>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace Goblin {
+
+// flat binary payload of a checkpoint, the renderers put their state in
+// and read it back in the same order
+class CheckpointBuffer {
+public:
+    CheckpointBuffer(): mReadOffset(0) {}
+
+    template<typename T>
+    void put(const T& value) {
+        putBytes(&value, sizeof(T));
+    }
+
+    void putBytes(const void* src, size_t size) {
+        const char* bytes = static_cast<const char*>(src);
+        mData.insert(mData.end(), bytes, bytes + size);
+    }
+
+    // false once the payload runs out
+    template<typename T>
+    bool get(T& value) {
+        return getBytes(&value, sizeof(T));
+    }
+
+    bool getBytes(void* dst, size_t size) {
+        if (mReadOffset + size > mData.size()) {
+            return false;
+        }
+        memcpy(dst, mData.data() + mReadOffset, size);
+        mReadOffset += size;
+        return true;
+    }
+
+    std::vector<char>& getData() { return mData; }
+
+private:
+    std::vector<char> mData;
+    size_t mReadOffset;
+};
+
+// writes checkpoints on its own thread so the render carries on while
+// the disk catches up. a checkpoint submitted before the previous one
+// hit the disk replaces the queued one, only the latest state matters
+class CheckpointWriter {
+public:
+    CheckpointWriter(const std::string& filename);
+
+    // flushes the queued checkpoint
+    ~CheckpointWriter();
+
+    // tag tells the renderers apart so one doesn't resume from
+    // another's state
+    void submit(const std::string& tag, CheckpointBuffer& buffer);
+
+    // block till the queued checkpoint is on disk
+    void flush();
+
+private:
+    void writerEntry();
+
+    bool writeFile(const std::vector<char>& data) const;
+
+private:
+    std::string mFilename;
+    std::thread mThread;
+    std::mutex mMutex;
+    std::condition_variable mCondition;
+    std::vector<char> mPending;
+    bool mHasPending;
+    bool mWriting;
+    bool mExit;
+};
+
+// load a checkpoint written with tag, false if there is none or it
+// belongs to another renderer
+bool readCheckpoint(const std::string& filename, const std::string& tag,
+    CheckpointBuffer& buffer);
+
+}
+
+#endif //GOBLIN_CHECKPOINT_H
@@ -74,21 +74,29 @@ static RendererPtr createRenderer(const json& jsonContext) {
 	}
 	std::string method = setting.getString("render_method", "path_tracing");
 	std::cout << std::string(sDelimiterWidth, '-') << std::endl;
+	RendererPtr renderer;
 	if (method == "ao") {
-		return RendererPtr(createAO(setting));
+		renderer.reset(createAO(setting));
 	} else if (method == "whitted") {
-		return RendererPtr(createWhitted(setting));
+		renderer.reset(createWhitted(setting));
 	} else if (method == "path_tracing") {
-		return RendererPtr(createPathTracer(setting));
+		renderer.reset(createPathTracer(setting));
 	} else if (method == "light_tracing") {
-		return RendererPtr(createLightTracer(setting));
+		renderer.reset(createLightTracer(setting));
 	} else if (method == "bdpt") {
-		return RendererPtr(createBDPT(setting));
+		renderer.reset(createBDPT(setting));
 	} else if (method == "sppm") {
-		return RendererPtr(createSPPM(setting));
+		renderer.reset(createSPPM(setting));
 	} else {
-		return RendererPtr(createPathTracer(setting));
+		renderer.reset(createPathTracer(setting));
 	}
+	renderer->setAdaptiveSampling(getAdaptiveSamplingSetting(setting));
+	renderer->setProgressive(getProgressiveSetting(setting));
+	renderer->setCheckpoint(getCheckpointSetting(setting));
+	renderer->setProgressReport(getProgressReportSetting(setting));
+	renderer->setTiling(getTilingSetting(setting));
+	renderer->setSeed((uint64_t)setting.getInt("seed", 0));
+	return renderer;
 }
 
 static Filter* createFilter(const json& jsonContext) {
@@ -207,6 +215,88 @@ static VolumeRegion* createVolume(const json& jsonContext,
 	}
 }
 
+static void createAccelerator(const json& jsonContext,
+	SceneCache* sceneCache) {
+	std::cout << "accelerator" << std::endl;
+	std::cout << std::string(sDelimiterWidth, '-') << std::endl;
+	ParamSet acceleratorParams;
+	json::const_iterator it = jsonContext.find("accelerator");
+	if (it != jsonContext.end()) {
+		parseParamSet(it.value(), &acceleratorParams);
+	}
+	// BVH construction follows the renderer thread number unless
+	// it's specified explicitly
+	if (!acceleratorParams.hasInt("thread_num")) {
+		int threadNum = getMaxThreadNum();
+		json::const_iterator settingIt = jsonContext.find("render_setting");
+		if (settingIt != jsonContext.end()) {
+			json::const_iterator threadIt = settingIt->find("thread_num");
+			if (threadIt != settingIt->end() &&
+				threadIt->is_number_integer()) {
+				threadNum = threadIt.value();
+			}
+		}
+		acceleratorParams.setInt("thread_num", threadNum);
+	}
+	// mesh BVH cache directory is relative to the scene file
+	if (acceleratorParams.hasString("cache_dir")) {
+		acceleratorParams.setString("cache_dir", sceneCache->resolvePath(
+			acceleratorParams.getString("cache_dir")));
+	}
+	// so is the build report
+	if (acceleratorParams.hasString("report")) {
+		acceleratorParams.setString("report", sceneCache->resolvePath(
+			acceleratorParams.getString("report")));
+	}
+	std::cout << std::string(sDelimiterWidth, '-') << std::endl;
+	sceneCache->setAcceleratorParams(acceleratorParams);
+}
+
+static json toJSON(const BVHReport& report) {
+	json result;
+	result["primitives"] = report.primitivesNum;
+	result["references"] = report.referencesNum;
+	result["interior_nodes"] = report.interiorNodesNum;
+	result["leaves"] = report.leavesNum;
+	result["max_depth"] = report.maxDepth;
+	result["sah_cost"] = report.sahCost;
+	result["overlap"] = {
+		{"mean", report.meanOverlap},
+		{"max", report.maxOverlap}};
+	result["leaf_size_histogram"] = report.leafSizeHistogram;
+	result["leaf_depth_histogram"] = report.leafDepthHistogram;
+	result["memory_bytes"] = {
+		{"binary_nodes", report.binaryNodesBytes},
+		{"wide_nodes", report.wideNodesBytes},
+		{"triangles", report.trianglesBytes},
+		{"primitives", report.primitivesBytes},
+		{"total", report.binaryNodesBytes + report.wideNodesBytes +
+			report.trianglesBytes + report.primitivesBytes}};
+	result["mapped_from_cache"] = report.mappedFromCache;
+	return result;
+}
+
+// build report of the top level BVH and every shared mesh BVH
+static void writeBVHReport(const std::string& filename, const Scene& scene,
+	const SceneCache& sceneCache) {
+	json report;
+	report["scene"] = toJSON(scene.getBVH()->getReport());
+	json meshes = json::object();
+	std::vector<std::pair<std::string, BVHPtr> > meshBVHs;
+	sceneCache.getMeshBVHs(meshBVHs);
+	for (size_t i = 0; i < meshBVHs.size(); ++i) {
+		meshes[meshBVHs[i].first] = toJSON(meshBVHs[i].second->getReport());
+	}
+	report["meshes"] = meshes;
+	std::ofstream file(filename.c_str());
+	if (!file.is_open()) {
+		std::cerr << "can't write BVH report to " << filename << std::endl;
+		return;
+	}
+	file << report.dump(4) << std::endl;
+	std::cout << "write BVH report to : " << filename << std::endl;
+}
+
 static void createGeometries(const json& jsonContext, SceneCache* sceneCache,
 	std::vector<Geometry*>& geometries) {
 	json::const_iterator it = jsonContext.find("geometries");
@@ -239,6 +329,13 @@ static void createGeometries(const json& jsonContext, SceneCache* sceneCache,
 			std::cout << std::string(sDelimiterWidth, '-') << std::endl;
 			sceneCache->addGeometry(name, geometry);
 			geometries.push_back(geometry);
+			// bottom level BVH is built once per mesh here and shared
+			// by all the models and instances referencing it
+			const PolygonMesh* mesh = geometry->getTriangleMesh();
+			if (mesh) {
+				sceneCache->addMeshBVH(geometry, BVHPtr(createBVH(mesh,
+					sceneCache->getAcceleratorParams())));
+			}
 		}
 	}
 }
@@ -380,6 +477,8 @@ static void createPrimitives(const json& jsonContext, SceneCache* sceneCache,
 			std::cout << "BBox center: " << bbox.center() << std::endl;
 			if (type == "instance") {
 				sceneCache->addInstance(primitive);
+				sceneCache->addNamedInstance(name,
+					static_cast<InstancedPrimitive*>(primitive));
 			}
 			std::cout << std::string(sDelimiterWidth, '-') << std::endl;
 		}
@@ -484,6 +583,7 @@ RenderContext* ContextLoader::load(const std::string& filename) {
 	}
 
 	RendererPtr renderer = createRenderer(jsonContext);
+	createAccelerator(jsonContext, &sceneCache);
 	std::vector<Geometry*> geometries;
 	std::vector<Primitive*> primitives;
 	CameraPtr camera = createCamera(
@@ -497,7 +597,14 @@ RenderContext* ContextLoader::load(const std::string& filename) {
 
     ScenePtr scene(new Scene(sceneCache.getInstances(), camera,
 		std::move(geometries), std::move(primitives),
-		sceneCache.getLights(), volume));
+		sceneCache.getLights(), volume,
+		sceneCache.getAcceleratorParams(),
+		sceneCache.getNamedInstances()));
+	const ParamSet& acceleratorParams = sceneCache.getAcceleratorParams();
+	if (acceleratorParams.hasString("report")) {
+		writeBVHReport(acceleratorParams.getString("report"), *scene,
+			sceneCache);
+	}
 
     RenderContext* ctx = new RenderContext(renderer, scene);
     return ctx;
@@ -1,12 +1,37 @@
 #include "GoblinFilm.h"
+#include "GoblinCheckpoint.h"
 #include "GoblinFilter.h"
 #include "GoblinUtils.h"
 #include "GoblinSampler.h"
 #include "GoblinImageIO.h"
+#include "GoblinMappedFile.h"
 
+#include <cstdio>
 #include <cstring>
+#include <fstream>
 
 namespace Goblin {
+static const int sMergeBlockSize = 32;
+
+static const char sPartialFilmMagic[4] = {'G', 'P', 'F', 'M'};
+static const uint32_t sPartialFilmVersion = 1;
+
+// followed by xCount * yCount row major PartialPixel of the image rect
+struct PartialFilmHeader {
+    char magic[4];
+    uint32_t version;
+    int32_t xRes, yRes;
+    int32_t xStart, yStart, xCount, yCount;
+    uint64_t sampleCount;
+    uint32_t normalize;
+    uint32_t toneMapping;
+    float bloomRadius, bloomWeight;
+};
+
+struct PartialPixel {
+    float r, g, b, weight;
+};
+
 FilterTable::FilterTable(const Filter* filter):
     mFilterWidth(filter->getXWidth(), filter->getYWidth()) {
     // precompute filter equation as a lookup table
@@ -37,10 +62,13 @@ float FilterTable::evaluate(float x, float y) const {
 }
 
 ImageTile::ImageTile(const ImageRect& tileRect,
-    const FilterTable& cachedFilter):
-    mTileRect(tileRect), mPixels(nullptr),
+    const FilterTable& cachedFilter, bool trackVariance):
+    mTileRect(tileRect), mPixels(nullptr), mVariances(nullptr),
     mCachedFilter(cachedFilter) {
     mPixels = new Pixel[mTileRect.xCount * mTileRect.yCount];
+    if (trackVariance) {
+        mVariances = new PixelVariance[mTileRect.xCount * mTileRect.yCount];
+    }
 }
 
 ImageTile::~ImageTile() {
@@ -48,6 +76,10 @@ ImageTile::~ImageTile() {
         delete [] mPixels;
         mPixels = nullptr;
     }
+    if (mVariances) {
+        delete [] mVariances;
+        mVariances = nullptr;
+    }
 }
 
 void ImageTile::getTileRange(int* xStart, int *xEnd,
@@ -58,42 +90,121 @@ void ImageTile::getTileRange(int* xStart, int *xEnd,
     *yEnd = mTileRect.yStart + mTileRect.yCount;
 }
 
-void ImageTile::addSample(float imageX, float imageY, const Color& L) {
-    if (L.isNaN()) {
-		std::cout << "sample ("<< imageX << " " << imageY
-            << ") generate NaN point, discard this sample" << std::endl;
-        return;
-    }
+// run accumulate(x, y, w) for every pixel of rect the filter centered
+// at the sample reaches
+template<typename Accumulate>
+static void filterSample(const ImageRect& rect,
+    const FilterTable& cachedFilter, float imageX, float imageY,
+    Accumulate accumulate) {
     // transform continuous space sample to discrete space
     float dImageX = imageX - 0.5f;
     float dImageY = imageY - 0.5f;
     // calculate the pixel range covered by filter center at sample
-    const Vector2 filterWidth = mCachedFilter.getFilterWidth();
+    const Vector2 filterWidth = cachedFilter.getFilterWidth();
     int x0 = ceilInt(dImageX - filterWidth.x);
     int x1 = floorInt(dImageX + filterWidth.x);
     int y0 = ceilInt(dImageY - filterWidth.y);
     int y1 = floorInt(dImageY + filterWidth.y);
-    x0 = std::max(x0, mTileRect.xStart);
-    x1 = std::min(x1, mTileRect.xStart + mTileRect.xCount - 1);
-    y0 = std::max(y0, mTileRect.yStart);
-    y1 = std::min(y1, mTileRect.yStart + mTileRect.yCount - 1);
+    x0 = std::max(x0, rect.xStart);
+    x1 = std::min(x1, rect.xStart + rect.xCount - 1);
+    y0 = std::max(y0, rect.yStart);
+    y1 = std::min(y1, rect.yStart + rect.yCount - 1);
 
     for (int y = y0; y <= y1; ++y) {
         for (int x = x0; x <= x1; ++x) {
-            float w = mCachedFilter.evaluate(x - dImageX, y - dImageY);
-            int index = (y - mTileRect.yStart) * mTileRect.xCount +
-                (x - mTileRect.xStart);
-            mPixels[index].color += w * L;
-            mPixels[index].weight += w;
+            float w = cachedFilter.evaluate(x - dImageX, y - dImageY);
+            accumulate(rect.pixelToOffset(x, y), w);
         }
     }
 }
 
+static bool discardNaN(float imageX, float imageY, const Color& L) {
+    if (L.isNaN()) {
+		std::cout << "sample ("<< imageX << " " << imageY
+            << ") generate NaN point, discard this sample" << std::endl;
+        return true;
+    }
+    return false;
+}
+
+void ImageTile::addSample(float imageX, float imageY, const Color& L) {
+    if (discardNaN(imageX, imageY, L)) {
+        return;
+    }
+    Pixel* pixels = mPixels;
+    filterSample(mTileRect, mCachedFilter, imageX, imageY,
+        [pixels, &L](int index, float w) {
+            pixels[index].color += w * L;
+            pixels[index].weight += w;
+        });
+    if (mVariances) {
+        int x = floorInt(imageX);
+        int y = floorInt(imageY);
+        if (x >= mTileRect.xStart && x < mTileRect.xStart + mTileRect.xCount &&
+            y >= mTileRect.yStart && y < mTileRect.yStart + mTileRect.yCount) {
+            mVariances[mTileRect.pixelToOffset(x, y)].add(L.luminance());
+        }
+    }
+}
+
+// no fetch_add for floats before c++20
+static inline void atomicAdd(std::atomic<float>& target, float value) {
+    float current = target.load(std::memory_order_relaxed);
+    while (!target.compare_exchange_weak(current, current + value,
+        std::memory_order_relaxed)) {}
+}
+
+SplatFilm::SplatFilm(const ImageRect& rect,
+    const FilterTable& cachedFilter):
+    mRect(rect), mPixels(new AtomicPixel[rect.pixelNum()]),
+    mCachedFilter(cachedFilter) {
+    clear();
+}
+
+void SplatFilm::clear() {
+    for (int i = 0; i < mRect.pixelNum(); ++i) {
+        mPixels[i].r.store(0.0f, std::memory_order_relaxed);
+        mPixels[i].g.store(0.0f, std::memory_order_relaxed);
+        mPixels[i].b.store(0.0f, std::memory_order_relaxed);
+        mPixels[i].weight.store(0.0f, std::memory_order_relaxed);
+    }
+}
+
+void SplatFilm::addSample(float imageX, float imageY, const Color& L) {
+    if (discardNaN(imageX, imageY, L)) {
+        return;
+    }
+    AtomicPixel* pixels = mPixels.get();
+    filterSample(mRect, mCachedFilter, imageX, imageY,
+        [pixels, &L](int index, float w) {
+            // the filter tails are mostly zero, skip the cas for them
+            if (w == 0.0f) {
+                return;
+            }
+            AtomicPixel& pixel = pixels[index];
+            atomicAdd(pixel.r, w * L.r);
+            atomicAdd(pixel.g, w * L.g);
+            atomicAdd(pixel.b, w * L.b);
+            atomicAdd(pixel.weight, w);
+        });
+}
+
+Pixel SplatFilm::getPixel(int x, int y) const {
+    const AtomicPixel& p = mPixels[mRect.pixelToOffset(x, y)];
+    Pixel pixel;
+    pixel.color = Color(p.r.load(std::memory_order_relaxed),
+        p.g.load(std::memory_order_relaxed),
+        p.b.load(std::memory_order_relaxed));
+    pixel.weight = p.weight.load(std::memory_order_relaxed);
+    return pixel;
+}
+
 Film::Film(int xRes, int yRes, const float crop[4],
     Filter* filter, const std::string& filename,
     bool toneMapping,
     float bloomRadius, float bloomWeight):
     mXRes(xRes), mYRes(yRes), mFilter(filter), mCachedFilter(filter),
+    mTraversalCostPixels(nullptr), mPixelVariances(nullptr),
     mFilename(filename), mToneMapping(toneMapping),
     mBloomRadius(bloomRadius), mBloomWeight(bloomWeight) {
 
@@ -106,6 +217,10 @@ Film::Film(int xRes, int yRes, const float crop[4],
 
     mPixels = new Pixel[mXRes * mYRes];
 
+    mMergeBlocksX = (mXRes + sMergeBlockSize - 1) / sMergeBlockSize;
+    mMergeBlocksY = (mYRes + sMergeBlockSize - 1) / sMergeBlockSize;
+    mMergeLocks.reset(new std::mutex[mMergeBlocksX * mMergeBlocksY]);
+
     mInvXRes = 1.0f / (float)mXRes;
     mInvYRes = 1.0f / (float)mYRes;
 }
@@ -115,6 +230,14 @@ Film::~Film() {
         delete[] mPixels;
         mPixels = nullptr;
     }
+    if (mTraversalCostPixels != nullptr) {
+        delete[] mTraversalCostPixels;
+        mTraversalCostPixels = nullptr;
+    }
+    if (mPixelVariances != nullptr) {
+        delete[] mPixelVariances;
+        mPixelVariances = nullptr;
+    }
     if (mFilter != nullptr) {
         delete mFilter;
         mFilter = nullptr;
@@ -137,7 +260,7 @@ void Film::getSampleRange(SampleRange& sampleRange) const {
     sampleRange.yEnd = floorInt(mYStart + 0.5f + mYCount + yWidth);
 }
 
-void Film::mergeTile(const ImageTile& tile) {
+static void mergeTileTo(const ImageTile& tile, Pixel* pixels, int xRes) {
     int xStart, xEnd, yStart, yEnd;
     tile.getTileRange(&xStart, &xEnd, &yStart, &yEnd);
     const Pixel* tileBuffer = tile.getTileBuffer();
@@ -145,11 +268,153 @@ void Film::mergeTile(const ImageTile& tile) {
     for (int y = yStart; y < yEnd; ++y) {
         for (int x = xStart; x < xEnd; ++x) {
             int tileIndex = (y - yStart) * tileWidth + (x - xStart);
+            int filmIndex = y * xRes + x;
+            pixels[filmIndex].color += tileBuffer[tileIndex].color;
+            pixels[filmIndex].weight += tileBuffer[tileIndex].weight;
+        }
+    }
+}
+
+void Film::getTileRect(const SampleRange& sampleRange,
+    ImageRect& tileRect) const {
+    // same footprint ImageTile::addSample computes for a single sample
+    float xWidth = mFilter->getXWidth();
+    float yWidth = mFilter->getYWidth();
+    int x0 = std::max(ceilInt(sampleRange.xStart - 0.5f - xWidth), mXStart);
+    int x1 = std::min(floorInt(sampleRange.xEnd - 0.5f + xWidth),
+        mXStart + mXCount - 1);
+    int y0 = std::max(ceilInt(sampleRange.yStart - 0.5f - yWidth), mYStart);
+    int y1 = std::min(floorInt(sampleRange.yEnd - 0.5f + yWidth),
+        mYStart + mYCount - 1);
+    tileRect.xStart = x0;
+    tileRect.yStart = y0;
+    tileRect.xCount = std::max(x1 - x0 + 1, 0);
+    tileRect.yCount = std::max(y1 - y0 + 1, 0);
+}
+
+void Film::mergeTile(const ImageTile& tile) {
+    int xStart, xEnd, yStart, yEnd;
+    tile.getTileRange(&xStart, &xEnd, &yStart, &yEnd);
+    if (xStart >= xEnd || yStart >= yEnd) {
+        return;
+    }
+    int bx0 = xStart / sMergeBlockSize;
+    int bx1 = (xEnd - 1) / sMergeBlockSize;
+    int by0 = yStart / sMergeBlockSize;
+    int by1 = (yEnd - 1) / sMergeBlockSize;
+    // always locked in row major order so two merges can't deadlock
+    for (int by = by0; by <= by1; ++by) {
+        for (int bx = bx0; bx <= bx1; ++bx) {
+            mMergeLocks[by * mMergeBlocksX + bx].lock();
+        }
+    }
+    mergeTileTo(tile, mPixels, mXRes);
+    const PixelVariance* tileVariances = tile.getVarianceBuffer();
+    if (mPixelVariances && tileVariances) {
+        int tileWidth = xEnd - xStart;
+        for (int y = yStart; y < yEnd; ++y) {
+            for (int x = xStart; x < xEnd; ++x) {
+                mPixelVariances[y * mXRes + x].merge(
+                    tileVariances[(y - yStart) * tileWidth + (x - xStart)]);
+            }
+        }
+    }
+    for (int by = by0; by <= by1; ++by) {
+        for (int bx = bx0; bx <= bx1; ++bx) {
+            mMergeLocks[by * mMergeBlocksX + bx].unlock();
+        }
+    }
+}
+
+void Film::mergeSplatFilm(const SplatFilm& splatFilm) {
+    const ImageRect& r = splatFilm.getRect();
+    for (int y = r.yStart; y < r.yStart + r.yCount; ++y) {
+        for (int x = r.xStart; x < r.xStart + r.xCount; ++x) {
+            Pixel pixel = splatFilm.getPixel(x, y);
             int filmIndex = y * mXRes + x;
-            mPixels[filmIndex].color += tileBuffer[tileIndex].color;
-            mPixels[filmIndex].weight += tileBuffer[tileIndex].weight;
+            mPixels[filmIndex].color += pixel.color;
+            mPixels[filmIndex].weight += pixel.weight;
+        }
+    }
+}
+
+void Film::trackVariance() {
+    if (mPixelVariances == nullptr) {
+        mPixelVariances = new PixelVariance[mXRes * mYRes];
+    }
+}
+
+int Film::markUnconvergedPixels(float threshold, uint32_t maxSamples,
+    std::vector<uint8_t>& mask) const {
+    mask.assign(mXRes * mYRes, 0);
+    if (mPixelVariances == nullptr) {
+        return 0;
+    }
+    int unconvergedNum = 0;
+    for (int y = mYStart; y < mYStart + mYCount; ++y) {
+        for (int x = mXStart; x < mXStart + mXCount; ++x) {
+            int index = y * mXRes + x;
+            const PixelVariance& v = mPixelVariances[index];
+            if (v.n < maxSamples && v.relativeError() > threshold) {
+                mask[index] = 1;
+                ++unconvergedNum;
+            }
+        }
+    }
+    return unconvergedNum;
+}
+
+void Film::mergeTraversalCostTile(const ImageTile& tile) {
+    std::lock_guard<std::mutex> lk(mTraversalCostMutex);
+    if (mTraversalCostPixels == nullptr) {
+        mTraversalCostPixels = new Pixel[mXRes * mYRes];
+    }
+    mergeTileTo(tile, mTraversalCostPixels, mXRes);
+}
+
+// blue for cheap, through green and yellow to red for the costliest
+static Color heatColor(float t) {
+    t = clamp(t, 0.0f, 1.0f);
+    if (t < 0.5f) {
+        return Color(0.0f, 2.0f * t, 1.0f - 2.0f * t);
+    }
+    return Color(2.0f * t - 1.0f, 2.0f - 2.0f * t, 0.0f);
+}
+
+void Film::writeTraversalCostImage() const {
+    if (mTraversalCostPixels == nullptr) {
+        return;
+    }
+    std::vector<float> costs(mXRes * mYRes, 0.0f);
+    float maxCost = 0.0f;
+    for (size_t i = 0; i < costs.size(); ++i) {
+        const Pixel& pixel = mTraversalCostPixels[i];
+        if (pixel.weight > 0.0f) {
+            costs[i] = pixel.color.r / pixel.weight;
+            maxCost = std::max(maxCost, costs[i]);
         }
     }
+    if (maxCost == 0.0f) {
+        // renderers that do not splat the cost per sample
+        return;
+    }
+    std::vector<Color> colors(costs.size());
+    float invMaxCost = 1.0f / maxCost;
+    for (size_t i = 0; i < costs.size(); ++i) {
+        colors[i] = heatColor(costs[i] * invMaxCost);
+    }
+    // goblin.exr -> goblin_traversal.exr
+    std::string filename = mFilename;
+    size_t dot = filename.find_last_of('.');
+    size_t slash = filename.find_last_of("/\\");
+    if (dot == std::string::npos ||
+        (slash != std::string::npos && dot < slash)) {
+        dot = filename.size();
+    }
+    filename.insert(dot, "_traversal");
+    std::cout << "max traversal cost per sample " << maxCost <<
+        ", write heatmap to : " << filename << std::endl;
+    Goblin::writeImage(filename, colors.data(), mXRes, mYRes, false);
 }
 
 void Film::scaleImage(float scale) {
@@ -191,6 +456,185 @@ void Film::writeImage(bool normalize) {
     Goblin::writeImage(mFilename, colors.data(), mXRes, mYRes, mToneMapping);
 }
 
+bool Film::writePartialFilm(uint64_t sampleCount, bool normalize) const {
+    if (mPartialFilename.empty()) {
+        return false;
+    }
+    PartialFilmHeader header;
+    memcpy(header.magic, sPartialFilmMagic, sizeof(sPartialFilmMagic));
+    header.version = sPartialFilmVersion;
+    header.xRes = mXRes;
+    header.yRes = mYRes;
+    header.xStart = mXStart;
+    header.yStart = mYStart;
+    header.xCount = mXCount;
+    header.yCount = mYCount;
+    header.sampleCount = sampleCount;
+    header.normalize = normalize ? 1 : 0;
+    header.toneMapping = mToneMapping ? 1 : 0;
+    header.bloomRadius = mBloomRadius;
+    header.bloomWeight = mBloomWeight;
+    std::vector<PartialPixel> pixels(mXCount * mYCount);
+    for (int y = 0; y < mYCount; ++y) {
+        for (int x = 0; x < mXCount; ++x) {
+            const Pixel& p = mPixels[(y + mYStart) * mXRes + x + mXStart];
+            PartialPixel& pp = pixels[y * mXCount + x];
+            pp.r = p.color.r;
+            pp.g = p.color.g;
+            pp.b = p.color.b;
+            pp.weight = p.weight;
+        }
+    }
+    // write aside and rename, the merge never picks up a partial file
+    std::string tmpFilename = mPartialFilename + ".tmp";
+    std::ofstream stream(tmpFilename.c_str(),
+        std::ios::out | std::ios::binary);
+    if (!stream.is_open()) {
+        std::cerr << "fail to write partial film " << mPartialFilename <<
+            std::endl;
+        return false;
+    }
+    stream.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    stream.write(reinterpret_cast<const char*>(pixels.data()),
+        pixels.size() * sizeof(PartialPixel));
+    stream.close();
+    if (stream.fail()) {
+        std::cerr << "fail to write partial film " << mPartialFilename <<
+            std::endl;
+        std::remove(tmpFilename.c_str());
+        return false;
+    }
+    if (!replaceFile(tmpFilename, mPartialFilename)) {
+        return false;
+    }
+    std::cout << "write partial film to : " << mPartialFilename << std::endl;
+    return true;
+}
+
+void Film::saveState(CheckpointBuffer& buffer) const {
+    buffer.put(mXRes);
+    buffer.put(mYRes);
+    buffer.put(mXStart);
+    buffer.put(mYStart);
+    buffer.put(mXCount);
+    buffer.put(mYCount);
+    buffer.putBytes(mPixels, sizeof(Pixel) * mXRes * mYRes);
+}
+
+bool Film::loadState(CheckpointBuffer& buffer) {
+    int xRes, yRes;
+    if (!buffer.get(xRes) || !buffer.get(yRes) ||
+        xRes != mXRes || yRes != mYRes) {
+        std::cerr << "checkpoint film resolution mismatch" << std::endl;
+        return false;
+    }
+    // the sums outside the crop are zero, another crop would mix
+    // rendered and unrendered pixels
+    int xStart, yStart, xCount, yCount;
+    if (!buffer.get(xStart) || !buffer.get(yStart) ||
+        !buffer.get(xCount) || !buffer.get(yCount) ||
+        xStart != mXStart || yStart != mYStart ||
+        xCount != mXCount || yCount != mYCount) {
+        std::cerr << "checkpoint film crop mismatch" << std::endl;
+        return false;
+    }
+    return buffer.getBytes(mPixels, sizeof(Pixel) * mXRes * mYRes);
+}
+
+// the crop has to fit the film or the merge writes past its pixels
+static bool isCropInsideFilm(const PartialFilmHeader& header) {
+    return header.xRes > 0 && header.yRes > 0 &&
+        header.xStart >= 0 && header.yStart >= 0 &&
+        header.xCount >= 0 && header.yCount >= 0 &&
+        (int64_t)header.xStart + header.xCount <= header.xRes &&
+        (int64_t)header.yStart + header.yCount <= header.yRes;
+}
+
+bool mergePartialFilms(const std::vector<std::string>& inputs,
+    const std::string& output) {
+    if (inputs.empty()) {
+        return false;
+    }
+    PartialFilmHeader first = PartialFilmHeader();
+    std::vector<Pixel> pixels;
+    uint64_t sampleCount = 0;
+    for (size_t i = 0; i < inputs.size(); ++i) {
+        MappedFile file;
+        if (!file.open(inputs[i])) {
+            std::cerr << "fail to read partial film " << inputs[i] <<
+                std::endl;
+            return false;
+        }
+        const PartialFilmHeader* header =
+            reinterpret_cast<const PartialFilmHeader*>(file.getData());
+        if (file.getSize() < sizeof(PartialFilmHeader) ||
+            memcmp(header->magic, sPartialFilmMagic,
+            sizeof(sPartialFilmMagic)) != 0 ||
+            header->version != sPartialFilmVersion ||
+            !isCropInsideFilm(*header) ||
+            file.getSize() != sizeof(PartialFilmHeader) +
+            (size_t)header->xCount * header->yCount * sizeof(PartialPixel)) {
+            std::cerr << "partial film " << inputs[i] <<
+                " is in an unknown format" << std::endl;
+            return false;
+        }
+        if (i == 0) {
+            first = *header;
+            pixels.resize((size_t)first.xRes * first.yRes);
+        } else if (header->xRes != first.xRes ||
+            header->yRes != first.yRes ||
+            header->normalize != first.normalize) {
+            std::cerr << "partial film " << inputs[i] <<
+                " belongs to a different film" << std::endl;
+            return false;
+        } else if (!first.normalize && (header->xStart != first.xStart ||
+            header->yStart != first.yStart ||
+            header->xCount != first.xCount ||
+            header->yCount != first.yCount)) {
+            // the splats of every sample land all over the crop, only
+            // renders of the same crop share the area / samples scale
+            std::cerr << "partial film " << inputs[i] <<
+                " has a different crop, splatting renders can only be " <<
+                "merged across seeds" << std::endl;
+            return false;
+        }
+        const PartialPixel* partialPixels =
+            reinterpret_cast<const PartialPixel*>(
+            file.getData() + sizeof(PartialFilmHeader));
+        for (int y = 0; y < header->yCount; ++y) {
+            for (int x = 0; x < header->xCount; ++x) {
+                const PartialPixel& pp = partialPixels[y * header->xCount + x];
+                Pixel& p = pixels[(y + header->yStart) * first.xRes +
+                    x + header->xStart];
+                p.color += Color(pp.r, pp.g, pp.b);
+                p.weight += pp.weight;
+            }
+        }
+        sampleCount += header->sampleCount;
+    }
+
+    std::vector<Color> colors(pixels.size(), Color::Black);
+    float scale = first.normalize || sampleCount == 0 ? 1.0f :
+        (float)(first.xCount * first.yCount) / (float)sampleCount;
+    for (size_t i = 0; i < pixels.size(); ++i) {
+        if (first.normalize) {
+            if (pixels[i].weight > 0.0f) {
+                colors[i] = pixels[i].color / pixels[i].weight;
+            }
+        } else {
+            colors[i] = pixels[i].color * scale;
+        }
+    }
+    std::cout << "merged " << inputs.size() << " partial films, " <<
+        sampleCount << " samples, write image to : " << output << std::endl;
+    if (first.bloomRadius > 0.0f && first.bloomWeight > 0.0f) {
+        Goblin::bloom(colors.data(), first.xRes, first.yRes,
+            first.bloomRadius, first.bloomWeight);
+    }
+    return Goblin::writeImage(output, colors.data(), first.xRes, first.yRes,
+        first.toneMapping != 0);
+}
+
 void Film::addDebugLine(const DebugLine& l, const Color& c) {
     mDebugLines.push_back(std::pair<DebugLine, Color>(l, c));
 }
@@ -199,6 +643,17 @@ void Film::addDebugPoint(const Vector2& p, const Color& c) {
     mDebugPoints.push_back(std::pair<Vector2, Color>(p, c));
 }
 
+SplatFilmMode getSplatFilmMode(const ParamSet& params) {
+    std::string mode = params.getString("splat_film", "tile");
+    if (mode == "shared") {
+        return SplatFilmShared;
+    } else if (mode != "tile") {
+        std::cerr << "unrecognized splat_film " << mode <<
+            ", fall back to tile" << std::endl;
+    }
+    return SplatFilmTile;
+}
+
 Film* createImageFilm(const ParamSet& params, Filter* filter) {
 	Vector2 res = params.getVector2("resolution", Vector2(512, 512));
 	int xRes = static_cast<int>(res.x);
@@ -213,8 +668,10 @@ Film* createImageFilm(const ParamSet& params, Filter* filter) {
 	bool toneMapping = params.getBool("tone_mapping");
 	float bloomRadius = params.getFloat("bloom_radius");
 	float bloomWeight = params.getFloat("bloom_weight");
-	return new Film(xRes, yRes, crop, filter, filePath,
+	Film* film = new Film(xRes, yRes, crop, filter, filePath,
 		toneMapping, bloomRadius, bloomWeight);
+	film->setPartialFilename(params.getString("partial_file", ""));
+	return film;
 }
 
 } // namespace Goblin
\ No newline at end of file
@@ -6,9 +6,13 @@
 #include "GoblinUtils.h"
 #include "GoblinVector.h"
 
+#include <atomic>
+#include <mutex>
+
 namespace Goblin {
 
 const int FILTER_TABLE_WIDTH = 16;
+class CheckpointBuffer;
 class Sample;
 struct SampleRange;
 class Filter;
@@ -22,6 +26,51 @@ public:
     float pad[3];
 };
 
+// running luminance mean and variance of the samples that land in a
+// pixel (Welford), tiles combine with the parallel form of the update
+struct PixelVariance {
+    PixelVariance(): n(0), mean(0.0f), m2(0.0f) {}
+
+    void add(float x) {
+        ++n;
+        float delta = x - mean;
+        mean += delta / n;
+        m2 += delta * (x - mean);
+    }
+
+    void merge(const PixelVariance& rhs) {
+        if (rhs.n == 0) {
+            return;
+        }
+        if (n == 0) {
+            *this = rhs;
+            return;
+        }
+        float total = (float)(n + rhs.n);
+        float delta = rhs.mean - mean;
+        mean += delta * rhs.n / total;
+        m2 += rhs.m2 + delta * delta * ((float)n * rhs.n / total);
+        n += rhs.n;
+    }
+
+    float variance() const {
+        return n > 1 ? m2 / (n - 1) : 0.0f;
+    }
+
+    // standard error of the mean over the mean, the floor keeps near
+    // black pixels from soaking up the whole budget
+    float relativeError() const {
+        if (n < 2) {
+            return INFINITY;
+        }
+        return sqrt(variance() / n) / (mean + 1e-2f);
+    }
+
+    uint32_t n;
+    float mean;
+    float m2;
+};
+
 struct ImageRect {
 	ImageRect() = default;
 
@@ -57,9 +106,18 @@ private:
     Vector2 mFilterWidth;
 };
 
-class ImageTile {
+// anything the integrators splat filtered samples into
+class SampleSplatter {
 public:
-    ImageTile(const ImageRect& tileRect, const FilterTable& cachedFilter);
+    virtual ~SampleSplatter() {}
+
+    virtual void addSample(float imageX, float imageY, const Color& L) = 0;
+};
+
+class ImageTile : public SampleSplatter {
+public:
+    ImageTile(const ImageRect& tileRect, const FilterTable& cachedFilter,
+        bool trackVariance = false);
 
     ~ImageTile();
 
@@ -70,11 +128,51 @@ public:
 		return mPixels;
 	}
 
-    void addSample(float imageX, float imageY, const Color& L);
+    // nullptr unless the tile tracks the variance
+    const PixelVariance* getVarianceBuffer() const {
+        return mVariances;
+    }
+
+    // a variance tracking tile also feeds L into the stats of the pixel
+    // the sample lands in
+    void addSample(float imageX, float imageY, const Color& L) override;
 
 private:
     ImageRect mTileRect;
     Pixel* mPixels;
+    PixelVariance* mVariances;
+    const FilterTable& mCachedFilter;
+};
+
+// a single image rect sized buffer all the render threads splat into,
+// the channels are accumulated with atomic float adds so the scattered
+// writes of the light tracing strategies never take a lock. costs one
+// film resolution instead of a full frame tile per thread
+class SplatFilm : public SampleSplatter {
+public:
+    SplatFilm(const ImageRect& rect, const FilterTable& cachedFilter);
+
+    void addSample(float imageX, float imageY, const Color& L) override;
+
+    // not synchronized, for the pass boundaries after a merge
+    void clear();
+
+    const ImageRect& getRect() const { return mRect; }
+
+    // not synchronized, only read it after the splatting is done
+    Pixel getPixel(int x, int y) const;
+
+    size_t getMemoryBytes() const {
+        return sizeof(AtomicPixel) * mRect.pixelNum();
+    }
+
+private:
+    struct AtomicPixel {
+        std::atomic<float> r, g, b, weight;
+    };
+
+    ImageRect mRect;
+    std::unique_ptr<AtomicPixel[]> mPixels;
     const FilterTable& mCachedFilter;
 };
 
@@ -99,6 +197,11 @@ public:
 
     void getSampleRange(SampleRange& sampleRange) const;
 
+    // pixels the samples in sampleRange can reach through the filter,
+    // clipped to the image rect
+    void getTileRect(const SampleRange& sampleRange,
+        ImageRect& tileRect) const;
+
     const FilterTable& getFilterTable() const {
         return mCachedFilter;
     }
@@ -107,8 +210,48 @@ public:
 
     void writeImage(bool normalize = true);
 
+    // thread safe, only the merge blocks the tile overlaps get locked
+    // so neighbor tiles finishing at the same time rarely wait
     void mergeTile(const ImageTile& tile);
 
+    void mergeSplatFilm(const SplatFilm& splatFilm);
+
+    // start tracking the per pixel variance, the tiles merged after it
+    // have to track it too
+    void trackVariance();
+
+    bool isTrackingVariance() const { return mPixelVariances != nullptr; }
+
+    // set the mask (row major, film resolution) for the image rect
+    // pixels with fewer than maxSamples samples and a relative error
+    // above threshold, clear the rest. returns the count of set ones
+    int markUnconvergedPixels(float threshold, uint32_t maxSamples,
+        std::vector<uint8_t>& mask) const;
+
+    // per pixel traversal cost accumulated like the radiance, written
+    // as a false color heatmap next to the film output
+    void mergeTraversalCostTile(const ImageTile& tile);
+
+    void writeTraversalCostImage() const;
+
+    // the raw color and weight sums of the image rect plus the sample
+    // count behind them, mergePartialFilms combines the output of several
+    // processes (other crops or seeds) into the final image. normalize
+    // tells how the merge resolves the sums: color / weight for the
+    // camera driven renderers, film area / sampleCount scaling for the
+    // splatting ones. does nothing without a partial_file
+    bool writePartialFilm(uint64_t sampleCount, bool normalize) const;
+
+    void setPartialFilename(const std::string& filename) {
+        mPartialFilename = filename;
+    }
+
+    // the accumulation buffer for a render checkpoint, loadState fails
+    // on a checkpoint of a different resolution
+    void saveState(CheckpointBuffer& buffer) const;
+
+    bool loadState(CheckpointBuffer& buffer);
+
     void addDebugLine(const DebugLine& l, const Color& c);
 
     void addDebugPoint(const Vector2& p, const Color& c);
@@ -121,7 +264,15 @@ private:
     Filter* mFilter;
     FilterTable mCachedFilter;
     Pixel* mPixels;
+    // one lock per sMergeBlockSize square block of pixels
+    std::unique_ptr<std::mutex[]> mMergeLocks;
+    int mMergeBlocksX, mMergeBlocksY;
+    std::mutex mTraversalCostMutex;
+    // allocated on the first traversal cost merge
+    Pixel* mTraversalCostPixels;
+    PixelVariance* mPixelVariances;
     std::string mFilename;
+    std::string mPartialFilename;
     bool mToneMapping;
     float mBloomRadius;
     float mBloomWeight;
@@ -129,6 +280,21 @@ private:
     std::vector<std::pair<Vector2, Color> > mDebugPoints;
 };
 
+// how the splat heavy renderers (light tracer, bdpt) gather samples
+enum SplatFilmMode {
+    // a full frame tile per thread merged when the thread is done
+    SplatFilmTile,
+    // one shared SplatFilm
+    SplatFilmShared
+};
+
+SplatFilmMode getSplatFilmMode(const ParamSet& params);
+
+// sum the partial films in inputs into the image output, false if one
+// can't be read or they don't belong to the same film
+bool mergePartialFilms(const std::vector<std::string>& inputs,
+    const std::string& output);
+
 Film* createImageFilm(const ParamSet& params, Filter* filter);
 
 }
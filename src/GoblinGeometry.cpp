@@ -36,6 +36,14 @@ void Fragment::transform(const Transform& t) {
     mIsUpdated = false;
 }
 
+void Fragment::transform(const AffineTransform& t) {
+    mPosition = t.onPoint(mPosition);
+    mNormal = normalize(t.onNormal(mNormal));
+    mDPDU = t.onVector(mDPDU);
+    mDPDV = t.onVector(mDPDV);
+    mIsUpdated = false;
+}
+
 Vector3 Geometry::sample(const Vector3& p, float u1, float u2,
     Vector3* normal) const {
     return sample(u1, u2, normal);
@@ -6,7 +6,9 @@
 #include "GoblinMatrix.h"
 
 namespace Goblin {
+class AffineTransform;
 class BBox;
+class PolygonMesh;
 class Ray;
 class Transform;
 
@@ -113,6 +115,8 @@ public:
 
     void transform(const Transform& t);
 
+    void transform(const AffineTransform& t);
+
 private:
     Vector3 mPosition;
     Vector3 mNormal;
@@ -160,6 +164,10 @@ public:
     virtual BBox getObjectBound() const = 0;
 
     virtual void refine(GeometryList& refinedGeometries) const;
+
+    // triangle mesh that can be built into a BVH directly without
+    // refining it into Triangle geometries first
+    virtual const PolygonMesh* getTriangleMesh() const { return nullptr; }
 };
 
 inline Vector3 Geometry::sample(float u1, float u2,
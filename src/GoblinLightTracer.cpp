@@ -10,56 +10,67 @@ public:
     LightTraceTask(LightTracer* lightTracer, const CameraPtr& camera,
         const ScenePtr& scene, const SampleRange& sampleRange,
         const SampleQuota& sampleQuota, int samplePerPixel,
-        int maxPathLength, RenderProgress* renderProgress);
+        int maxPathLength, RenderProgress* renderProgress,
+        SplatFilm* splatFilm);
     ~LightTraceTask();
     void run(TLSPtr& tls);
 private:
     const LightTracer* mLightTracer;
     std::vector<PathVertex> mPathVertices;
+    // nullptr for the per thread full frame tiles
+    SplatFilm* mSplatFilm;
 };
 
 LightTraceTask::LightTraceTask(LightTracer* lightTracer,
     const CameraPtr& camera, const ScenePtr& scene,
     const SampleRange& sampleRange,
     const SampleQuota& sampleQuota, int samplePerPixel,
-    int maxPathLength, RenderProgress* renderProgress):
+    int maxPathLength, RenderProgress* renderProgress,
+    SplatFilm* splatFilm):
     RenderTask(lightTracer, camera, scene, sampleRange, sampleQuota,
     samplePerPixel, renderProgress),
-    mLightTracer(lightTracer), mPathVertices(maxPathLength + 1) {}
+    mLightTracer(lightTracer), mPathVertices(maxPathLength + 1),
+    mSplatFilm(splatFilm) {}
 
 LightTraceTask::~LightTraceTask() {}
 
 void LightTraceTask::run(TLSPtr& tls) {
     RenderingTLS* renderingTLS = static_cast<RenderingTLS*>(tls.get());
-    ImageTile* tile = renderingTLS->getTile();
+    SampleSplatter* splatter = mSplatFilm ?
+        static_cast<SampleSplatter*>(mSplatFilm) : renderingTLS->getTile();
 
-    Sampler sampler(mSampleRange, mSamplePerPixel, mSampleQuota, mRNG);
+    Sampler sampler(mSampleRange, mSamplePerPixel, mSampleQuota, &mRNG);
+    sampler.setSampleIndexOffset(mSampleIndexOffset);
+    sampler.setSeed(mRenderer->getSeed());
     int batchAmount = sampler.maxSamplesPerRequest();
     Sample* samples = sampler.allocateSampleBuffer(batchAmount);
+    RayCounts raysBefore = threadRayCounts();
     int sampleNum = 0;
     uint64_t totalSampleCount = 0;
     while ((sampleNum = sampler.requestSamples(samples)) > 0) {
         for (int s = 0; s <sampleNum; ++s) {
-            //mLightTracer->splatFilmT0(mScene, samples[s], *mRNG,
-            //    mPathVertices, tile);
+            //mLightTracer->splatFilmT0(mScene, samples[s], mRNG,
+            //    mPathVertices, splatter);
 
-            mLightTracer->splatFilmT1(mScene, samples[s], *mRNG,
-                mPathVertices, tile);
+            mLightTracer->splatFilmT1(mScene, samples[s], mRNG,
+                mPathVertices, splatter);
 
-            //mLightTracer->splatFilmS1(mScene, samples[s], *mRNG,
-            //    mPathVertices, tile);
+            //mLightTracer->splatFilmS1(mScene, samples[s], mRNG,
+            //    mPathVertices, splatter);
         }
         totalSampleCount += sampleNum;
     }
     renderingTLS->addSampleCount(totalSampleCount);
     delete [] samples;
-    mRenderProgress->update();
+    mRenderProgress->update(totalSampleCount,
+        threadRayCounts() - raysBefore);
 }
 
 LightTracer::LightTracer(int samplePerPixel, int threadNum,
-    int maxPathLength):
+    int maxPathLength, SplatFilmMode splatFilmMode):
     Renderer(samplePerPixel, threadNum),
-    mTotalSamplesNum(0), mMaxPathLength(maxPathLength) {}
+    mTotalSamplesNum(0), mMaxPathLength(maxPathLength),
+    mSplatFilmMode(splatFilmMode) {}
 
 LightTracer::~LightTracer() {}
 
@@ -72,7 +83,7 @@ Color LightTracer::Li(const ScenePtr& scene, const RayDifferential& ray,
 
 void LightTracer::splatFilmT1(const ScenePtr& scene, const Sample& sample,
     const RNG& rng, std::vector<PathVertex>& pathVertices,
-    ImageTile* tile) const {
+    SampleSplatter* splatter) const {
     if (scene->getLights().size() == 0) {
         return;
     }
@@ -166,13 +177,13 @@ void LightTracer::splatFilmT1(const ScenePtr& scene, const Sample& sample,
         float fsE = camera->evalWe(pCamera, pvPos);
         Color pathContribution = fsL * fsE * G *
             pv.throughput * cVertex.throughput;
-        tile->addSample(filmPixel.x, filmPixel.y, pathContribution);
+        splatter->addSample(filmPixel.x, filmPixel.y, pathContribution);
     }
 }
 
 void LightTracer::splatFilmT0(const ScenePtr& scene, const Sample& sample,
     const RNG& rng, std::vector<PathVertex>& pathVertices,
-    ImageTile* tile) const {
+    SampleSplatter* splatter) const {
     if (scene->getLights().size() == 0) {
         return;
     }
@@ -215,7 +226,7 @@ void LightTracer::splatFilmT0(const ScenePtr& scene, const Sample& sample,
             if (filmPixel != Camera::sInvalidPixel) {
                 Color L = light->eval(pLight, nLight, dirLight);
                 float We = camera->evalWe(pCamera, pS_1);
-                tile->addSample(filmPixel.x, filmPixel.y,
+                splatter->addSample(filmPixel.x, filmPixel.y,
                     L * We * pathVertices[lightVertex].throughput);
             }
             break;
@@ -238,7 +249,7 @@ void LightTracer::splatFilmT0(const ScenePtr& scene, const Sample& sample,
 
 void LightTracer::splatFilmS1(const ScenePtr& scene, const Sample& sample,
     const RNG& rng, std::vector<PathVertex>& pathVertices,
-    ImageTile* tile) const {
+    SampleSplatter* splatter) const {
     if (scene->getLights().size() == 0) {
         return;
     }
@@ -327,7 +338,7 @@ void LightTracer::splatFilmS1(const ScenePtr& scene, const Sample& sample,
         }
         Color pathContribution = fsL * fsE * G *
             pv.throughput * lVertex.throughput;
-        tile->addSample(filmPixel.x, filmPixel.y, pathContribution);
+        splatter->addSample(filmPixel.x, filmPixel.y, pathContribution);
     }
 }
 
@@ -339,30 +350,35 @@ void LightTracer::render(const ScenePtr& scene) {
 
     std::vector<SampleRange> sampleRanges;
     getSampleRanges(film, sampleRanges);
-    std::vector<Task*> lightTraceTasks;
-    RenderProgress progress((int)sampleRanges.size());
-    for (size_t i = 0; i < sampleRanges.size(); ++i) {
-        lightTraceTasks.push_back(new LightTraceTask(this,
-            camera, scene, sampleRanges[i], sampleQuota, mSamplePerPixel,
-            mMaxPathLength, &progress));
+    std::unique_ptr<SplatFilm> splatFilm;
+    if (mSplatFilmMode == SplatFilmShared) {
+        ImageRect filmRect;
+        film->getImageRect(filmRect);
+        splatFilm.reset(new SplatFilm(filmRect, film->getFilterTable()));
     }
-
-    RenderingTLSManager tlsManager(film);
+    RenderProgress progress(mProgressReport, getExpectedSampleNum(film));
+    auto splatStart = std::chrono::steady_clock::now();
+    RenderingTLSManager tlsManager(film, !splatFilm);
     ThreadPool threadPool(mThreadNum, &tlsManager);
-    threadPool.enqueue(lightTraceTasks);
-    threadPool.waitForAll();
-    //clean up
-    for (size_t i = 0; i < lightTraceTasks.size(); ++i) {
-        delete lightTraceTasks[i];
-    }
-    lightTraceTasks.clear();
+    renderSplatPasses(scene, "lighttracer", threadPool, tlsManager,
+        progress, sampleRanges, splatFilm.get(),
+        [&](const SampleRange& sampleRange, int samplePerPixel,
+        RenderProgress* renderProgress) -> RenderTask* {
+        return new LightTraceTask(this, camera, scene, sampleRange,
+            sampleQuota, samplePerPixel, mMaxPathLength, renderProgress,
+            splatFilm.get());
+    });
+    reportSplatFilm(film, splatFilm.get(), std::chrono::duration<double>(
+        std::chrono::steady_clock::now() - splatStart).count());
 
     ImageRect filmRect;
     film->getImageRect(filmRect);
     float filmArea = (float)(filmRect.xCount * filmRect.yCount);
+    film->writePartialFilm(tlsManager.getTotalSampleCount(), false);
     film->scaleImage(filmArea / tlsManager.getTotalSampleCount());
     drawDebugData(tlsManager.getDebugData(), camera);
     film->writeImage(false);
+    tlsManager.reportTraversalStats();
 }
 
 void LightTracer::querySampleQuota(const ScenePtr& scene,
@@ -395,6 +411,7 @@ Renderer* createLightTracer(const ParamSet& params) {
     int samplePerPixel = params.getInt("sample_per_pixel", 1);
     int threadNum = params.getInt("thread_num", getMaxThreadNum());
 	int maxPathLength = std::max(1, params.getInt("max_ray_depth", 5));
-    return new LightTracer(samplePerPixel, threadNum, maxPathLength);
+    return new LightTracer(samplePerPixel, threadNum, maxPathLength,
+        getSplatFilmMode(params));
 }
 }
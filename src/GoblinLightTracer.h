@@ -10,7 +10,8 @@ namespace Goblin {
 class LightTracer : public Renderer {
 public:
     LightTracer(int samplePerPixel, int threadNum,
-        int maxPathLength = 5);
+        int maxPathLength = 5,
+        SplatFilmMode splatFilmMode = SplatFilmTile);
 
     ~LightTracer();
 
@@ -26,7 +27,7 @@ public:
     // path tracing technique
     void splatFilmT1(const ScenePtr& scene, const Sample& sample,
         const RNG& rng, std::vector<PathVertex>& pathVertices,
-        ImageTile* tile) const;
+        SampleSplatter* splatter) const;
     // t = 0 strategy
     // random walk a particle path from light source and only contribute
     // to film when the last intersection hit the camera lens. This is
@@ -35,7 +36,7 @@ public:
     // compare to other strategy
     void splatFilmT0(const ScenePtr& scene, const Sample& sample,
         const RNG& rng, std::vector<PathVertex>& pathVertices,
-        ImageTile* tile) const;
+        SampleSplatter* splatter) const;
 
     // s = 1 strategy
     // random walk a particle path from camera and and connect to one
@@ -43,13 +44,14 @@ public:
     // implemented.
     void splatFilmS1(const ScenePtr& scene, const Sample& sample,
         const RNG& rng, std::vector<PathVertex>& pathVertices,
-        ImageTile* tile) const;
+        SampleSplatter* splatter) const;
 
     void querySampleQuota(const ScenePtr& scene,
         SampleQuota* sampleQuota);
 private:
     uint64_t mTotalSamplesNum;
     int mMaxPathLength;
+    SplatFilmMode mSplatFilmMode;
 };
 
 Renderer* createLightTracer(const ParamSet &params);
@@ -0,0 +1,106 @@
+#include "GoblinMappedFile.h"
+
+#if defined(_WIN32) || defined(_WIN64)
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace Goblin {
+
+#if defined(_WIN32) || defined(_WIN64)
+
+MappedFile::MappedFile(): mData(nullptr), mSize(0),
+    mFileHandle(INVALID_HANDLE_VALUE), mMappingHandle(nullptr) {}
+
+bool MappedFile::open(const std::string& filename) {
+    close();
+    HANDLE file = CreateFileA(filename.c_str(), GENERIC_READ,
+        FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL,
+        nullptr);
+    if (file == INVALID_HANDLE_VALUE) {
+        return false;
+    }
+    LARGE_INTEGER size;
+    if (!GetFileSizeEx(file, &size) || size.QuadPart == 0) {
+        CloseHandle(file);
+        return false;
+    }
+    HANDLE mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY,
+        0, 0, nullptr);
+    if (mapping == nullptr) {
+        CloseHandle(file);
+        return false;
+    }
+    void* data = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+    if (data == nullptr) {
+        CloseHandle(mapping);
+        CloseHandle(file);
+        return false;
+    }
+    mFileHandle = file;
+    mMappingHandle = mapping;
+    mData = static_cast<const char*>(data);
+    mSize = static_cast<size_t>(size.QuadPart);
+    return true;
+}
+
+void MappedFile::close() {
+    if (mData) {
+        UnmapViewOfFile(mData);
+        CloseHandle(mMappingHandle);
+        CloseHandle(mFileHandle);
+    }
+    mData = nullptr;
+    mSize = 0;
+    mFileHandle = INVALID_HANDLE_VALUE;
+    mMappingHandle = nullptr;
+}
+
+#else
+
+MappedFile::MappedFile(): mData(nullptr), mSize(0) {}
+
+bool MappedFile::open(const std::string& filename) {
+    close();
+    int fd = ::open(filename.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0) {
+        ::close(fd);
+        return false;
+    }
+    void* data = mmap(nullptr, static_cast<size_t>(st.st_size), PROT_READ,
+        MAP_PRIVATE, fd, 0);
+    // the mapping holds its own reference to the file
+    ::close(fd);
+    if (data == MAP_FAILED) {
+        return false;
+    }
+    mData = static_cast<const char*>(data);
+    mSize = static_cast<size_t>(st.st_size);
+    return true;
+}
+
+void MappedFile::close() {
+    if (mData) {
+        munmap(const_cast<char*>(mData), mSize);
+    }
+    mData = nullptr;
+    mSize = 0;
+}
+
+#endif
+
+MappedFile::~MappedFile() {
+    close();
+}
+
+}
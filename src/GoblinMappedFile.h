@@ -0,0 +1,45 @@
+#ifndef GOBLIN_MAPPED_FILE_H
+#define GOBLIN_MAPPED_FILE_H
+
+#include <cstddef>
+#include <string>
+
+namespace Goblin {
+
+// read only view of a whole file mapped into memory, the content stays
+// valid till the MappedFile is destroyed
+class MappedFile {
+public:
+    MappedFile();
+
+    ~MappedFile();
+
+    bool open(const std::string& filename);
+
+    void close();
+
+    const char* getData() const {
+        return mData;
+    }
+
+    size_t getSize() const {
+        return mSize;
+    }
+
+private:
+    MappedFile(const MappedFile&);
+
+    MappedFile& operator=(const MappedFile&);
+
+private:
+    const char* mData;
+    size_t mSize;
+#if defined(_WIN32) || defined(_WIN64)
+    void* mFileHandle;
+    void* mMappingHandle;
+#endif
+};
+
+}
+
+#endif //GOBLIN_MAPPED_FILE_H
@@ -8,10 +8,19 @@
 namespace Goblin {
 
 Model::Model(const Geometry* geometry, const MaterialPtr& material,
-    const AreaLight* areaLight, bool isCameraLens):
+    const AreaLight* areaLight, bool isCameraLens,
+    const ParamSet& acceleratorParams, const BVHPtr& meshBVH):
     mGeometry(geometry), mMaterial(material), mAreaLight(areaLight),
-    mIsCameraLens(isCameraLens) {
-	if (!mGeometry->intersectable()) {
+    mIsCameraLens(isCameraLens), mBVH(meshBVH) {
+	if (mBVH) {
+		return;
+	}
+	if (!mGeometry->intersectable() && mGeometry->getTriangleMesh()) {
+		// triangle mesh goes straight into a BVH of flatten triangles,
+		// no per triangle Model needed
+		mBVH.reset(createBVH(mGeometry->getTriangleMesh(),
+			acceleratorParams));
+	} else if (!mGeometry->intersectable()) {
 		GeometryList refinedGeometries;
 		mGeometry->refine(refinedGeometries);
 		mRefinedModels.reserve(refinedGeometries.size());
@@ -21,12 +30,15 @@ Model::Model(const Geometry* geometry, const MaterialPtr& material,
 		}
 		PrimitiveList primitives;
 		primitives.push_back(this);
-		mBVH.reset(new BVH(primitives, 1, "equal_count"));
+		mBVH.reset(createBVH(primitives, acceleratorParams));
 	}
 }
 
 bool Model::occluded(const Ray& ray, IntersectFilter f) const {
 	if (mBVH) {
+		if (mRefinedModels.empty() && f != nullptr && !f(this, ray)) {
+			return false;
+		}
 		return mBVH->occluded(ray, f);
 	} else {
 		if (f != nullptr && !f(this, ray)) {
@@ -37,9 +49,31 @@ bool Model::occluded(const Ray& ray, IntersectFilter f) const {
 }
 
 bool Model::intersect(const Ray& ray, float* epsilon, 
+    Intersection* intersection, IntersectFilter f) const {
+	bool hit = intersectDeferred(ray, epsilon, intersection, f);
+	if (hit) {
+		intersection->resolve(ray);
+	}
+	return hit;
+}
+
+bool Model::intersectDeferred(const Ray& ray, float* epsilon,
     Intersection* intersection, IntersectFilter f) const {
 	if (mBVH) {
-		return mBVH->intersect(ray, epsilon, intersection, f);
+		if (mRefinedModels.empty()) {
+			// mesh BVH only records the hit, the filter and the
+			// primitive are on this Model
+			if (f != nullptr && !f(this, ray)) {
+				return false;
+			}
+			bool hit = mBVH->intersectDeferred(ray, epsilon,
+				intersection, f);
+			if (hit) {
+				intersection->primitive = this;
+			}
+			return hit;
+		}
+		return mBVH->intersectDeferred(ray, epsilon, intersection, f);
 	} else {
 		if (f != nullptr && !f(this, ray)) {
 			return false;
@@ -48,11 +82,59 @@ bool Model::intersect(const Ray& ray, float* epsilon,
 			&intersection->fragment);
 		if (hit) {
 			intersection->primitive = this;
+			intersection->hitRecord.mesh = nullptr;
 		}
 		return hit;
 	}
 }
 
+// drop the rays the filter rejects for this Model
+static uint32_t filterPacket(const Primitive* p, const Ray* rays,
+	uint32_t activeMask, IntersectFilter f) {
+	if (f == nullptr) {
+		return activeMask;
+	}
+	for (int i = 0; i < RAY_PACKET_SIZE; ++i) {
+		uint32_t bit = 1u << i;
+		if ((activeMask & bit) && !f(p, rays[i])) {
+			activeMask &= ~bit;
+		}
+	}
+	return activeMask;
+}
+
+uint32_t Model::intersectPacket(const Ray* rays, uint32_t activeMask,
+	float* epsilons, Intersection* intersections, IntersectFilter f) const {
+	if (!mBVH) {
+		return Primitive::intersectPacket(rays, activeMask, epsilons,
+			intersections, f);
+	}
+	if (!mRefinedModels.empty()) {
+		return mBVH->intersectPacket(rays, activeMask, epsilons,
+			intersections, f);
+	}
+	activeMask = filterPacket(this, rays, activeMask, f);
+	uint32_t hitMask = mBVH->intersectPacket(rays, activeMask, epsilons,
+		intersections, f);
+	for (int i = 0; i < RAY_PACKET_SIZE; ++i) {
+		if (hitMask & (1u << i)) {
+			intersections[i].primitive = this;
+		}
+	}
+	return hitMask;
+}
+
+uint32_t Model::occludedPacket(const Ray* rays, uint32_t activeMask,
+	IntersectFilter f) const {
+	if (!mBVH) {
+		return Primitive::occludedPacket(rays, activeMask, f);
+	}
+	if (mRefinedModels.empty()) {
+		activeMask = filterPacket(this, rays, activeMask, f);
+	}
+	return mBVH->occludedPacket(rays, activeMask, f);
+}
+
 BBox Model::getAABB() const {
     return mGeometry->getObjectBound();
 }
@@ -78,7 +160,8 @@ Primitive* createModel(const ParamSet& params,
     }
     bool isCameraLens = params.getBool("is_camera_lens");
 	return new Model(geometry, material, areaLight,
-		isCameraLens);
+		isCameraLens, sceneCache.getAcceleratorParams(),
+		sceneCache.getMeshBVH(geometry));
 }
 
 }
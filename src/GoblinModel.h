@@ -1,16 +1,18 @@
 #ifndef GOBLIN_MODEL_H
 #define GOBLIN_MODEL_H
+#include "GoblinBVH.h"
 #include "GoblinPrimitive.h"
 #include "GoblinLight.h"
+#include "GoblinParamSet.h"
 
 namespace Goblin {
 
-class BVH;
-
 class Model : public Primitive {
 public:
 	Model(const Geometry* geometry, const MaterialPtr& material,
-		const AreaLight* areaLight, bool isCameraLens);
+		const AreaLight* areaLight, bool isCameraLens,
+		const ParamSet& acceleratorParams = ParamSet(),
+		const BVHPtr& meshBVH = BVHPtr());
 
 	bool intersectable() const override {
 		return mBVH ? true : mGeometry->intersectable();
@@ -19,8 +21,18 @@ public:
 	bool intersect(const Ray& ray, float* epsilon,
 		Intersection* intersection, IntersectFilter f) const override;
 
+	bool intersectDeferred(const Ray& ray, float* epsilon,
+		Intersection* intersection, IntersectFilter f) const override;
+
 	bool occluded(const Ray& ray, IntersectFilter f) const override;
 
+	uint32_t intersectPacket(const Ray* rays, uint32_t activeMask,
+		float* epsilons, Intersection* intersections,
+		IntersectFilter f) const override;
+
+	uint32_t occludedPacket(const Ray* rays, uint32_t activeMask,
+		IntersectFilter f) const override;
+
 	bool isCameraLens() const override {
 		return mIsCameraLens;
 	}
@@ -43,10 +55,10 @@ private:
     const AreaLight* mAreaLight;
     bool mIsCameraLens;
     std::vector<Model> mRefinedModels;
-	std::unique_ptr<BVH> mBVH;
+	// bottom level BVH, shared with the other models on the same mesh
+	BVHPtr mBVH;
 };
 
-class ParamSet;
 class SceneCache;
 
 Primitive* createModel(const ParamSet& params,
@@ -2,6 +2,7 @@
 #include "GoblinTriangle.h"
 #include "GoblinScene.h"
 #include "GoblinParamSet.h"
+#include "GoblinRay.h"
 
 #include <iostream>
 #include <fstream>
@@ -281,6 +282,55 @@ void PolygonMesh::refine(GeometryList& refinedGeometries) const {
     }
 }
 
+void PolygonMesh::computeFragment(size_t index, const Ray& ray, float t,
+    float b1, float b2, Fragment* fragment) const {
+    const TriangleIndex& ti = mTriangles[index];
+    const Vertex& v0 = mVertices[ti.v[0]];
+    const Vertex& v1 = mVertices[ti.v[1]];
+    const Vertex& v2 = mVertices[ti.v[2]];
+    Vector3 e1 = v1.position - v0.position;
+    Vector3 e2 = v2.position - v0.position;
+    float b0 = 1.0f - b1 - b2;
+    // start collect intersection geometry info:
+    // position, normal, uv, dpdu, dpdv....
+    Vector3 position(ray(t));
+    Vector3 normal;
+    if (mHasNormal) {
+        normal = normalize(b0 * v0.normal + b1 * v1.normal + b2 * v2.normal);
+    } else {
+        normal = normalize(cross(e1, e2));
+    }
+
+    Vector2 uvs[3];
+    if (mHasTexCoord) {
+        uvs[0] = v0.texC;
+        uvs[1] = v1.texC;
+        uvs[2] = v2.texC;
+    } else {
+        uvs[0] = Vector2(0.0f, 0.0f);
+        uvs[1] = Vector2(1.0f, 0.0f);
+        uvs[2] = Vector2(0.0f, 1.0f);
+    }
+    Vector2 uv(b0 * uvs[0] + b1 * uvs[1] + b2 * uvs[2]);
+
+    float du1 = uvs[1].x - uvs[0].x;
+    float dv1 = uvs[1].y - uvs[0].y;
+    float du2 = uvs[2].x - uvs[0].x;
+    float dv2 = uvs[2].y - uvs[0].y;
+    float determinant = du1 * dv2 - dv1 * du2;
+    Vector3 dpdu, dpdv;
+    if (determinant == 0.0f) {
+        // form a random shading coordinate from normal then
+        dpdu = normalize(e1 - dot(normal, e1) * normal);
+        dpdv = cross(normal, dpdu);
+    } else {
+        float invDet = 1.0f / determinant;
+        dpdu = invDet * (dv2 * e1 - dv1 * e2);
+        dpdv = invDet * (-du2 * e1 + du1 * e2);
+    }
+    *fragment = Fragment(position, normal, uv, dpdu, dpdv);
+}
+
 void PolygonMesh::recalculateArea() {
     mArea = 0.0f;
     for (size_t i = 0; i < mTriangles.size(); ++i) {
@@ -32,6 +32,15 @@ public:
 
     void refine(GeometryList& refinedGeometries) const override;
 
+    const PolygonMesh* getTriangleMesh() const override {
+        return this;
+    }
+
+    // fill in the Fragment of triangle index hit at t with
+    // barycentric coordinate (b1, b2)
+    void computeFragment(size_t index, const Ray& ray, float t,
+        float b1, float b2, Fragment* fragment) const;
+
 	const Vertex* getVertexPtr(size_t index) const {
 		return &mVertices[index];
 	}
@@ -40,6 +49,10 @@ public:
 		return &mTriangles[index];
 	}
 
+	size_t getTrianglesNum() const {
+		return mTriangles.size();
+	}
+
 	bool hasNormal() const {
 		return mHasNormal;
 	}
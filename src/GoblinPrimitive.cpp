@@ -1,10 +1,27 @@
 #include "GoblinParamSet.h"
+#include "GoblinPolygonMesh.h"
 #include "GoblinPrimitive.h"
 #include "GoblinRay.h"
 #include "GoblinScene.h"
 
 namespace Goblin {
 
+void Intersection::resolve(const Ray& ray) {
+	if (hitRecord.mesh == nullptr) {
+		return;
+	}
+	if (hitRecord.toWorld) {
+		Ray r = hitRecord.toWorld->invertRay(ray);
+		hitRecord.mesh->computeFragment(hitRecord.triangleIndex, r,
+			hitRecord.t, hitRecord.b1, hitRecord.b2, &fragment);
+		fragment.transform(*hitRecord.toWorld);
+	} else {
+		hitRecord.mesh->computeFragment(hitRecord.triangleIndex, ray,
+			hitRecord.t, hitRecord.b1, hitRecord.b2, &fragment);
+	}
+	hitRecord = HitRecord();
+}
+
 Color Intersection::Le(const Vector3& outDirection) {
 	Vector3 ps = fragment.getPosition();
 	Vector3 ns = fragment.getNormal();
@@ -96,16 +113,60 @@ void Intersection::computeUVDifferential(const RayDifferential& ray) {
 	fragment.setUVDifferential(dudx, dvdx, dudy, dvdy);
 }
 
+uint32_t Primitive::intersectPacket(const Ray* rays, uint32_t activeMask,
+	float* epsilons, Intersection* intersections, IntersectFilter f) const {
+	uint32_t hitMask = 0;
+	for (int i = 0; i < RAY_PACKET_SIZE; ++i) {
+		uint32_t bit = 1u << i;
+		if ((activeMask & bit) && intersectDeferred(rays[i],
+			&epsilons[i], &intersections[i], f)) {
+			hitMask |= bit;
+		}
+	}
+	return hitMask;
+}
+
+uint32_t Primitive::occludedPacket(const Ray* rays, uint32_t activeMask,
+	IntersectFilter f) const {
+	uint32_t occludedMask = 0;
+	for (int i = 0; i < RAY_PACKET_SIZE; ++i) {
+		uint32_t bit = 1u << i;
+		if ((activeMask & bit) && occluded(rays[i], f)) {
+			occludedMask |= bit;
+		}
+	}
+	return occludedMask;
+}
+
 InstancedPrimitive::InstancedPrimitive(const Transform& toWorld, 
 	const Primitive* primitive):
-	mToWorld(toWorld), mPrimitive(primitive) {}
+	mToWorld(toWorld),
+	mWorldBound(mToWorld.onBBox(primitive->getAABB())),
+	mPrimitive(primitive) {}
 
 bool InstancedPrimitive::intersect(const Ray& ray, float* epsilon, 
+	Intersection* intersection, IntersectFilter f) const {
+	bool hit = intersectDeferred(ray, epsilon, intersection, f);
+	if (hit) {
+		intersection->resolve(ray);
+	}
+	return hit;
+}
+
+bool InstancedPrimitive::intersectDeferred(const Ray& ray, float* epsilon,
 	Intersection* intersection, IntersectFilter f) const {
 	Ray r = mToWorld.invertRay(ray);
-	bool hit = mPrimitive->intersect(r, epsilon, intersection, f);
+	bool hit = mPrimitive->intersectDeferred(r, epsilon, intersection, f);
 	if (hit) {
-		intersection->fragment.transform(mToWorld);
+		HitRecord& hitRecord = intersection->hitRecord;
+		if (hitRecord.mesh && hitRecord.toWorld == nullptr) {
+			// keep it pending, resolve will redo the ray transform
+			hitRecord.toWorld = &mToWorld;
+		} else {
+			// nested instance, only one transform fits in the record
+			intersection->resolve(r);
+			intersection->fragment.transform(mToWorld);
+		}
 		ray.maxt = r.maxt;
 	}
 	return hit;
@@ -117,8 +178,58 @@ bool InstancedPrimitive::occluded(const Ray& ray,
 	return mPrimitive->occluded(r, f);
 }
 
+uint32_t InstancedPrimitive::intersectPacket(const Ray* rays,
+	uint32_t activeMask, float* epsilons, Intersection* intersections,
+	IntersectFilter f) const {
+	if ((activeMask & (activeMask - 1)) == 0) {
+		return Primitive::intersectPacket(rays, activeMask, epsilons,
+			intersections, f);
+	}
+	Ray r[RAY_PACKET_SIZE];
+	for (int i = 0; i < RAY_PACKET_SIZE; ++i) {
+		if (activeMask & (1u << i)) {
+			r[i] = mToWorld.invertRay(rays[i]);
+		}
+	}
+	uint32_t hitMask = mPrimitive->intersectPacket(r, activeMask,
+		epsilons, intersections, f);
+	for (int i = 0; i < RAY_PACKET_SIZE; ++i) {
+		if ((hitMask & (1u << i)) == 0) {
+			continue;
+		}
+		HitRecord& hitRecord = intersections[i].hitRecord;
+		if (hitRecord.mesh && hitRecord.toWorld == nullptr) {
+			hitRecord.toWorld = &mToWorld;
+		} else {
+			intersections[i].resolve(r[i]);
+			intersections[i].fragment.transform(mToWorld);
+		}
+		rays[i].maxt = r[i].maxt;
+	}
+	return hitMask;
+}
+
+uint32_t InstancedPrimitive::occludedPacket(const Ray* rays,
+	uint32_t activeMask, IntersectFilter f) const {
+	if ((activeMask & (activeMask - 1)) == 0) {
+		return Primitive::occludedPacket(rays, activeMask, f);
+	}
+	Ray r[RAY_PACKET_SIZE];
+	for (int i = 0; i < RAY_PACKET_SIZE; ++i) {
+		if (activeMask & (1u << i)) {
+			r[i] = mToWorld.invertRay(rays[i]);
+		}
+	}
+	return mPrimitive->occludedPacket(r, activeMask, f);
+}
+
 BBox InstancedPrimitive::getAABB() const {
-	return mToWorld.onBBox(mPrimitive->getAABB());
+	return mWorldBound;
+}
+
+void InstancedPrimitive::setTransform(const Transform& toWorld) {
+	mToWorld = AffineTransform(toWorld);
+	mWorldBound = mToWorld.onBBox(mPrimitive->getAABB());
 }
 
 Primitive* createInstance(const ParamSet& params,
@@ -7,14 +7,15 @@
 #include "GoblinBBox.h"
 #include "GoblinUtils.h"
 #include "GoblinLight.h"
+#include "GoblinRay.h"
 
-#include <vector>
 #include <exception>
+#include <map>
+#include <string>
+#include <vector>
 
 namespace Goblin {
 
-class Ray;
-class RayDifferential;
 /* temp notes:
 model = geometry + material
 instance = transform + any kind of primitive
@@ -29,9 +30,25 @@ instance::intersect -> transform the ray to object space
 class Primitive;
 typedef std::vector<const Primitive*> PrimitiveList;
 
+// closest mesh hit recorded during traversal, only the barycentric
+// coordinate is kept till Intersection::resolve builds the Fragment
+struct HitRecord {
+	HitRecord() : mesh(nullptr), toWorld(nullptr) {}
+
+	const PolygonMesh* mesh;
+	// instance transform the hit still needs to be moved through
+	const AffineTransform* toWorld;
+	uint32_t triangleIndex;
+	float t, b1, b2;
+};
+
 struct Intersection {
 	Intersection() : primitive(nullptr) {}
 
+	// build the Fragment from a pending HitRecord, nothing to do if
+	// the closest hit already filled in the Fragment
+	void resolve(const Ray& ray);
+
 	Color Le(const Vector3& outDirection);
 
 	const Light* getLight() const;
@@ -46,11 +63,31 @@ struct Intersection {
 
 	Fragment fragment;
 
+	HitRecord hitRecord;
+
 	const Primitive* primitive;
 };
 
 typedef bool (*IntersectFilter)(const Primitive* p, const Ray& ray);
 
+// a fixed size batch of rays traced together, see BVH::intersect for the
+// ray stream version, hits[i] tells whether rays[i] hit anything (or is
+// occluded for the shadow ray query)
+template<int N>
+struct RayPacket {
+	RayPacket() : raysNum(0) {}
+
+	void addRay(const Ray& ray) {
+		rays[raysNum++] = ray;
+	}
+
+	Ray rays[N];
+	float epsilons[N];
+	Intersection intersections[N];
+	bool hits[N];
+	int raysNum;
+};
+
 class Primitive {
 public:
 	virtual ~Primitive() = default;
@@ -67,9 +104,33 @@ public:
 	virtual bool intersect(const Ray& ray, float* epsilon,
 		Intersection* intersection, IntersectFilter f = nullptr) const = 0;
 
+	// hit stage of intersect used inside acceleration structures, it
+	// is allowed to leave a pending intersection->hitRecord instead of
+	// the Fragment, caller need to resolve it after traversal
+	virtual bool intersectDeferred(const Ray& ray, float* epsilon,
+		Intersection* intersection, IntersectFilter f = nullptr) const {
+		bool hit = intersect(ray, epsilon, intersection, f);
+		if (hit) {
+			intersection->hitRecord.mesh = nullptr;
+		}
+		return hit;
+	}
+
 	virtual bool occluded(const Ray& ray,
 		IntersectFilter f = nullptr) const = 0;
 
+	// packet version of intersectDeferred, only rays[i] with bit i set
+	// in activeMask are tested, return the mask of rays that found a
+	// closer hit. primitives holding a BVH override these to share the
+	// node visits, the default tests the rays one by one
+	virtual uint32_t intersectPacket(const Ray* rays, uint32_t activeMask,
+		float* epsilons, Intersection* intersections,
+		IntersectFilter f = nullptr) const;
+
+	// return the mask of the occluded rays
+	virtual uint32_t occludedPacket(const Ray* rays, uint32_t activeMask,
+		IntersectFilter f = nullptr) const;
+
 	virtual BBox getAABB() const = 0;
 
 	virtual const MaterialPtr& getMaterial() const {
@@ -98,15 +159,34 @@ public:
 	bool intersect(const Ray& ray, float* epsilon,
 		Intersection* intersection, IntersectFilter f) const override;
 
+	bool intersectDeferred(const Ray& ray, float* epsilon,
+		Intersection* intersection, IntersectFilter f) const override;
+
 	bool occluded(const Ray& ray, IntersectFilter f) const override;
 
+	uint32_t intersectPacket(const Ray* rays, uint32_t activeMask,
+		float* epsilons, Intersection* intersections,
+		IntersectFilter f) const override;
+
+	uint32_t occludedPacket(const Ray* rays, uint32_t activeMask,
+		IntersectFilter f) const override;
+
 	BBox getAABB() const override;
 
+	// the BVH containing this instance needs a refit afterward
+	void setTransform(const Transform& toWorld);
+
 private:
-	Transform mToWorld;
+	// instance level of the two level structure: the child primitive
+	// (and the mesh BVH under it) is shared, each instance only keeps
+	// a 3x4 transform pair and its world bound
+	AffineTransform mToWorld;
+	BBox mWorldBound;
 	const Primitive* mPrimitive;
 };
 
+typedef std::map<std::string, InstancedPrimitive*> InstanceMap;
+
 class ParamSet;
 class SceneCache;
 
@@ -29,6 +29,9 @@ inline Vector3 Ray::operator()(float t) const {
     return o + t * d;
 }
 
+// max rays traced as one packet, the active rays are an uint32_t mask
+const int RAY_PACKET_SIZE = 32;
+
 
 class RayDifferential : public Ray {
 public:
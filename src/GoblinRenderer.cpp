@@ -1,11 +1,14 @@
 #include "GoblinRenderer.h"
 #include "GoblinRay.h"
+#include "GoblinCheckpoint.h"
 #include "GoblinColor.h"
 #include "GoblinCamera.h"
 #include "GoblinFilm.h"
 #include "GoblinUtils.h"
 #include "GoblinVolume.h"
 
+#include <sstream>
+
 namespace Goblin {
 
 RenderTask::RenderTask(Renderer* renderer, const CameraPtr& camera,
@@ -15,63 +18,210 @@ RenderTask::RenderTask(Renderer* renderer, const CameraPtr& camera,
     mRenderer(renderer), mCamera(camera), mScene(scene),
     mSampleRange(sampleRange), mSampleQuota(sampleQuota), 
     mSamplePerPixel(samplePerPixel),
-    mRenderProgress(renderProgress) {
-    mRNG = new RNG();
-}
+    mRenderProgress(renderProgress), mPixelMask(nullptr),
+    mSampleIndexOffset(0) {}
 
-RenderTask::~RenderTask() {
-    if (mRNG) {
-        delete mRNG;
-        mRNG = nullptr;
-    }
-}
+RenderTask::~RenderTask() {}
 
 void RenderTask::run(TLSPtr& tls) {
     RenderingTLS* renderingTLS =
         static_cast<RenderingTLS*>(tls.get());
-    ImageTile* tile = renderingTLS->getTile();
+    // only the pixels this task can reach, merged once it's done
+    Film* film = mCamera->getFilm();
+    ImageRect tileRect;
+    film->getTileRect(mSampleRange, tileRect);
+    ImageTile tile(tileRect, film->getFilterTable(),
+        film->isTrackingVariance());
+#ifdef GOBLIN_TRAVERSAL_STATS
+    ImageTile traversalCostTile(tileRect, film->getFilterTable());
+#endif
 
-    Sampler sampler(mSampleRange, mSamplePerPixel, mSampleQuota, mRNG);
+    Sampler sampler(mSampleRange, mSamplePerPixel, mSampleQuota, &mRNG);
+    sampler.setSampleIndexOffset(mSampleIndexOffset);
+    sampler.setSeed(mRenderer->getSeed());
+    if (mPixelMask) {
+        sampler.setPixelMask(mPixelMask, film->getXResolution(),
+            film->getYResolution());
+    }
     int batchAmount = sampler.maxSamplesPerRequest();
     Sample* samples = sampler.allocateSampleBuffer(batchAmount);
+    RayCounts raysBefore = threadRayCounts();
+    RayDifferential* rays = new RayDifferential[batchAmount];
+    float* weights = new float[batchAmount];
+    Color* Ls = new Color[batchAmount];
     int sampleNum = 0;
+    uint64_t totalSampleCount = 0;
     while((sampleNum = sampler.requestSamples(samples)) > 0) {
+#ifdef GOBLIN_TRAVERSAL_STATS
+        TraversalStats statsBefore = threadTraversalStats();
+#endif
+        for (int s = 0; s < sampleNum; ++s) {
+            weights[s] = mCamera->generateRay(samples[s], &rays[s]);
+        }
+        mRenderer->batchLi(mScene, rays, samples, sampleNum, mRNG,
+            renderingTLS, Ls);
+        for (int s = 0; s < sampleNum; ++s) {
+            Color tr = mRenderer->transmittance(mScene, rays[s], mRNG);
+            Color Lv = mRenderer->Lv(mScene, rays[s], mRNG);
+            tile.addSample(samples[s].imageX, samples[s].imageY,
+                weights[s] * (tr * Ls[s] + Lv));
+        }
+#ifdef GOBLIN_TRAVERSAL_STATS
+        // the request is traced as a batch, spread its cost evenly
+        float cost = (float)(threadTraversalStats() - statsBefore).cost() /
+            (float)sampleNum;
         for (int s = 0; s < sampleNum; ++s) {
-            RayDifferential ray;
-            float w = mCamera->generateRay(samples[s], &ray);
-            Color L = mRenderer->Li(mScene, ray, samples[s], 
-                *mRNG, renderingTLS);
-            Color tr = mRenderer->transmittance(mScene, ray, *mRNG);
-            Color Lv = mRenderer->Lv(mScene, ray, *mRNG);
-            tile->addSample(samples[s].imageX, samples[s].imageY,
-                w * (tr * L + Lv));
+            traversalCostTile.addSample(samples[s].imageX,
+                samples[s].imageY, Color(cost));
         }
+#endif
+        totalSampleCount += sampleNum;
     }
+    renderingTLS->addSampleCount(totalSampleCount);
     delete [] samples;
-    mRenderProgress->update();
+    delete [] rays;
+    delete [] weights;
+    delete [] Ls;
+    film->mergeTile(tile);
+#ifdef GOBLIN_TRAVERSAL_STATS
+    film->mergeTraversalCostTile(traversalCostTile);
+#endif
+    mRenderProgress->update(totalSampleCount,
+        threadRayCounts() - raysBefore);
+}
+
+RenderProgress::RenderProgress(const ProgressReportSetting& setting,
+    uint64_t expectedSampleNum):
+    mTilesNum(0), mSamplesNum(0), mRaysNum(0), mShadowRaysNum(0),
+    mExpectedSampleNum(expectedSampleNum), mSetting(setting),
+    mStart(std::chrono::steady_clock::now()), mExit(false) {
+    if (!mSetting.filename.empty()) {
+        // a named pipe blocks here till the reader shows up
+        mReportStream.open(mSetting.filename.c_str(), std::ios::out);
+        if (!mReportStream.is_open()) {
+            std::cerr << "fail to open progress report " <<
+                mSetting.filename << std::endl;
+        }
+    }
+    mReporter = std::thread(&RenderProgress::reporterEntry, this);
 }
 
-RenderProgress::RenderProgress(int taskNum): 
-    mFinishedNum(0), mTasksNum(taskNum) {
+RenderProgress::~RenderProgress() {
+    {
+        std::lock_guard<std::mutex> lk(mExitMutex);
+        mExit = true;
+    }
+    mExitCondition.notify_all();
+    mReporter.join();
 }
 
-void RenderProgress::reset() {
-    std::lock_guard<std::mutex> lk(mUpdateMutex);
-    mFinishedNum = 0;
+void RenderProgress::update(uint64_t sampleNum, const RayCounts& rays) {
+    // plain counters, the reporter doesn't need them consistent with
+    // each other
+    mTilesNum.fetch_add(1, std::memory_order_relaxed);
+    mSamplesNum.fetch_add(sampleNum, std::memory_order_relaxed);
+    mRaysNum.fetch_add(rays.raysNum, std::memory_order_relaxed);
+    mShadowRaysNum.fetch_add(rays.shadowRaysNum,
+        std::memory_order_relaxed);
 }
 
-void RenderProgress::update() {
-    std::lock_guard<std::mutex> lk(mUpdateMutex);
-    mFinishedNum++;
-    std::cout.precision(3);
-    std::cout << "\rProgress: %" << 
-        (float)mFinishedNum / (float)mTasksNum * 100.0f <<
-        "                     ";
+RenderProgress::Snapshot RenderProgress::takeSnapshot() const {
+    Snapshot snapshot;
+    snapshot.seconds = std::chrono::duration<double>(
+        std::chrono::steady_clock::now() - mStart).count();
+    snapshot.tilesNum = mTilesNum.load(std::memory_order_relaxed);
+    snapshot.samplesNum = mSamplesNum.load(std::memory_order_relaxed);
+    snapshot.raysNum = mRaysNum.load(std::memory_order_relaxed);
+    snapshot.shadowRaysNum =
+        mShadowRaysNum.load(std::memory_order_relaxed);
+    return snapshot;
+}
 
+void RenderProgress::reporterEntry() {
+    Snapshot first = takeSnapshot();
+    Snapshot last = first;
+    std::unique_lock<std::mutex> lk(mExitMutex);
+    while (!mExit) {
+        if (mSetting.interval > 0.0f) {
+            mExitCondition.wait_for(lk,
+                std::chrono::duration<double>(mSetting.interval));
+        } else {
+            mExitCondition.wait(lk);
+        }
+        if (mExit) {
+            break;
+        }
+        lk.unlock();
+        Snapshot current = takeSnapshot();
+        report(current, last, false);
+        last = current;
+        lk.lock();
+    }
+    lk.unlock();
+    // the final report has the throughput of the whole render
+    report(takeSnapshot(), first, true);
+}
+
+void RenderProgress::report(const Snapshot& current, const Snapshot& last,
+    bool done) {
+    uint64_t expected = mExpectedSampleNum.load(std::memory_order_relaxed);
+    double progress = 1.0;
+    if (!done) {
+        progress = expected == 0 ? 0.0 :
+            std::min((double)current.samplesNum / (double)expected, 1.0);
+    }
+    double seconds = current.seconds - last.seconds;
+    double samplesPerSecond = 0.0;
+    double raysPerSecond = 0.0;
+    if (seconds > 0.0) {
+        samplesPerSecond =
+            (double)(current.samplesNum - last.samplesNum) / seconds;
+        raysPerSecond = (double)(current.raysNum - last.raysNum +
+            current.shadowRaysNum - last.shadowRaysNum) / seconds;
+    }
+    // from the average speed so far, the last interval alone is noisy
+    double eta = progress > 0.0 ?
+        current.seconds * (1.0 - progress) / progress : -1.0;
+
+    // formatted aside and written in one go, the console precision and
+    // whatever the main thread prints meanwhile stay untouched
+    std::ostringstream line;
+    line.precision(3);
+    if (done) {
+        line << "\rRender Complete! " << current.seconds <<
+            " seconds, " << raysPerSecond * 1e-6 << " Mrays/s" <<
+            "                     \n";
+    } else {
+        line << "\rProgress: %" << progress * 100.0 << ", " <<
+            raysPerSecond * 1e-6 << " Mrays/s, ETA ";
+        if (eta < 0.0) {
+            line << "-";
+        } else {
+            line << eta << "s";
+        }
+        line << "                     ";
+    }
+    std::cout << line.str();
     std::cout.flush();
-    if (mFinishedNum == mTasksNum) {
-        std::cout << "\rRender Complete!         " << std::endl;
-        std::cout.flush();
+
+    if (mReportStream.is_open()) {
+        mReportStream << "{\"elapsed\": " << current.seconds <<
+            ", \"progress\": " << progress <<
+            ", \"tiles\": " << current.tilesNum <<
+            ", \"samples\": " << current.samplesNum <<
+            ", \"rays\": " << current.raysNum <<
+            ", \"shadow_rays\": " << current.shadowRaysNum <<
+            ", \"samples_per_second\": " << samplesPerSecond <<
+            ", \"rays_per_second\": " << raysPerSecond <<
+            ", \"eta\": ";
+        if (eta < 0.0) {
+            mReportStream << "null";
+        } else {
+            mReportStream << eta;
+        }
+        // flushed every line, the other end of a pipe reads as we go
+        mReportStream << ", \"done\": " << (done ? "true" : "false") <<
+            "}" << std::endl;
     }
 }
 
@@ -79,7 +229,7 @@ Renderer::Renderer(int samplePerPixel, int threadNum):
     mLightSampleIndexes(nullptr), mBSDFSampleIndexes(nullptr),
     mPickLightSampleIndexes(nullptr),
     mSamplePerPixel(samplePerPixel),
-    mThreadNum(threadNum) {}
+    mThreadNum(threadNum), mSeed(0) {}
 
 Renderer::~Renderer() {
     if (mLightSampleIndexes) {
@@ -104,25 +254,401 @@ void Renderer::render(const ScenePtr& scene) {
 
     std::vector<SampleRange> sampleRanges;
     getSampleRanges(film, sampleRanges);
-    std::vector<Task*> renderTasks;
-    RenderProgress progress(static_cast<int>(sampleRanges.size()));
+    RenderProgress progress(mProgressReport, getExpectedSampleNum(film));
+    RenderingTLSManager tlsManager(film, false);
+    ThreadPool threadPool(mThreadNum, &tlsManager);
+    // the adaptive passes depend on the variance so far, checkpoints go
+    // with the progressive passes only
+    if (mAdaptiveSampling.enabled &&
+        (mProgressive.enabled || !mCheckpoint.filename.empty())) {
+        std::cerr << "adaptive_sampling is ignored with " <<
+            (mProgressive.enabled ? "progressive" : "checkpoint_file") <<
+            ", rendering uniform passes" << std::endl;
+    }
+    if (mProgressive.enabled || !mCheckpoint.filename.empty()) {
+        renderProgressive(scene, threadPool, tlsManager, progress,
+            sampleRanges, sampleQuota);
+    } else if (mAdaptiveSampling.enabled) {
+        renderAdaptive(scene, threadPool, progress, sampleRanges,
+            sampleQuota);
+    } else {
+        renderPass(scene, threadPool, progress, sampleRanges, sampleQuota,
+            mSamplePerPixel, 0, nullptr);
+    }
+    threadPool.finalizeTLS();
+    film->writePartialFilm(tlsManager.getTotalSampleCount(), true);
+    drawDebugData(tlsManager.getDebugData(), camera);
+    film->writeImage();
+    tlsManager.reportTraversalStats();
+}
+
+static bool hasMaskedInPixel(const SampleRange& range,
+    const std::vector<uint8_t>& mask, int xRes, int yRes) {
+    int x0 = std::max(range.xStart, 0);
+    int x1 = std::min(range.xEnd, xRes);
+    int y0 = std::max(range.yStart, 0);
+    int y1 = std::min(range.yEnd, yRes);
+    for (int y = y0; y < y1; ++y) {
+        for (int x = x0; x < x1; ++x) {
+            if (mask[y * xRes + x]) {
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+void Renderer::renderPass(const ScenePtr& scene, ThreadPool& threadPool,
+    RenderProgress& progress, const std::vector<SampleRange>& sampleRanges,
+    const SampleQuota& sampleQuota, int samplePerPixel,
+    uint64_t sampleIndexOffset, const std::vector<uint8_t>* pixelMask) {
+    const CameraPtr camera = scene->getCamera();
+    const Film* film = camera->getFilm();
+    std::vector<const SampleRange*> passRanges;
     for (size_t i = 0; i < sampleRanges.size(); ++i) {
-        renderTasks.push_back(new RenderTask(this, 
-            camera, scene, sampleRanges[i], sampleQuota, mSamplePerPixel,
-            &progress));
+        if (pixelMask == nullptr || hasMaskedInPixel(sampleRanges[i],
+            *pixelMask, film->getXResolution(), film->getYResolution())) {
+            passRanges.push_back(&sampleRanges[i]);
+        }
+    }
+    std::vector<Task*> renderTasks;
+    for (size_t i = 0; i < passRanges.size(); ++i) {
+        RenderTask* renderTask = new RenderTask(this,
+            camera, scene, *passRanges[i], sampleQuota, samplePerPixel,
+            &progress);
+        renderTask->setPixelMask(pixelMask);
+        renderTask->setSampleIndexOffset(sampleIndexOffset);
+        renderTasks.push_back(renderTask);
     }
-        
-    RenderingTLSManager tlsManager(film);
-    ThreadPool threadPool(mThreadNum, &tlsManager);
     threadPool.enqueue(renderTasks);
-    threadPool.waitForAll();
+    threadPool.waitForTasks();
     //clean up
     for (size_t i = 0; i < renderTasks.size(); ++i) {
         delete renderTasks[i];
     }
-    renderTasks.clear();
-    drawDebugData(tlsManager.getDebugData(), camera);
-    film->writeImage();
+}
+
+// the largest square sample count not above n, 0 if n < 1
+static int floorSquare(uint64_t n) {
+    int root = (int)sqrt((double)n);
+    return root * root;
+}
+
+void Renderer::renderAdaptive(const ScenePtr& scene, ThreadPool& threadPool,
+    RenderProgress& progress, const std::vector<SampleRange>& sampleRanges,
+    const SampleQuota& sampleQuota) {
+    Film* film = scene->getCamera()->getFilm();
+    film->trackVariance();
+    ImageRect filmRect;
+    film->getImageRect(filmRect);
+    // same budget the uniform render would spend
+    int samplePerPixel = roundToSquare(mSamplePerPixel);
+    uint64_t budget = (uint64_t)samplePerPixel * filmRect.pixelNum();
+    int baseSamplePerPixel = roundToSquare(
+        clamp(mAdaptiveSampling.baseSamplePerPixel, 1, samplePerPixel));
+    uint32_t maxSamples = (uint32_t)std::max(
+        mAdaptiveSampling.maxSampleScale * samplePerPixel,
+        (float)baseSamplePerPixel);
+    std::cout << "adaptive sampling base pass " << baseSamplePerPixel <<
+        " samples per pixel" << std::endl;
+    renderPass(scene, threadPool, progress, sampleRanges, sampleQuota,
+        baseSamplePerPixel, 0, nullptr);
+    // passes number their samples after all the earlier ones so a pixel
+    // never sees the same sample stream twice
+    uint64_t sampleIndexOffset = baseSamplePerPixel;
+    uint64_t spent = (uint64_t)baseSamplePerPixel * filmRect.pixelNum();
+
+    std::vector<uint8_t> mask;
+    // the sampler wants square counts, every pass doubles the strata per
+    // side of the previous one (doubling the count itself would round
+    // right back down to the same square). a pixel that keeps failing
+    // the test grows geometrically and the pass count stays logarithmic
+    int passRoot = (int)sqrt((double)baseSamplePerPixel);
+    int passSamplePerPixel = baseSamplePerPixel;
+    int pass = 1;
+    for (; spent < budget; ++pass) {
+        int unconvergedNum = film->markUnconvergedPixels(
+            mAdaptiveSampling.threshold, maxSamples, mask);
+        if (unconvergedNum == 0) {
+            std::cout << "all pixels converged or capped, " <<
+                budget - spent << " samples left unspent" << std::endl;
+            break;
+        }
+        int budgetRoot = (int)sqrt((double)((budget - spent) /
+            unconvergedNum));
+        passRoot = std::min(2 * passRoot, budgetRoot);
+        passSamplePerPixel = passRoot * passRoot;
+        if (passSamplePerPixel == 0) {
+            break;
+        }
+        std::cout << "adaptive sampling pass " << pass << ": " <<
+            unconvergedNum << " pixels, " << passSamplePerPixel <<
+            " samples per pixel" << std::endl;
+        renderPass(scene, threadPool, progress, sampleRanges, sampleQuota,
+            passSamplePerPixel, sampleIndexOffset, &mask);
+        sampleIndexOffset += passSamplePerPixel;
+        spent += (uint64_t)passSamplePerPixel * unconvergedNum;
+    }
+    std::cout << "adaptive sampling " << pass << " passes, " << spent <<
+        "/" << budget << " samples" << std::endl;
+}
+
+void Renderer::renderProgressive(const ScenePtr& scene,
+    ThreadPool& threadPool, RenderingTLSManager& tlsManager,
+    RenderProgress& progress, const std::vector<SampleRange>& sampleRanges,
+    const SampleQuota& sampleQuota) {
+    typedef std::chrono::steady_clock Clock;
+    Film* film = scene->getCamera()->getFilm();
+    int passSamplePerPixel = getPassSamplePerPixel();
+    int samplePerPixel = roundToSquare(mSamplePerPixel);
+    double timeBudget = mProgressive.enabled ? mProgressive.timeBudget : 0.0;
+    Clock::time_point start = Clock::now();
+    Clock::time_point lastWrite = start;
+    Clock::time_point lastCheckpoint = start;
+    double lastPassSeconds = 0.0;
+    int renderedSamplePerPixel = 0;
+    std::unique_ptr<CheckpointWriter> checkpointWriter =
+        createCheckpointWriter();
+    if (checkpointWriter && loadFilmCheckpoint("renderer", film,
+        tlsManager, &renderedSamplePerPixel)) {
+        progress.setExpectedSampleNum(getExpectedSampleNum(film) -
+            tlsManager.getTotalSampleCount());
+    }
+    int pass = 0;
+    while (renderedSamplePerPixel < samplePerPixel) {
+        double elapsed = std::chrono::duration<double>(
+            Clock::now() - start).count();
+        // the passes cost about the same, skip the one that would end
+        // past the budget so the render finishes on time
+        if (timeBudget > 0.0 && pass > 0 &&
+            elapsed + lastPassSeconds > timeBudget) {
+            std::cout << "time budget " << timeBudget <<
+                " seconds reached" << std::endl;
+            break;
+        }
+        // the sampler wants square counts, the remainder goes out in
+        // square passes so the render stops right at samplePerPixel
+        int thisPassSamplePerPixel = std::min(passSamplePerPixel,
+            floorSquare(samplePerPixel - renderedSamplePerPixel));
+        Clock::time_point passStart = Clock::now();
+        renderPass(scene, threadPool, progress, sampleRanges, sampleQuota,
+            thisPassSamplePerPixel, renderedSamplePerPixel, nullptr);
+        Clock::time_point passEnd = Clock::now();
+        lastPassSeconds =
+            std::chrono::duration<double>(passEnd - passStart).count();
+        renderedSamplePerPixel += thisPassSamplePerPixel;
+        ++pass;
+        std::cout << "progressive pass " << pass << ": " <<
+            renderedSamplePerPixel << " samples per pixel, " <<
+            lastPassSeconds << " seconds" << std::endl;
+        bool done = renderedSamplePerPixel >= samplePerPixel;
+        if (!done && checkpointWriter &&
+            isCheckpointDue(lastCheckpoint)) {
+            // the sample counts only reach the manager on finalize
+            threadPool.finalizeTLS();
+            saveFilmCheckpoint(*checkpointWriter, "renderer", film,
+                tlsManager, renderedSamplePerPixel);
+        }
+        // a render that only checkpoints writes its image once at the end
+        if (!done && mProgressive.enabled && std::chrono::duration<double>(
+            passEnd - lastWrite).count() >= mProgressive.writeInterval) {
+            film->writeImage();
+            lastWrite = Clock::now();
+        }
+    }
+}
+
+void Renderer::renderSplatPasses(const ScenePtr& scene,
+    const std::string& tag, ThreadPool& threadPool,
+    RenderingTLSManager& tlsManager, RenderProgress& progress,
+    const std::vector<SampleRange>& sampleRanges, SplatFilm* splatFilm,
+    const SplatTaskFactory& createTask) {
+    Film* film = scene->getCamera()->getFilm();
+    int samplePerPixel = roundToSquare(mSamplePerPixel);
+    // a single pass unless there are checkpoints to take in between
+    int passSamplePerPixel = samplePerPixel;
+    int renderedSamplePerPixel = 0;
+    std::unique_ptr<CheckpointWriter> checkpointWriter =
+        createCheckpointWriter();
+    if (checkpointWriter) {
+        passSamplePerPixel = getPassSamplePerPixel();
+        if (loadFilmCheckpoint(tag, film, tlsManager,
+            &renderedSamplePerPixel)) {
+            progress.setExpectedSampleNum(getExpectedSampleNum(film) -
+                tlsManager.getTotalSampleCount());
+        }
+    }
+    std::chrono::steady_clock::time_point lastCheckpoint =
+        std::chrono::steady_clock::now();
+    while (renderedSamplePerPixel < samplePerPixel) {
+        // square passes for the remainder, see renderProgressive
+        int thisPassSamplePerPixel = std::min(passSamplePerPixel,
+            floorSquare(samplePerPixel - renderedSamplePerPixel));
+        std::vector<Task*> tasks;
+        for (size_t i = 0; i < sampleRanges.size(); ++i) {
+            RenderTask* task = createTask(sampleRanges[i],
+                thisPassSamplePerPixel, &progress);
+            task->setSampleIndexOffset(renderedSamplePerPixel);
+            tasks.push_back(task);
+        }
+        threadPool.enqueue(tasks);
+        threadPool.waitForTasks();
+        for (size_t i = 0; i < tasks.size(); ++i) {
+            delete tasks[i];
+        }
+        renderedSamplePerPixel += thisPassSamplePerPixel;
+        bool done = renderedSamplePerPixel >= samplePerPixel;
+        bool checkpoint = !done && checkpointWriter &&
+            isCheckpointDue(lastCheckpoint);
+        if (done || checkpoint) {
+            // flush the full frame tiles and the splat film into the
+            // film so it holds everything rendered so far
+            threadPool.finalizeTLS();
+            if (splatFilm) {
+                film->mergeSplatFilm(*splatFilm);
+                splatFilm->clear();
+            }
+        }
+        if (checkpoint) {
+            saveFilmCheckpoint(*checkpointWriter, tag, film, tlsManager,
+                renderedSamplePerPixel);
+        }
+    }
+}
+
+uint64_t Renderer::getExpectedSampleNum(const Film* film) const {
+    ImageRect filmRect;
+    film->getImageRect(filmRect);
+    return (uint64_t)filmRect.pixelNum() * roundToSquare(mSamplePerPixel);
+}
+
+std::unique_ptr<CheckpointWriter> Renderer::createCheckpointWriter() const {
+    std::unique_ptr<CheckpointWriter> writer;
+    if (!mCheckpoint.filename.empty()) {
+        writer.reset(new CheckpointWriter(mCheckpoint.filename));
+    }
+    return writer;
+}
+
+bool Renderer::isCheckpointDue(
+    std::chrono::steady_clock::time_point& lastCheckpoint) const {
+    std::chrono::steady_clock::time_point now =
+        std::chrono::steady_clock::now();
+    if (std::chrono::duration<double>(now - lastCheckpoint).count() <
+        mCheckpoint.interval) {
+        return false;
+    }
+    lastCheckpoint = now;
+    return true;
+}
+
+void Renderer::saveCheckpointSetup(CheckpointBuffer& buffer) const {
+    buffer.put(mSeed);
+    buffer.put(mSamplePerPixel);
+}
+
+bool Renderer::checkCheckpointSetup(CheckpointBuffer& buffer) const {
+    uint64_t seed;
+    int samplePerPixel;
+    if (!buffer.get(seed) || !buffer.get(samplePerPixel)) {
+        return false;
+    }
+    if (seed != mSeed) {
+        std::cerr << "checkpoint seed " << seed << " mismatch, the " <<
+            "render uses " << mSeed << std::endl;
+        return false;
+    }
+    if (samplePerPixel != mSamplePerPixel) {
+        std::cerr << "checkpoint sample_per_pixel " << samplePerPixel <<
+            " mismatch, the render uses " << mSamplePerPixel << std::endl;
+        return false;
+    }
+    return true;
+}
+
+bool Renderer::loadFilmCheckpoint(const std::string& tag, Film* film,
+    RenderingTLSManager& tlsManager, int* renderedSamplePerPixel) const {
+    CheckpointBuffer buffer;
+    if (!mCheckpoint.resume ||
+        !readCheckpoint(mCheckpoint.filename, tag, buffer)) {
+        return false;
+    }
+    int samplePerPixel;
+    uint64_t sampleCount;
+    if (!checkCheckpointSetup(buffer) ||
+        !buffer.get(samplePerPixel) || !buffer.get(sampleCount) ||
+        !film->loadState(buffer)) {
+        std::cerr << "fail to resume from checkpoint " <<
+            mCheckpoint.filename << std::endl;
+        return false;
+    }
+    tlsManager.addRestoredSampleCount(sampleCount);
+    *renderedSamplePerPixel = samplePerPixel;
+    std::cout << "resume at " << samplePerPixel << " samples per pixel" <<
+        std::endl;
+    return true;
+}
+
+void Renderer::saveFilmCheckpoint(CheckpointWriter& writer,
+    const std::string& tag, const Film* film,
+    const RenderingTLSManager& tlsManager,
+    int renderedSamplePerPixel) const {
+    CheckpointBuffer buffer;
+    saveCheckpointSetup(buffer);
+    buffer.put(renderedSamplePerPixel);
+    buffer.put(tlsManager.getTotalSampleCount());
+    film->saveState(buffer);
+    writer.submit(tag, buffer);
+}
+
+AdaptiveSamplingSetting getAdaptiveSamplingSetting(const ParamSet& params) {
+    AdaptiveSamplingSetting setting;
+    setting.enabled = params.getBool("adaptive_sampling", false);
+    setting.baseSamplePerPixel = std::max(1, params.getInt(
+        "adaptive_base_sample_per_pixel", setting.baseSamplePerPixel));
+    setting.threshold = params.getFloat("adaptive_threshold",
+        setting.threshold);
+    setting.maxSampleScale = params.getFloat("adaptive_max_sample_scale",
+        setting.maxSampleScale);
+    return setting;
+}
+
+ProgressiveSetting getProgressiveSetting(const ParamSet& params) {
+    ProgressiveSetting setting;
+    setting.enabled = params.getBool("progressive", false);
+    setting.passSamplePerPixel = std::max(1, params.getInt(
+        "progressive_pass_sample_per_pixel", setting.passSamplePerPixel));
+    setting.timeBudget = params.getFloat("time_budget", setting.timeBudget);
+    setting.writeInterval = params.getFloat("progressive_write_interval",
+        setting.writeInterval);
+    return setting;
+}
+
+ProgressReportSetting getProgressReportSetting(const ParamSet& params) {
+    ProgressReportSetting setting;
+    setting.interval = params.getFloat("progress_interval",
+        setting.interval);
+    setting.filename = params.getString("progress_file", "");
+    return setting;
+}
+
+CheckpointSetting getCheckpointSetting(const ParamSet& params) {
+    CheckpointSetting setting;
+    setting.filename = params.getString("checkpoint_file", "");
+    setting.interval = params.getFloat("checkpoint_interval",
+        setting.interval);
+    setting.passSamplePerPixel = std::max(1, params.getInt(
+        "checkpoint_pass_sample_per_pixel", setting.passSamplePerPixel));
+    setting.resume = params.getBool("resume", false);
+    return setting;
+}
+
+void Renderer::batchLi(const ScenePtr& scene, const RayDifferential* rays,
+    const Sample* samples, int raysNum, const RNG& rng,
+    RenderingTLS* tls, Color* L) const {
+    for (int i = 0; i < raysNum; ++i) {
+        L[i] = Li(scene, rays[i], samples[i], rng, tls);
+    }
 }
 
 Color Renderer::LbssrdfSingle(const ScenePtr& scene,
@@ -651,17 +1177,51 @@ void Renderer::getSampleRanges(const Film* film,
     std::vector<SampleRange>& sampleRanges) const {
     SampleRange fullRange;
     film->getSampleRange(fullRange);
-    int step = 8;
-    for (int y = fullRange.yStart; y < fullRange.yEnd; y += step) {
-        for (int x = fullRange.xStart; x < fullRange.xEnd; x += step) {
-            SampleRange subSampleRange;
-            subSampleRange.xStart = x;
-            subSampleRange.xEnd = std::min(x + step, fullRange.xEnd);
-            subSampleRange.yStart = y;
-            subSampleRange.yEnd = std::min(y + step, fullRange.yEnd);
-            sampleRanges.push_back(subSampleRange);
-        }
+    // what a task takes in one go, the progressive passes only take a
+    // slice of samplePerPixel. the checkpoint passes are large enough to
+    // size the tiles on the full count
+    int samplePerPixel = mSamplePerPixel;
+    if (mProgressive.enabled) {
+        samplePerPixel = getPassSamplePerPixel();
+    }
+    splitTiles(fullRange, samplePerPixel, getThreadNum(), mTiling,
+        sampleRanges);
+}
+
+int Renderer::getPassSamplePerPixel() const {
+    int samplePerPixel = roundToSquare(mSamplePerPixel);
+    int passSamplePerPixel = samplePerPixel;
+    if (mProgressive.enabled) {
+        passSamplePerPixel = mProgressive.passSamplePerPixel;
+    } else if (!mCheckpoint.filename.empty()) {
+        passSamplePerPixel = mCheckpoint.passSamplePerPixel;
+    }
+    // a square the sampler can stratify, never past the whole render
+    return std::min(roundToSquare(std::max(passSamplePerPixel, 1)),
+        samplePerPixel);
+}
+
+int Renderer::getThreadNum() const {
+    return mThreadNum > 0 ? mThreadNum : (int)getMaxThreadNum();
+}
+
+void Renderer::reportSplatFilm(const Film* film,
+    const SplatFilm* splatFilm, double seconds) const {
+    size_t bytes;
+    if (splatFilm) {
+        bytes = splatFilm->getMemoryBytes();
+    } else {
+        // a full frame tile per thread, ThreadPool clamps the same way
+        ImageRect filmRect;
+        film->getImageRect(filmRect);
+        unsigned int threadNum = mThreadNum <= 0 ? getMaxThreadNum() :
+            std::min(getMaxThreadNum(), (unsigned int)mThreadNum);
+        bytes = threadNum * filmRect.pixelNum() * sizeof(Pixel);
     }
+    std::cout << "splat film " << (splatFilm ? "shared" : "tile") <<
+        ": " << bytes / (1024.0 * 1024.0) <<
+        " MB accumulation buffers, render and merge " << seconds <<
+        " seconds" << std::endl;
 }
 
 void Renderer::drawDebugData(const DebugData& debugData,
@@ -6,8 +6,15 @@
 #include "GoblinScene.h"
 #include "GoblinSampler.h"
 #include "GoblinThreadPool.h"
+#include "GoblinTiling.h"
+
+#include <chrono>
+#include <fstream>
+#include <functional>
 
 namespace Goblin {
+class CheckpointBuffer;
+class CheckpointWriter;
 class Color;
 class ImageTile;
 class ParamSet;
@@ -17,16 +24,123 @@ struct LightSample;
 struct BSDFSampleIndex;
 struct LightSampleIndex;
 
+struct ProgressReportSetting {
+    ProgressReportSetting(): interval(1.0f) {}
+
+    // seconds between two reports, 0 only reports when the render ends
+    float interval;
+    // gets a JSON line per report, a named pipe works too, empty for
+    // the console line alone
+    std::string filename;
+};
+
+ProgressReportSetting getProgressReportSetting(const ParamSet& params);
+
+// the render tasks bump lock free counters once they are done, a
+// reporter thread samples them every interval for the progress line and
+// the JSON report, so no task ever waits on the console or the file
 class RenderProgress {
 public:
-    RenderProgress(int taskNum);
-    void reset();
-    void update();
+    // expectedSampleNum is what the whole render is going to take,
+    // the progress and the ETA come from the share done
+    RenderProgress(const ProgressReportSetting& setting,
+        uint64_t expectedSampleNum);
+
+    // stops the reporter after a final report
+    ~RenderProgress();
+
+    // a resumed render only has the samples left to go
+    void setExpectedSampleNum(uint64_t expectedSampleNum) {
+        mExpectedSampleNum.store(expectedSampleNum,
+            std::memory_order_relaxed);
+    }
+
+    // a task is done, rays are the scene queries it issued
+    void update(uint64_t sampleNum, const RayCounts& rays);
+
+private:
+    struct Snapshot {
+        double seconds;
+        uint64_t tilesNum;
+        uint64_t samplesNum;
+        uint64_t raysNum;
+        uint64_t shadowRaysNum;
+    };
+
+    Snapshot takeSnapshot() const;
+
+    void reporterEntry();
+
+    void report(const Snapshot& current, const Snapshot& last,
+        bool done);
+
 private:
-    std::mutex mUpdateMutex;
-    int mFinishedNum, mTasksNum;
+    std::atomic<uint64_t> mTilesNum;
+    std::atomic<uint64_t> mSamplesNum;
+    std::atomic<uint64_t> mRaysNum;
+    std::atomic<uint64_t> mShadowRaysNum;
+    std::atomic<uint64_t> mExpectedSampleNum;
+
+    ProgressReportSetting mSetting;
+    std::chrono::steady_clock::time_point mStart;
+    // only the reporter thread writes it, opening a pipe blocks till
+    // the other end shows up
+    std::ofstream mReportStream;
+    std::thread mReporter;
+    std::mutex mExitMutex;
+    std::condition_variable mExitCondition;
+    bool mExit;
+};
+
+struct AdaptiveSamplingSetting {
+    AdaptiveSamplingSetting(): enabled(false), baseSamplePerPixel(4),
+        threshold(0.02f), maxSampleScale(4.0f) {}
+
+    bool enabled;
+    // samples every pixel gets in the first pass
+    int baseSamplePerPixel;
+    // relative error a pixel counts as converged under
+    float threshold;
+    // a pixel stops getting samples at maxSampleScale * samplePerPixel
+    float maxSampleScale;
+};
+
+AdaptiveSamplingSetting getAdaptiveSamplingSetting(const ParamSet& params);
+
+struct ProgressiveSetting {
+    ProgressiveSetting(): enabled(false), passSamplePerPixel(1),
+        timeBudget(0.0f), writeInterval(30.0f) {}
+
+    bool enabled;
+    // samples per pixel every pass adds over the whole film
+    int passSamplePerPixel;
+    // wall clock seconds, 0 renders till samplePerPixel is reached
+    float timeBudget;
+    // seconds between the intermediate image writes, 0 writes every pass
+    float writeInterval;
+};
+
+ProgressiveSetting getProgressiveSetting(const ParamSet& params);
+
+struct CheckpointSetting {
+    CheckpointSetting(): interval(600.0f), passSamplePerPixel(64),
+        resume(false) {}
+
+    // empty turns the checkpoints off
+    std::string filename;
+    // wall clock seconds between two checkpoints
+    float interval;
+    // samples per pixel of the passes a render that is not progressive
+    // gets cut into for the checkpoints, large enough to keep most of
+    // the stratification of a single pass
+    int passSamplePerPixel;
+    // pick the render up from filename if it holds a checkpoint of the
+    // same renderer
+    bool resume;
 };
 
+CheckpointSetting getCheckpointSetting(const ParamSet& params);
+
 class RenderTask : public Task {
 public:
     RenderTask(Renderer* mRenderer, const CameraPtr& camera,
@@ -36,6 +150,16 @@ public:
     ~RenderTask();
     void run(TLSPtr& tls);
 
+    // skip the pixels with a zero entry, see Sampler::setPixelMask
+    void setPixelMask(const std::vector<uint8_t>* mask) {
+        mPixelMask = mask;
+    }
+
+    // see Sampler::setSampleIndexOffset
+    void setSampleIndexOffset(uint64_t offset) {
+        mSampleIndexOffset = offset;
+    }
+
 protected:
     Renderer* mRenderer;
     const CameraPtr& mCamera;
@@ -44,7 +168,9 @@ protected:
     const SampleQuota& mSampleQuota;
     int mSamplePerPixel;
     RenderProgress* mRenderProgress;
-    RNG* mRNG;
+    RNG mRNG;
+    const std::vector<uint8_t>* mPixelMask;
+    uint64_t mSampleIndexOffset;
 };
 
 class Renderer {
@@ -56,10 +182,47 @@ public:
 
     virtual void render(const ScenePtr& scene);
 
+    // only the camera driven renderers (the default render) use it
+    void setAdaptiveSampling(const AdaptiveSamplingSetting& setting) {
+        mAdaptiveSampling = setting;
+    }
+
+    // same as above, takes over the adaptive sampling when enabled
+    void setProgressive(const ProgressiveSetting& setting) {
+        mProgressive = setting;
+    }
+
+    // the renderers checkpoint at their pass boundaries, the camera
+    // driven ones switch to the progressive passes for it
+    void setCheckpoint(const CheckpointSetting& setting) {
+        mCheckpoint = setting;
+    }
+
+    void setTiling(const TilingSetting& setting) {
+        mTiling = setting;
+    }
+
+    void setProgressReport(const ProgressReportSetting& setting) {
+        mProgressReport = setting;
+    }
+
+    // picks the random streams, the processes rendering the same crop
+    // for a partial film merge need different seeds
+    void setSeed(uint64_t seed) { mSeed = seed; }
+
+    uint64_t getSeed() const { return mSeed; }
+
     virtual Color Li(const ScenePtr& scene, const RayDifferential& ray, 
         const Sample& sample, const RNG& rng,
         RenderingTLS* tls = nullptr) const = 0;
 
+    // shade the camera rays of one sampler request (the samples of a
+    // pixel) into L, renderers that can trace the rays together as a
+    // ray stream override this, the default shades them one by one
+    virtual void batchLi(const ScenePtr& scene, const RayDifferential* rays,
+        const Sample* samples, int raysNum, const RNG& rng,
+        RenderingTLS* tls, Color* L) const;
+
     // volume in scatter and emission contribution
     Color Lv(const ScenePtr& scene, const Ray& ray, const RNG& rng) const;
 
@@ -111,12 +274,93 @@ protected:
         float epsilon, const Intersection& intersection,
         const Sample& sample, const RNG& rng) const;
 
+    // samples per pixel of a renderProgressive / renderSplatPasses pass,
+    // the progressive setting wins over the checkpoint one
+    int getPassSamplePerPixel() const;
+
+    // the film cut into tiles as mTiling says, one task each
     void getSampleRanges(const Film* film,
         std::vector<SampleRange>& sampleRanges) const;
 
+    // the worker count the thread pool ends up with
+    int getThreadNum() const;
+
+    // run one RenderTask per sample range that has a pixel left in
+    // pixelMask (all of them without a mask) with samplePerPixel,
+    // numbering the samples from sampleIndexOffset
+    void renderPass(const ScenePtr& scene, ThreadPool& threadPool,
+        RenderProgress& progress,
+        const std::vector<SampleRange>& sampleRanges,
+        const SampleQuota& sampleQuota, int samplePerPixel,
+        uint64_t sampleIndexOffset, const std::vector<uint8_t>* pixelMask);
+
+    // a base pass over every pixel, then passes over the pixels whose
+    // relative error is still above the threshold till the
+    // samplePerPixel budget is spent or all of them converged
+    void renderAdaptive(const ScenePtr& scene, ThreadPool& threadPool,
+        RenderProgress& progress,
+        const std::vector<SampleRange>& sampleRanges,
+        const SampleQuota& sampleQuota);
+
+    // full film passes of passSamplePerPixel till samplePerPixel is
+    // reached or the next pass would overrun the time budget, writing
+    // the image in between
+    void renderProgressive(const ScenePtr& scene, ThreadPool& threadPool,
+        RenderingTLSManager& tlsManager, RenderProgress& progress,
+        const std::vector<SampleRange>& sampleRanges,
+        const SampleQuota& sampleQuota);
+
+    typedef std::function<RenderTask*(const SampleRange& sampleRange,
+        int samplePerPixel, RenderProgress* progress)> SplatTaskFactory;
+
+    // the splatting renderers (light tracer, bdpt) run createTask over
+    // the sample ranges in passes so they can checkpoint in between,
+    // the full frame tiles and splatFilm end up merged in the film
+    void renderSplatPasses(const ScenePtr& scene, const std::string& tag,
+        ThreadPool& threadPool, RenderingTLSManager& tlsManager,
+        RenderProgress& progress,
+        const std::vector<SampleRange>& sampleRanges, SplatFilm* splatFilm,
+        const SplatTaskFactory& createTask);
+
+    // the samples a full render of the film takes, what the progress
+    // report measures against
+    uint64_t getExpectedSampleNum(const Film* film) const;
+
+    // nullptr with the checkpoints off
+    std::unique_ptr<CheckpointWriter> createCheckpointWriter() const;
+
+    // true once the checkpoint interval passed since lastCheckpoint,
+    // which then moves to now
+    bool isCheckpointDue(
+        std::chrono::steady_clock::time_point& lastCheckpoint) const;
+
+    // the film, the samples per pixel rendered so far and the sample
+    // count, what the film driven renderers resume from. load leaves
+    // everything alone when there is nothing to resume
+    bool loadFilmCheckpoint(const std::string& tag, Film* film,
+        RenderingTLSManager& tlsManager, int* renderedSamplePerPixel) const;
+
+    // the seed and the samples per pixel (iterations for sppm) the
+    // render is after, a checkpoint of another setup would mix unrelated
+    // sums in or be past the target already
+    void saveCheckpointSetup(CheckpointBuffer& buffer) const;
+
+    bool checkCheckpointSetup(CheckpointBuffer& buffer) const;
+
+    // the TLS has to be finalized so the sample count is complete
+    void saveFilmCheckpoint(CheckpointWriter& writer,
+        const std::string& tag, const Film* film,
+        const RenderingTLSManager& tlsManager,
+        int renderedSamplePerPixel) const;
+
     void drawDebugData(const DebugData& debugData,
         const CameraPtr& camera) const;
 
+    // accumulation buffer memory and wall time of a splatting pass
+    // (render plus merge), to compare the splat_film modes
+    void reportSplatFilm(const Film* film, const SplatFilm* splatFilm,
+        double seconds) const;
+
 private:
     virtual void querySampleQuota(const ScenePtr& scene, 
         SampleQuota* sampleQuota) = 0;
@@ -139,6 +383,12 @@ protected:
     BSSRDFSampleIndex mBSSRDFSampleIndex;
     int mSamplePerPixel;
     int mThreadNum;
+    uint64_t mSeed;
+    AdaptiveSamplingSetting mAdaptiveSampling;
+    ProgressiveSetting mProgressive;
+    CheckpointSetting mCheckpoint;
+    ProgressReportSetting mProgressReport;
+    TilingSetting mTiling;
 };
 }
 
@@ -1,5 +1,6 @@
 #include "GoblinSPPM.h"
 #include "GoblinCamera.h"
+#include "GoblinCheckpoint.h"
 #include "GoblinFilm.h"
 #include "GoblinRay.h"
 
@@ -37,17 +38,22 @@ public:
         const PermutedHalton& halton):
         mSPPM(sppm), mScene(scene), mCurrentIteration(0),
         mSampleRange(sampleRange), mHalton(halton) {
-        // make each pixel uses different QMC sub sequence
-        mHaltonStartID.resize((mSampleRange.xEnd - mSampleRange.xStart) *
-            (mSampleRange.yEnd - mSampleRange.yStart));
-        for (size_t i = 0; i < mHaltonStartID.size(); ++i) {
-            mHaltonStartID[i] = mRNG.randomUInt();
+        // make each pixel uses different QMC sub sequence, drawn from
+        // the pixel stream so it doesn't depend on the tiling
+        for (int y = mSampleRange.yStart; y < mSampleRange.yEnd; ++y) {
+            for (int x = mSampleRange.xStart; x < mSampleRange.xEnd; ++x) {
+                mRNG.setPixelSample(x, y, 0, sppm->getSeed());
+                mHaltonStartID.push_back(mRNG.randomUInt());
+            }
         }
     }
 
     void run(TLSPtr& tls);
 
     void nextIteration() { mCurrentIteration++; }
+
+    // a resumed render picks up the sample streams where it left
+    void setIteration(int iteration) { mCurrentIteration = iteration; }
 private:
     SPPM* mSPPM;
     const ScenePtr& mScene;
@@ -67,6 +73,8 @@ void RayTraceTask::run(TLSPtr& tls) {
     for (int y = mSampleRange.yStart; y < mSampleRange.yEnd; ++y) {
         for (int x = mSampleRange.xStart; x  < mSampleRange.xEnd; ++x) {
             uint64_t id = mHaltonStartID[pixelOffset] + mCurrentIteration;
+            mRNG.setPixelSample(x, y, mCurrentIteration + 1,
+                mSPPM->getSeed());
             mHalton.sample(&rayTraceTLS->mSample, x, y, id, &mRNG);
             mSPPM->rayTracePass(mScene, rayTraceTLS->mSample, x, y);
             pixelOffset++;
@@ -106,7 +114,8 @@ public:
         std::vector<PixelData>& pixelData,
         std::vector<std::vector<PhotonCache> >& photonCache,
         uint64_t* emittedPhotons):
-        mSampleQuota(sampleQuota), mNextThreadID(0), mPixelData(pixelData),
+        mSampleQuota(sampleQuota), mNextThreadID(0), mLiveTLSNum(0),
+        mPixelData(pixelData),
         mPhotonCache(photonCache), mEmittedPhotons(emittedPhotons) {}
 
     void initialize(TLSPtr& tlsPtr) {
@@ -114,6 +123,7 @@ public:
             // TODO this can probably be replaced with an atomic
             std::lock_guard<std::mutex> lk(mSyncTLSMutex);
             size_t threadID = mNextThreadID++;
+            ++mLiveTLSNum;
             tlsPtr.reset(new PhotonTraceTLS(mSampleQuota, threadID,
                 mPhotonCache[threadID]));
         }
@@ -136,6 +146,11 @@ public:
                 photonCache[i].Mi = 0;
             }
             *mEmittedPhotons += photonTraceTLS->mEmittedPhotons;
+            // the pool finalizes all the TLS after every pass, the next
+            // pass hands out the photon caches from the first one again
+            if (--mLiveTLSNum == 0) {
+                mNextThreadID = 0;
+            }
         }
     }
 
@@ -143,6 +158,7 @@ private:
     std::mutex mSyncTLSMutex;
     const SampleQuota& mSampleQuota;
     size_t mNextThreadID;
+    size_t mLiveTLSNum;
     std::vector<PixelData>& mPixelData;
     std::vector<std::vector<PhotonCache>>& mPhotonCache;
     uint64_t* mEmittedPhotons;
@@ -186,6 +202,9 @@ void PhotonTraceTask::run(TLSPtr& tls) {
         static_cast<PhotonTraceTLS*>(tls.get());
     for (uint64_t i = 0; i < mSampleNum; ++i) {
         uint64_t id = getHaltonStartID() + i;
+        // photons are keyed by their halton index alone, on a stream
+        // no film pixel (x, y >= 0) maps to
+        mRNG.setSample(~0ULL, id, mSPPM->getSeed());
         mHalton.sample(&photonTraceTLS->mSample, id, &mRNG);
         mSPPM->photonTracePass(mScene, photonTraceTLS->mSample,
             photonTraceTLS->mPhotonCache);
@@ -461,6 +480,55 @@ void SPPM::photonTracePass(const ScenePtr& scene, const Sample&sample,
     }
 }
 
+bool SPPM::loadCheckpoint(int* iteration, uint64_t* emittedPhotons) {
+    CheckpointBuffer buffer;
+    if (!mCheckpoint.resume ||
+        !readCheckpoint(mCheckpoint.filename, "sppm", buffer)) {
+        return false;
+    }
+    int restoredIteration;
+    uint64_t restoredPhotons, pixelNum;
+    if (!checkCheckpointSetup(buffer) ||
+        !buffer.get(restoredIteration) || !buffer.get(restoredPhotons) ||
+        !buffer.get(pixelNum) || pixelNum != mPixelData.size()) {
+        std::cerr << "fail to resume from checkpoint " <<
+            mCheckpoint.filename << std::endl;
+        return false;
+    }
+    std::vector<PixelData> pixelData(mPixelData);
+    for (size_t i = 0; i < pixelData.size(); ++i) {
+        if (!buffer.get(pixelData[i].Ni) || !buffer.get(pixelData[i].Ri) ||
+            !buffer.get(pixelData[i].Ld) || !buffer.get(pixelData[i].Tau)) {
+            std::cerr << "fail to resume from checkpoint " <<
+                mCheckpoint.filename << std::endl;
+            return false;
+        }
+    }
+    mPixelData.swap(pixelData);
+    *iteration = restoredIteration;
+    *emittedPhotons = restoredPhotons;
+    std::cout << "resume at iteration " << restoredIteration << std::endl;
+    return true;
+}
+
+void SPPM::saveCheckpoint(CheckpointWriter& writer, int iteration,
+    uint64_t emittedPhotons) const {
+    // only what lasts across the iterations, the per pass data gets
+    // reset after each of them anyway
+    CheckpointBuffer buffer;
+    saveCheckpointSetup(buffer);
+    buffer.put(iteration);
+    buffer.put(emittedPhotons);
+    buffer.put((uint64_t)mPixelData.size());
+    for (size_t i = 0; i < mPixelData.size(); ++i) {
+        buffer.put(mPixelData[i].Ni);
+        buffer.put(mPixelData[i].Ri);
+        buffer.put(mPixelData[i].Ld);
+        buffer.put(mPixelData[i].Tau);
+    }
+    writer.submit("sppm", buffer);
+}
+
 void SPPM::render(const ScenePtr& scene) {
     const CameraPtr camera = scene->getCamera();
     Film* film = camera->getFilm();
@@ -474,15 +542,10 @@ void SPPM::render(const ScenePtr& scene) {
     int xEnd = xStart + filmRect.xCount;
     int yStart = filmRect.yStart;
     int yEnd = yStart + filmRect.yCount;
-    int tileWidth = 64;
+    // one ray per pixel and iteration
     std::vector<SampleRange> sampleRanges;
-    for (int y = yStart; y < yEnd; y += tileWidth) {
-        for (int x = xStart; x < xEnd; x += tileWidth) {
-            sampleRanges.push_back(SampleRange(
-                x, std::min(x + tileWidth, xEnd),
-                y, std::min(y + tileWidth, yEnd)));
-        }
-    }
+    splitTiles(SampleRange(xStart, xEnd, yStart, yEnd), 1, getThreadNum(),
+        mTiling, sampleRanges);
     RNG rng;
     // init HaltonSampler for RayTraceTask
     PermutedHalton rayTraceHalton(sampleQuota.getDimension(), &rng);
@@ -504,13 +567,19 @@ void SPPM::render(const ScenePtr& scene) {
     }
     // init HaltonSampler for PhotonTraceTask
     PermutedHalton photonTraceHalton(sampleQuota.getDimension(), &rng);
-    // init PhotonTraceTask
-    std::vector<Task*> photonTraceTasks(mThreadNum);
-    size_t taskPhotonSamples = std::max(filmRect.pixelNum() / mThreadNum, 1);
+    // init PhotonTraceTask, a photon per pixel split along the same
+    // tiles, more tasks than threads so the stealing evens out the paths
+    // of different lengths
+    std::vector<Task*> photonTraceTasks(sampleRanges.size());
+    uint64_t photonOffset = 0;
     for (size_t i = 0 ; i < photonTraceTasks.size(); ++i) {
+        const SampleRange& range = sampleRanges[i];
+        uint64_t taskPhotonSamples = (uint64_t)(range.xEnd - range.xStart) *
+            (range.yEnd - range.yStart);
         photonTraceTasks[i] = new PhotonTraceTask(
             this, scene, photonTraceHalton,
-            i * taskPhotonSamples, taskPhotonSamples);
+            photonOffset, taskPhotonSamples);
+        photonOffset += taskPhotonSamples;
     }
     std::vector<std::vector<PhotonCache> > photonChaches(mThreadNum);
     for (size_t i = 0; i < photonChaches.size(); ++i) {
@@ -518,12 +587,34 @@ void SPPM::render(const ScenePtr& scene) {
     }
     uint64_t emittedPhotons = 0;
     int iterationCount = mSamplePerPixel;
-    for (int i = 0; i < iterationCount; ++i) {
-        // ray trace pass
-        RayTraceTLSManager rayTraceTLSManager(sampleQuota);
-        ThreadPool rayTraceThreadPool(mThreadNum, &rayTraceTLSManager);
+    int startIteration = 0;
+    std::unique_ptr<CheckpointWriter> checkpointWriter =
+        createCheckpointWriter();
+    if (checkpointWriter &&
+        loadCheckpoint(&startIteration, &emittedPhotons)) {
+        for (size_t i = 0; i < rayTraceTasks.size(); ++i) {
+            static_cast<RayTraceTask*>(rayTraceTasks[i])->setIteration(
+                startIteration);
+        }
+        for (size_t i = 0; i < photonTraceTasks.size(); ++i) {
+            static_cast<PhotonTraceTask*>(
+                photonTraceTasks[i])->setIterationOffset(emittedPhotons);
+        }
+    }
+    std::chrono::steady_clock::time_point lastCheckpoint =
+        std::chrono::steady_clock::now();
+    // the workers stay parked between the passes instead of getting
+    // spawned and joined twice every iteration
+    RayTraceTLSManager rayTraceTLSManager(sampleQuota);
+    ThreadPool rayTraceThreadPool(mThreadNum, &rayTraceTLSManager);
+    PhotonTraceTLSManager photonTraceTLSManager(sampleQuota,
+        mPixelData, photonChaches, &emittedPhotons);
+    ThreadPool photonTraceThreadPool(mThreadNum, &photonTraceTLSManager);
+    for (int i = startIteration; i < iterationCount; ++i) {
+        // ray trace pass, its TLS is only a sample buffer and stays
+        // around for all the iterations
         rayTraceThreadPool.enqueue(rayTraceTasks);
-        rayTraceThreadPool.waitForAll();
+        rayTraceThreadPool.waitForTasks();
         for (size_t j = 0; j < rayTraceTasks.size(); ++j) {
             RayTraceTask* task =
                 static_cast<RayTraceTask*>(rayTraceTasks[j]);
@@ -532,11 +623,8 @@ void SPPM::render(const ScenePtr& scene) {
         // deposit visible pixels into hash grids
         mHashGrids->rebuild(mPixelData);
 
-        // photon trace pass
-        PhotonTraceTLSManager photonTraceTLSManager(sampleQuota,
-            mPixelData, photonChaches, &emittedPhotons);
-        ThreadPool photonTraceThreadPool(mThreadNum,
-            &photonTraceTLSManager);
+        // photon trace pass, finalizing the TLS merges the photon
+        // caches into the pixel data
         photonTraceThreadPool.enqueue(photonTraceTasks);
         photonTraceThreadPool.waitForAll();
         for (size_t j = 0; j < photonTraceTasks.size(); ++j) {
@@ -566,6 +654,11 @@ void SPPM::render(const ScenePtr& scene) {
             mPixelData[j].reset();
         }
 
+        if (i + 1 < iterationCount && checkpointWriter &&
+            isCheckpointDue(lastCheckpoint)) {
+            saveCheckpoint(*checkpointWriter, i + 1, emittedPhotons);
+        }
+
         // report progress
         std::cout << "\rIteration: " << i + 1 << "/" << iterationCount;
         std::cout.flush();
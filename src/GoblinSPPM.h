@@ -74,6 +74,13 @@ public:
     void photonTracePass(const ScenePtr& scene, const Sample& sample,
         std::vector<PhotonCache>& photonCache);
 
+private:
+    // the data that lasts across the iterations, see PixelData
+    bool loadCheckpoint(int* iteration, uint64_t* emittedPhotons);
+
+    void saveCheckpoint(CheckpointWriter& writer, int iteration,
+        uint64_t emittedPhotons) const;
+
 private:
     int mMaxPathLength;
     std::vector<PixelData> mPixelData;
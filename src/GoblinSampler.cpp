@@ -67,7 +67,9 @@ Sampler::Sampler(const SampleRange& sampleRange,
     mYStart(sampleRange.yStart), mYEnd(sampleRange.yEnd),
     mCurrentX(sampleRange.xStart), mCurrentY(sampleRange.yStart),
     mSampleBuffer(nullptr), mJitter(true),
-    mSampleQuota(sampleQuota), mRNG(rng) {
+    mSampleQuota(sampleQuota), mRNG(rng),
+    mPixelMask(nullptr), mMaskWidth(0), mMaskHeight(0),
+    mSampleIndexOffset(0), mSeed(0) {
     int root;
     mSamplesPerPixel = roundToSquare(samplePerPixel, &root);
     mXPerPixel = mYPerPixel = root;
@@ -84,6 +86,23 @@ int Sampler::maxSamplesPerRequest() const {
     return mSamplesPerPixel;
 }
 
+void Sampler::setPixelMask(const std::vector<uint8_t>* mask,
+    int maskWidth, int maskHeight) {
+    mPixelMask = mask;
+    mMaskWidth = maskWidth;
+    mMaskHeight = maskHeight;
+}
+
+bool Sampler::isMaskedOut(int x, int y) const {
+    if (mPixelMask == nullptr) {
+        return false;
+    }
+    if (x < 0 || x >= mMaskWidth || y < 0 || y >= mMaskHeight) {
+        return true;
+    }
+    return (*mPixelMask)[y * mMaskWidth + x] == 0;
+}
+
 uint64_t Sampler::maxTotalSamples() const {
     return (uint64_t)mSamplesPerPixel * 
         (uint64_t)(mXEnd - mXStart) * 
@@ -106,9 +125,16 @@ uint64_t Sampler::maxTotalSamples() const {
     *
     */
 int Sampler::requestSamples(Sample* samples) {
+    while (mCurrentY != mYEnd && isMaskedOut(mCurrentX, mCurrentY)) {
+        if (++mCurrentX == mXEnd) {
+            mCurrentX = mXStart;
+            mCurrentY++;
+        }
+    }
     if (mCurrentY == mYEnd) {
         return 0;
     }
+    mRNG->setPixelSample(mCurrentX, mCurrentY, mSampleIndexOffset, mSeed);
     if (mSampleBuffer == nullptr) {
         // 4(imageX, imageY, lensU1, lensU2) + 
         // quota size(extra requested 1/2D samples)
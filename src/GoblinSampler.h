@@ -80,6 +80,10 @@ struct SampleRange {
     int yEnd;
 };
 
+// the RNG gets moved to the pixel stream on every request, whatever the
+// caller draws from it till the next request is part of that pixel
+// sample too, so a pixel renders the same no matter which task or
+// thread gets it
 class Sampler {
 public:
     Sampler(const SampleRange& sampleRange, 
@@ -90,8 +94,26 @@ public:
     uint64_t maxTotalSamples() const;
     int requestSamples(Sample* samples);
 
+    // only hand out samples for the pixels with a non zero mask entry,
+    // mask is row major maskWidth x maskHeight from pixel (0, 0) and
+    // the pixels outside it are skipped
+    void setPixelMask(const std::vector<uint8_t>* mask,
+        int maskWidth, int maskHeight);
+
+    // index of the first sample this sampler hands out per pixel, the
+    // passes after the first one start past the samples already taken
+    void setSampleIndexOffset(uint64_t offset) {
+        mSampleIndexOffset = offset;
+    }
+
+    // renders with different seeds draw independent pixel streams
+    void setSeed(uint64_t seed) {
+        mSeed = seed;
+    }
+
     Sample* allocateSampleBuffer(size_t bufferSize);
 private:
+    bool isMaskedOut(int x, int y) const;
     void stratifiedUniform1D(float* buffer, uint32_t n1D);
     void stratifiedUniform2D(float* buffer, uint32_t n2D);
 
@@ -106,6 +128,10 @@ private:
     bool mJitter;
     SampleQuota mSampleQuota;
     RNG* mRNG;
+    const std::vector<uint8_t>* mPixelMask;
+    int mMaskWidth, mMaskHeight;
+    uint64_t mSampleIndexOffset;
+    uint64_t mSeed;
 };
 
 // Cumulative Distribution Function 1D
@@ -4,6 +4,7 @@
 #include "GoblinSampler.h"
 #include "GoblinScene.h"
 #include "GoblinSphere.h"
+#include "GoblinTraversalStats.h"
 #include "GoblinVolume.h"
 
 namespace Goblin {
@@ -11,21 +12,47 @@ namespace Goblin {
 Scene::Scene(const PrimitiveList& inputPrimitives, const CameraPtr& camera,
 	std::vector<Geometry*>&& geometries,
 	std::vector<Primitive*>&& primitives,
-    const std::vector<Light*>& lights, VolumeRegion* volumeRegion):
-    mBVH(inputPrimitives, 1, "equal_count"),
+    const std::vector<Light*>& lights, VolumeRegion* volumeRegion,
+    const ParamSet& acceleratorParams, const InstanceMap& namedInstances):
+    mBVH(createBVH(inputPrimitives, acceleratorParams)),
 	mCamera(camera),
 	mGeometries(std::move(geometries)),
 	mPrimitives(std::move(primitives)),
 	mLights(lights),
-    mVolumeRegion(volumeRegion), mPowerDistribution(nullptr) {
+    mVolumeRegion(volumeRegion), mPowerDistribution(nullptr),
+    mNamedInstances(namedInstances) {
+    updateLightPowers();
+}
+
+void Scene::updateLightPowers() {
+    // infinite lights estimate their power from the scene bound
     std::vector<float> lightPowers;
-    for (size_t i = 0; i < lights.size(); ++i) {
+    for (size_t i = 0; i < mLights.size(); ++i) {
         lightPowers.push_back(
-            lights[i]->power(*this).luminance());
+            mLights[i]->power(*this).luminance());
+    }
+    if (mPowerDistribution) {
+        delete mPowerDistribution;
     }
     mPowerDistribution = new CDF1D(lightPowers);
 }
 
+bool Scene::setInstanceTransform(const std::string& name,
+    const Transform& toWorld) {
+    InstanceMap::iterator it = mNamedInstances.find(name);
+    if (it == mNamedInstances.end()) {
+        std::cerr << "Instance " << name << " not defined!\n";
+        return false;
+    }
+    it->second->setTransform(toWorld);
+    return true;
+}
+
+void Scene::refit() {
+    mBVH->refit();
+    updateLightPowers();
+}
+
 Scene::~Scene() {        
     for (size_t i = 0; i < mLights.size(); ++i) {
         delete mLights[i];
@@ -60,8 +87,12 @@ const CameraPtr Scene::getCamera() const {
     return mCamera;
 }
 
+const BVH* Scene::getBVH() const {
+    return mBVH.get();
+}
+
 void Scene::getBoundingSphere(Vector3* center, float* radius) const {
-    mBVH.getAABB().getBoundingSphere(center, radius);
+    mBVH->getAABB().getBoundingSphere(center, radius);
 }
 
 const std::vector<Light*>& Scene::getLights() const {
@@ -74,7 +105,8 @@ const VolumeRegion* Scene::getVolumeRegion() const {
 
 bool Scene::intersect(const Ray& ray, float* epsilon, 
     Intersection* intersection, IntersectFilter f) const {
-    bool isIntersect = mBVH.intersect(ray, epsilon, intersection, f);
+    countIntersectRays(1);
+    bool isIntersect = mBVH->intersect(ray, epsilon, intersection, f);
     if (isIntersect) {
         const MaterialPtr& material = intersection->getMaterial();
         material->perturb(&intersection->fragment);
@@ -83,7 +115,26 @@ bool Scene::intersect(const Ray& ray, float* epsilon,
 }
 
 bool Scene::occluded(const Ray& ray, IntersectFilter f) const {
-	return mBVH.occluded(ray, f);
+    countShadowRays(1);
+	return mBVH->occluded(ray, f);
+}
+
+void Scene::intersect(const Ray* rays, size_t raysNum, float* epsilons,
+    Intersection* intersections, bool* hits, IntersectFilter f) const {
+    countIntersectRays(raysNum);
+    mBVH->intersect(rays, raysNum, epsilons, intersections, hits, f);
+    for (size_t i = 0; i < raysNum; ++i) {
+        if (hits[i]) {
+            const MaterialPtr& material = intersections[i].getMaterial();
+            material->perturb(&intersections[i].fragment);
+        }
+    }
+}
+
+void Scene::occluded(const Ray* rays, size_t raysNum, bool* occluded,
+    IntersectFilter f) const {
+    countShadowRays(raysNum);
+    mBVH->occluded(rays, raysNum, occluded, f);
 }
 
 Color Scene::evalEnvironmentLight(const Ray& ray) const {
@@ -163,10 +214,24 @@ void SceneCache::addInstance(const Primitive* i) {
     mInstances.push_back(i);
 }
 
+void SceneCache::addNamedInstance(const std::string& name,
+    InstancedPrimitive* i) {
+    std::pair<std::string, InstancedPrimitive*> pair(name, i);
+    mNamedInstances.insert(pair);
+}
+
 void SceneCache::addLight(Light* l) {
     mLights.push_back(l);
 }
 
+void SceneCache::setAcceleratorParams(const ParamSet& params) {
+    mAcceleratorParams = params;
+}
+
+void SceneCache::addMeshBVH(const Geometry* g, const BVHPtr& bvh) {
+    mMeshBVHMap[g] = bvh;
+}
+
 const Geometry* SceneCache::getGeometry(const std::string& name) const {
     GeometryMap::const_iterator it = mGeometryMap.find(name);
     if (it == mGeometryMap.end()) {
@@ -228,10 +293,37 @@ const PrimitiveList& SceneCache::getInstances() const {
     return mInstances;
 }
 
+const InstanceMap& SceneCache::getNamedInstances() const {
+    return mNamedInstances;
+}
+
 const std::vector<Light*>& SceneCache::getLights() const {
     return mLights;
 }
 
+const ParamSet& SceneCache::getAcceleratorParams() const {
+    return mAcceleratorParams;
+}
+
+BVHPtr SceneCache::getMeshBVH(const Geometry* g) const {
+    MeshBVHMap::const_iterator it = mMeshBVHMap.find(g);
+    if (it == mMeshBVHMap.end()) {
+        return BVHPtr();
+    }
+    return it->second;
+}
+
+void SceneCache::getMeshBVHs(
+    std::vector<std::pair<std::string, BVHPtr> >& meshBVHs) const {
+    for (GeometryMap::const_iterator it = mGeometryMap.begin();
+        it != mGeometryMap.end(); ++it) {
+        BVHPtr bvh = getMeshBVH(it->second);
+        if (bvh) {
+            meshBVHs.push_back(std::make_pair(it->first, bvh));
+        }
+    }
+}
+
 std::string SceneCache::resolvePath(const std::string& filename) const {
     if (filename[0] == '/' || filename[1] == ':') {
 		// absolute path
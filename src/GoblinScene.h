@@ -4,6 +4,7 @@
 #include "GoblinBVH.h"
 #include "GoblinLight.h"
 #include "GoblinMaterial.h"
+#include "GoblinParamSet.h"
 #include "GoblinPrimitive.h"
 #include "GoblinTexture.h"
 #include "GoblinUtils.h"
@@ -18,7 +19,9 @@ public:
     Scene(const PrimitiveList& inputPrimitives, const CameraPtr& camera,
 		std::vector<Geometry*>&& geometries,
 		std::vector<Primitive*>&& primitives,
-        const std::vector<Light*>& lights, VolumeRegion* volumeRegion);
+        const std::vector<Light*>& lights, VolumeRegion* volumeRegion,
+        const ParamSet& acceleratorParams,
+        const InstanceMap& namedInstances = InstanceMap());
 
     ~Scene();
 
@@ -28,25 +31,60 @@ public:
 
     const VolumeRegion* getVolumeRegion() const;
 
+    // top level BVH over the scene instances
+    const BVH* getBVH() const;
+
     bool intersect(const Ray& ray, float* epsilon, 
         Intersection* intersection, IntersectFilter f = nullptr) const;
 
 	bool occluded(const Ray& ray, IntersectFilter f = nullptr) const;
 
+    // batched queries for coherent rays, see BVH::intersect
+    template<int N>
+    void intersect(RayPacket<N>& packet, IntersectFilter f = nullptr) const {
+        intersect(packet.rays, packet.raysNum, packet.epsilons,
+            packet.intersections, packet.hits, f);
+    }
+
+    template<int N>
+    void occluded(RayPacket<N>& packet, IntersectFilter f = nullptr) const {
+        occluded(packet.rays, packet.raysNum, packet.hits, f);
+    }
+
+    void intersect(const Ray* rays, size_t raysNum, float* epsilons,
+        Intersection* intersections, bool* hits,
+        IntersectFilter f = nullptr) const;
+
+    void occluded(const Ray* rays, size_t raysNum, bool* occluded,
+        IntersectFilter f = nullptr) const;
+
     Color evalEnvironmentLight(const Ray& ray) const;
 
     void getBoundingSphere(Vector3* center, float* radius) const;
 
     const Light* sampleLight(float u, float* pdf) const;
 
+    // transform only scene update between frames, the new transform
+    // takes effect after refit(), return false if name is not found
+    bool setInstanceTransform(const std::string& name,
+        const Transform& toWorld);
+
+    // refit the top level BVH to the current instance transforms
+    // instead of rebuilding it
+    void refit();
+
+private:
+    void updateLightPowers();
+
 private:
-    BVH mBVH;
+    std::unique_ptr<BVH> mBVH;
     CameraPtr mCamera;
 	std::vector<Geometry*> mGeometries;
 	std::vector<Primitive*> mPrimitives;
     std::vector<Light*> mLights;
     VolumeRegion* mVolumeRegion;
     CDF1D* mPowerDistribution;
+    InstanceMap mNamedInstances;
 };
 
 class SceneCache {
@@ -59,7 +97,10 @@ public:
     void addColorTexture(const std::string& name, const ColorTexturePtr& t);
     void addAreaLight(const std::string& name, const AreaLight* l);
     void addInstance(const Primitive* i);
+    void addNamedInstance(const std::string& name, InstancedPrimitive* i);
     void addLight(Light* l);
+    void setAcceleratorParams(const ParamSet& params);
+    void addMeshBVH(const Geometry* g, const BVHPtr& bvh);
     const Geometry* getGeometry(const std::string& name) const;
     const Primitive* getPrimitive(const std::string& name) const;
     const MaterialPtr& getMaterial(const std::string& name) const;
@@ -67,7 +108,13 @@ public:
     const ColorTexturePtr& getColorTexture(const std::string& name) const;
     const AreaLight* getAreaLight(const std::string& name) const;
     const PrimitiveList& getInstances() const;
+    const InstanceMap& getNamedInstances() const;
     const std::vector<Light*>& getLights() const;
+    const ParamSet& getAcceleratorParams() const;
+    BVHPtr getMeshBVH(const Geometry* g) const;
+    // shared mesh BVHs with the name of their geometry
+    void getMeshBVHs(
+        std::vector<std::pair<std::string, BVHPtr> >& meshBVHs) const;
 	std::string resolvePath(const std::string& filename) const;
 
 private:
@@ -79,6 +126,7 @@ private:
     typedef std::map<std::string, ColorTexturePtr> ColorTextureMap;
     typedef std::map<std::string, FloatTexturePtr> FloatTextureMap;
     typedef std::map<std::string, const AreaLight*> AreaLightMap;
+    typedef std::map<const Geometry*, BVHPtr> MeshBVHMap;
 
     GeometryMap mGeometryMap;
     PrimitiveMap mPrimitiveMap;
@@ -86,8 +134,11 @@ private:
     FloatTextureMap mFloatTextureMap;
     ColorTextureMap mColorTextureMap;
     AreaLightMap mAreaLightMap;
+    MeshBVHMap mMeshBVHMap;
     PrimitiveList mInstances;
+    InstanceMap mNamedInstances;
     std::vector<Light*> mLights;
+    ParamSet mAcceleratorParams;
     std::string mSceneRoot;
 	std::string mErrorCode;
 };
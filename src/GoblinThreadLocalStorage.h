@@ -3,6 +3,7 @@
 
 #include "GoblinDebugData.h"
 #include "GoblinFilm.h"
+#include "GoblinTraversalStats.h"
 
 #include <thread>
 #include <mutex>
@@ -27,11 +28,19 @@ public:
 
 class RenderingTLS : public ThreadLocalStorage {
 public:
-    RenderingTLS(const Film& film): mTile(nullptr), mSampleCount(0) {
-        ImageRect r;
-        film.getImageRect(r);
-        const FilterTable& filterTable = film.getFilterTable();
-        mTile = new ImageTile(r, filterTable);
+    // renderers that splat anywhere on the film need a full frame tile
+    // per thread, the camera driven ones merge tile local buffers as
+    // they go and leave it out
+    RenderingTLS(const Film& film, bool fullFrameTile = true):
+        mTile(nullptr), mSampleCount(0) {
+        if (fullFrameTile) {
+            ImageRect r;
+            film.getImageRect(r);
+            mTile = new ImageTile(r, film.getFilterTable());
+        }
+#ifdef GOBLIN_TRAVERSAL_STATS
+        mTraversalStatsBase = threadTraversalStats();
+#endif
     }
 
     ~RenderingTLS() {
@@ -51,19 +60,25 @@ public:
 
     DebugData& getDebugData() { return mDebugData; }
 
+    // traversal work this thread did since the storage got initialized
+    TraversalStats getTraversalStats() const {
+        return threadTraversalStats() - mTraversalStatsBase;
+    }
+
 private:
     ImageTile* mTile;
     uint64_t mSampleCount;
     DebugData mDebugData;
+    TraversalStats mTraversalStatsBase;
 };
 
 class RenderingTLSManager : public TLSManager {
 public:
-    RenderingTLSManager(Film* film):
-        mFilm(film), mTotalSampleCount(0) {}
+    RenderingTLSManager(Film* film, bool fullFrameTile = true):
+        mFilm(film), mFullFrameTile(fullFrameTile), mTotalSampleCount(0) {}
 
     void initialize(TLSPtr& tlsPtr) {
-        tlsPtr.reset(new RenderingTLS(*mFilm));
+        tlsPtr.reset(new RenderingTLS(*mFilm, mFullFrameTile));
     }
 
     void finalize(TLSPtr& tlsPtr) {
@@ -71,8 +86,13 @@ public:
             std::lock_guard<std::mutex> lk(mMergeTLSMutex);
             RenderingTLS* renderingTLS =
                 static_cast<RenderingTLS*>(tlsPtr.get());
-            mFilm->mergeTile(*renderingTLS->getTile());
+            if (renderingTLS->getTile()) {
+                mFilm->mergeTile(*renderingTLS->getTile());
+            }
             mTotalSampleCount += renderingTLS->getSampleCount();
+#ifdef GOBLIN_TRAVERSAL_STATS
+            mTraversalStats += renderingTLS->getTraversalStats();
+#endif
 
             const DebugData& debugData = renderingTLS->getDebugData();
             const std::vector<std::pair<Ray, Color> >& debugRays =
@@ -91,13 +111,41 @@ public:
 
     uint64_t getTotalSampleCount() const { return mTotalSampleCount; }
 
+    // samples a resumed render got from its checkpoint, call it while
+    // the workers are parked
+    void addRestoredSampleCount(uint64_t sampleCount) {
+        mTotalSampleCount += sampleCount;
+    }
+
     const DebugData& getDebugData() const { return mDebugData; }
 
+    const TraversalStats& getTraversalStats() const {
+        return mTraversalStats;
+    }
+
+    // print the merged counters and write the film traversal cost
+    // heatmap, does nothing without GOBLIN_TRAVERSAL_STATS
+    void reportTraversalStats() const {
+#ifdef GOBLIN_TRAVERSAL_STATS
+        const TraversalStats& s = mTraversalStats;
+        double raysNum = s.raysNum > 0 ? (double)s.raysNum : 1.0;
+        std::cout << "rays " << s.raysNum <<
+            ", per ray: nodes visited " << s.nodesVisited / raysNum <<
+            ", boxes hit " << s.boxesHit / raysNum <<
+            ", primitives tested " << s.primitivesTested / raysNum <<
+            ", closest hit updates " << s.closestHitUpdates / raysNum <<
+            std::endl;
+        mFilm->writeTraversalCostImage();
+#endif
+    }
+
 private:
     Film* mFilm;
+    bool mFullFrameTile;
     std::mutex mMergeTLSMutex;
     uint64_t mTotalSampleCount;
     DebugData mDebugData;
+    TraversalStats mTraversalStats;
 };
 
 }
@@ -2,110 +2,240 @@
 
 namespace Goblin {
 
+TaskDeque::TaskDeque(): mMask(0), mTop(0), mBottom(0) {}
+
+void TaskDeque::reset(size_t capacity) {
+    size_t size = 1;
+    while (size < capacity) {
+        size <<= 1;
+    }
+    if (static_cast<int64_t>(size) != mMask + 1) {
+        mBuffer.reset(new std::atomic<Task*>[size]);
+        mMask = static_cast<int64_t>(size) - 1;
+    }
+    mTop.store(0, std::memory_order_relaxed);
+    mBottom.store(0, std::memory_order_relaxed);
+}
+
+void TaskDeque::push(Task* task) {
+    int64_t b = mBottom.load(std::memory_order_relaxed);
+    mBuffer[b & mMask].store(task, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    mBottom.store(b + 1, std::memory_order_relaxed);
+}
+
+Task* TaskDeque::pop() {
+    int64_t b = mBottom.load(std::memory_order_relaxed) - 1;
+    mBottom.store(b, std::memory_order_relaxed);
+    // the bottom update has to be visible before top gets read, or a
+    // thief and the owner can both take the last task
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    int64_t t = mTop.load(std::memory_order_relaxed);
+    if (t > b) {
+        mBottom.store(b + 1, std::memory_order_relaxed);
+        return nullptr;
+    }
+    Task* task = mBuffer[b & mMask].load(std::memory_order_relaxed);
+    if (t == b) {
+        // last one, race the thieves for it
+        if (!mTop.compare_exchange_strong(t, t + 1,
+            std::memory_order_seq_cst, std::memory_order_relaxed)) {
+            task = nullptr;
+        }
+        mBottom.store(b + 1, std::memory_order_relaxed);
+    }
+    return task;
+}
+
+Task* TaskDeque::steal() {
+    int64_t t = mTop.load(std::memory_order_acquire);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    int64_t b = mBottom.load(std::memory_order_acquire);
+    if (t >= b) {
+        return nullptr;
+    }
+    Task* task = mBuffer[t & mMask].load(std::memory_order_relaxed);
+    if (!mTop.compare_exchange_strong(t, t + 1,
+        std::memory_order_seq_cst, std::memory_order_relaxed)) {
+        return nullptr;
+    }
+    return task;
+}
+
 ThreadPool::ThreadPool(unsigned int coreNum,
     TLSManager* tlsManager):
-    mTasksNum(0), mStartWork(false), mTLSManager(tlsManager) {
+    mPendingNum(0), mCommand(RunTasks), mGeneration(0), mBusyNum(0),
+    mTLSManager(tlsManager) {
     mCoreNum = coreNum == 0 ?
         getMaxThreadNum() : std::min(getMaxThreadNum(), coreNum);
+    mDeques.reset(new TaskDeque[mCoreNum]);
+    mWorkerTLS.resize(mCoreNum);
 }
 
+ThreadPool::~ThreadPool() {
+    cleanup();
+}
 
 void ThreadPool::initWorkers() {
     if (mCoreNum == 1) {
         return;
     }
-    for (size_t i = 0; i < mCoreNum; ++i) {
-        mWorkers.push_back(
-            new std::thread(&ThreadPool::taskEntry, this));
+    // a pool reused after cleanup has moved past generation 0 already,
+    // the new workers must only wake up for the commands after this
+    uint64_t generation;
+    {
+        std::lock_guard<std::mutex> lk(mCommandMutex);
+        generation = mGeneration;
+    }
+    for (unsigned int i = 0; i < mCoreNum; ++i) {
+        mWorkers.push_back(new std::thread(&ThreadPool::taskEntry, this,
+            i, generation));
     }
 }
 
-void ThreadPool::taskEntry() {
-    static thread_local TLSPtr tlsPtr;
-    {
-        std::unique_lock<std::mutex> lk(mStartMutex);
-        while(!mStartWork) {
-            mStartCondition.wait(lk);
+void ThreadPool::distributeTasks() {
+    std::lock_guard<std::mutex> lk(mTaskQueueMutex);
+    // contiguous blocks so a worker keeps neighbor tasks (tiles) as long
+    // as nobody steals them, thieves take from the block start
+    size_t tasksNum = mTasks.size();
+    for (unsigned int i = 0; i < mCoreNum; ++i) {
+        size_t begin = tasksNum * i / mCoreNum;
+        size_t end = tasksNum * (i + 1) / mCoreNum;
+        mDeques[i].reset(end - begin);
+        for (size_t j = begin; j < end; ++j) {
+            mDeques[i].push(mTasks[j]);
         }
     }
-    if (mTLSManager) {
+    mPendingNum.store(tasksNum);
+    mTasks.clear();
+}
+
+Task* ThreadPool::acquireTask(unsigned int workerIndex) {
+    Task* task = mDeques[workerIndex].pop();
+    for (unsigned int i = 1; task == nullptr && i < mCoreNum; ++i) {
+        task = mDeques[(workerIndex + i) % mCoreNum].steal();
+    }
+    return task;
+}
+
+void ThreadPool::runTasks(unsigned int workerIndex) {
+    TLSPtr& tlsPtr = mWorkerTLS[workerIndex];
+    if (mTLSManager && !tlsPtr) {
         mTLSManager->initialize(tlsPtr);
     }
+    while(mPendingNum.load() > 0) {
+        Task* task = acquireTask(workerIndex);
+        if (task == nullptr) {
+            // lost the races, the remaining tasks are being taken
+            std::this_thread::yield();
+            continue;
+        }
+        --mPendingNum;
+        task->run(tlsPtr);
+    }
+}
+
+void ThreadPool::taskEntry(unsigned int workerIndex,
+    uint64_t generation) {
     while(true) {
-        Task* task = nullptr;
+        Command command;
         {
-            std::lock_guard<std::mutex> lk(mTaskQueueMutex);
-            if (mTasks.size() == 0) {
-                break;
+            std::unique_lock<std::mutex> lk(mCommandMutex);
+            while(mGeneration == generation) {
+                mCommandCondition.wait(lk);
             }
-            task= mTasks.back();
-            mTasks.pop_back();
+            generation = mGeneration;
+            command = mCommand;
         }
-
-        if (task) {
-            task->run(tlsPtr);
+        if (command == RunTasks) {
+            runTasks(workerIndex);
+        } else if (command == FinalizeTLS) {
+            TLSPtr& tlsPtr = mWorkerTLS[workerIndex];
+            if (mTLSManager && tlsPtr) {
+                mTLSManager->finalize(tlsPtr);
+            }
+            tlsPtr.reset();
         }
-
         {
-            std::unique_lock<std::mutex> lk(mTaskQueueMutex);
-            if (--mTasksNum == 0) {
-                mTasksCondition.notify_all();
-                break;
+            std::lock_guard<std::mutex> lk(mCommandMutex);
+            if (--mBusyNum == 0) {
+                mDoneCondition.notify_all();
             }
         }
+        if (command == Exit) {
+            break;
+        }
     }
-    if (mTLSManager) {
-        mTLSManager->finalize(tlsPtr);
+}
+
+void ThreadPool::dispatch(Command command) {
+    {
+        std::lock_guard<std::mutex> lk(mCommandMutex);
+        mCommand = command;
+        mBusyNum = mWorkers.size();
+        ++mGeneration;
+    }
+    mCommandCondition.notify_all();
+    std::unique_lock<std::mutex> lk(mCommandMutex);
+    while(mBusyNum != 0) {
+        mDoneCondition.wait(lk);
     }
 }
 
 void ThreadPool::enqueue(const std::vector<Task*>& tasks) {
     if (mCoreNum == 1) {
-        TLSPtr tlsPtr;
-        mTLSManager->initialize(tlsPtr);
+        if (mTLSManager && !mInlineTLS) {
+            mTLSManager->initialize(mInlineTLS);
+        }
         for (size_t i = 0; i < tasks.size(); ++i) {
-            tasks[i]->run(tlsPtr);
+            tasks[i]->run(mInlineTLS);
         }
-        mTLSManager->finalize(tlsPtr);
         return;
     }
 
-    if (mWorkers.size() == 0) {
-        initWorkers();
-    }
-    
-    {
-        std::lock_guard<std::mutex> lk(mTaskQueueMutex);
-        for (size_t i = 0; i < tasks.size(); ++i) {
-            mTasks.push_back(tasks[i]);
-        }
-        mTasksNum += mTasks.size();
+    std::lock_guard<std::mutex> lk(mTaskQueueMutex);
+    for (size_t i = 0; i < tasks.size(); ++i) {
+        mTasks.push_back(tasks[i]);
     }
 };
 
-void ThreadPool::waitForAll() {
+void ThreadPool::waitForTasks() {
     if (mCoreNum == 1) {
         return;
     }
-
-    // let the worker start working
-    {
-        std::unique_lock<std::mutex> lk(mStartMutex);
-        mStartWork = true;
+    if (mWorkers.size() == 0) {
+        initWorkers();
     }
-    mStartCondition.notify_all();
+    // the workers are parked till the dispatch, nobody touches the
+    // deques yet
+    distributeTasks();
+    dispatch(RunTasks);
+}
 
-    // wake me up til all the taks finish
-    { 
-        std::unique_lock<std::mutex> lk(mTaskQueueMutex);
-        while(mTasksNum != 0) {
-            mTasksCondition.wait(lk);
+void ThreadPool::finalizeTLS() {
+    if (mCoreNum == 1) {
+        if (mTLSManager && mInlineTLS) {
+            mTLSManager->finalize(mInlineTLS);
         }
-    } 
-    cleanup();
+        mInlineTLS.reset();
+        return;
+    }
+    if (mWorkers.size() > 0) {
+        dispatch(FinalizeTLS);
+    }
+}
+
+void ThreadPool::waitForAll() {
+    waitForTasks();
+    finalizeTLS();
 }
 
 void ThreadPool::cleanup() {
+    finalizeTLS();
+    if (mWorkers.size() == 0) {
+        return;
+    }
+    dispatch(Exit);
     for (size_t i = 0; i < mWorkers.size(); ++i) {
         if (mWorkers[i]->joinable()) {
             mWorkers[i]->join();
@@ -113,11 +243,6 @@ void ThreadPool::cleanup() {
         delete mWorkers[i];
     }
     mWorkers.clear();
-    {
-        std::unique_lock<std::mutex> lk(mStartMutex);
-        mStartWork = false;
-    }
-
 }
 
-}
\ No newline at end of file
+}
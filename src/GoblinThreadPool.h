@@ -3,6 +3,8 @@
 
 #include "GoblinThreadLocalStorage.h"
 #include "GoblinUtils.h"
+#include <atomic>
+#include <condition_variable>
 #include <thread>
 #include <mutex>
 
@@ -14,32 +16,95 @@ public:
     virtual ~Task() {};
 };
 
+// Chase-Lev deque: the owner worker pushes and pops at the bottom
+// without locking, the other workers steal from the top with a CAS
+class TaskDeque {
+public:
+    TaskDeque();
+
+    // owner only, drop the content and make room for capacity tasks
+    void reset(size_t capacity);
+
+    // owner only
+    void push(Task* task);
+
+    // owner only, nullptr if empty
+    Task* pop();
+
+    // any thread, nullptr if empty or another thread took the task
+    Task* steal();
+
+private:
+    std::unique_ptr<std::atomic<Task*>[]> mBuffer;
+    int64_t mMask;
+    // top and bottom live on their own cache lines, thieves hammer top
+    char mPad0[64];
+    std::atomic<int64_t> mTop;
+    char mPad1[64];
+    std::atomic<int64_t> mBottom;
+    char mPad2[64];
+};
+
 class ThreadPool {
 public:
     ThreadPool(unsigned int coreNum = 0,
         TLSManager* tlsManager = nullptr);
+    ~ThreadPool();
     void enqueue(const std::vector<Task*>& tasks);
+    // run the queued tasks, the workers and their TLS stay alive after
+    // it so the next batch starts right away with the same TLS
+    void waitForTasks();
+    // barrier that has every worker finalize its TLS on its own thread,
+    // the next batch initializes a fresh one
+    void finalizeTLS();
+    // waitForTasks then finalizeTLS
     void waitForAll();
+    // finalize the TLS and join the workers
     void cleanup();
 
 private:
+    enum Command {
+        RunTasks,
+        FinalizeTLS,
+        Exit
+    };
+
     void initWorkers();
-    void taskEntry();
+    // generation is the last command the worker counts as handled
+    void taskEntry(unsigned int workerIndex, uint64_t generation);
+    // wake up the parked workers for command and wait till all of
+    // them are done with it
+    void dispatch(Command command);
+    void runTasks(unsigned int workerIndex);
+    // deal the queued tasks out to the worker deques
+    void distributeTasks();
+    // pop the worker own deque first, then go steal from the others
+    Task* acquireTask(unsigned int workerIndex);
 
 private:
     std::vector<std::thread*> mWorkers;
     unsigned int mCoreNum;
+    std::unique_ptr<TaskDeque[]> mDeques;
+    std::vector<TLSPtr> mWorkerTLS;
+    // the single thread pool runs the tasks on the calling thread
+    TLSPtr mInlineTLS;
 
-    std::condition_variable mTasksCondition;
+    // tasks enqueued but not handed out to the deques yet
     std::mutex mTaskQueueMutex;
     std::vector<Task*> mTasks;
-    size_t mTasksNum;
+    // tasks no worker picked up yet
+    std::atomic<size_t> mPendingNum;
 
-    std::condition_variable mStartCondition;
-    std::mutex mStartMutex;
-    bool mStartWork;
+    // the workers park on mCommandCondition till the generation moves
+    std::mutex mCommandMutex;
+    std::condition_variable mCommandCondition;
+    std::condition_variable mDoneCondition;
+    Command mCommand;
+    uint64_t mGeneration;
+    // workers not done with the current command yet
+    size_t mBusyNum;
     TLSManager* mTLSManager;
 };
 }
 
-#endif //GOBLIN_THREAD_POOL_H
\ No newline at end of file
+#endif //GOBLIN_THREAD_POOL_H
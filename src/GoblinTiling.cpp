@@ -0,0 +1,130 @@
+#include "GoblinTiling.h"
+#include "GoblinParamSet.h"
+
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+
+namespace Goblin {
+
+static const int sMinTileSize = 8;
+static const int sMaxTileSize = 64;
+// tiles each thread should get for the stealing to even the load out
+static const int sTilesPerThread = 16;
+// samples a tile takes before growing it stops paying off
+static const uint64_t sTargetTileSamples = 4096;
+
+struct TileKey {
+    bool operator<(const TileKey& rhs) const {
+        if (primary != rhs.primary) {
+            return primary < rhs.primary;
+        }
+        return secondary < rhs.secondary;
+    }
+
+    double primary;
+    double secondary;
+    int x;
+    int y;
+};
+
+static int tilesNum(int length, int tileSize) {
+    return (length + tileSize - 1) / tileSize;
+}
+
+int autoTileSize(const SampleRange& range, int samplePerPixel,
+    int threadNum) {
+    int width = range.xEnd - range.xStart;
+    int height = range.yEnd - range.yStart;
+    int minTilesNum = sTilesPerThread * std::max(threadNum, 1);
+    uint64_t tileSamplePerPixel = (uint64_t)std::max(samplePerPixel, 1);
+    int tileSize = sMinTileSize;
+    while (tileSize < sMaxTileSize &&
+        tileSize * tileSize * tileSamplePerPixel < sTargetTileSamples &&
+        tilesNum(width, 2 * tileSize) * tilesNum(height, 2 * tileSize) >=
+        minTilesNum) {
+        tileSize *= 2;
+    }
+    return tileSize;
+}
+
+// distance of (x, y) along the hilbert curve over an n x n grid, n is a
+// power of two
+static uint64_t hilbertIndex(uint32_t n, uint32_t x, uint32_t y) {
+    uint64_t d = 0;
+    for (uint32_t s = n / 2; s > 0; s /= 2) {
+        uint32_t rx = (x & s) > 0 ? 1 : 0;
+        uint32_t ry = (y & s) > 0 ? 1 : 0;
+        d += (uint64_t)s * s * ((3 * rx) ^ ry);
+        // turn the quadrant so the sub curve starts where we are
+        if (ry == 0) {
+            if (rx == 1) {
+                x = n - 1 - x;
+                y = n - 1 - y;
+            }
+            std::swap(x, y);
+        }
+    }
+    return d;
+}
+
+void splitTiles(const SampleRange& range, int samplePerPixel,
+    int threadNum, const TilingSetting& setting,
+    std::vector<SampleRange>& tiles) {
+    int tileSize = setting.tileSize > 0 ? setting.tileSize :
+        autoTileSize(range, samplePerPixel, threadNum);
+    int xTilesNum = tilesNum(range.xEnd - range.xStart, tileSize);
+    int yTilesNum = tilesNum(range.yEnd - range.yStart, tileSize);
+    // the curve covers the enclosing power of two grid, the tiles past
+    // the range edge are just not there
+    uint32_t n = 1;
+    while (n < (uint32_t)std::max(xTilesNum, yTilesNum)) {
+        n <<= 1;
+    }
+    std::vector<TileKey> keys;
+    keys.reserve(xTilesNum * yTilesNum);
+    for (int y = 0; y < yTilesNum; ++y) {
+        for (int x = 0; x < xTilesNum; ++x) {
+            TileKey key;
+            key.x = x;
+            key.y = y;
+            key.secondary = 0.0;
+            if (setting.order == TileOrderHilbert) {
+                key.primary = (double)hilbertIndex(n, x, y);
+            } else if (setting.order == TileOrderSpiral) {
+                // square rings from the center out, each walked around
+                double dx = x + 0.5 - 0.5 * xTilesNum;
+                double dy = y + 0.5 - 0.5 * yTilesNum;
+                key.primary = floor(std::max(fabs(dx), fabs(dy)));
+                key.secondary = atan2(dy, dx);
+            } else {
+                key.primary = (double)(y * xTilesNum + x);
+            }
+            keys.push_back(key);
+        }
+    }
+    std::sort(keys.begin(), keys.end());
+    for (size_t i = 0; i < keys.size(); ++i) {
+        int x = range.xStart + keys[i].x * tileSize;
+        int y = range.yStart + keys[i].y * tileSize;
+        tiles.push_back(SampleRange(x, std::min(x + tileSize, range.xEnd),
+            y, std::min(y + tileSize, range.yEnd)));
+    }
+}
+
+TilingSetting getTilingSetting(const ParamSet& params) {
+    TilingSetting setting;
+    setting.tileSize = std::max(0, params.getInt("tile_size", 0));
+    std::string order = params.getString("tile_order", "hilbert");
+    if (order == "spiral") {
+        setting.order = TileOrderSpiral;
+    } else if (order == "scanline") {
+        setting.order = TileOrderScanline;
+    } else if (order != "hilbert") {
+        std::cerr << "unrecognized tile_order " << order <<
+            ", fall back to hilbert" << std::endl;
+    }
+    return setting;
+}
+
+}
@@ -0,0 +1,42 @@
+#ifndef GOBLIN_TILING_H
+#define GOBLIN_TILING_H
+
+#include "GoblinSampler.h"
+
+#include <vector>
+
+namespace Goblin {
+class ParamSet;
+
+enum TileOrder {
+    TileOrderHilbert,
+    TileOrderSpiral,
+    TileOrderScanline
+};
+
+struct TilingSetting {
+    TilingSetting(): tileSize(0), order(TileOrderHilbert) {}
+
+    // tile edge in pixels, 0 picks one with autoTileSize
+    int tileSize;
+    TileOrder order;
+};
+
+TilingSetting getTilingSetting(const ParamSet& params);
+
+// large enough that a tile pays off its setup and merge, small enough
+// to leave every thread plenty of tiles to balance the load with
+int autoTileSize(const SampleRange& range, int samplePerPixel,
+    int threadNum);
+
+// cut range into tiles laid out in setting.order. the thread pool deals
+// the tasks out in contiguous blocks, along the hilbert curve (or the
+// spiral) a block is a compact patch of the image so each thread stays
+// on nearby geometry and textures
+void splitTiles(const SampleRange& range, int samplePerPixel,
+    int threadNum, const TilingSetting& setting,
+    std::vector<SampleRange>& tiles);
+
+}
+
+#endif //GOBLIN_TILING_H
@@ -192,4 +192,81 @@ void Transform::update() const {
     mIsUpdated = true;
 }
 
-}
\ No newline at end of file
+AffineTransform::AffineTransform() {
+    for (int i = 0; i < 3; ++i) {
+        for (int j = 0; j < 4; ++j) {
+            mToWorld[i][j] = mToObject[i][j] = i == j ? 1.0f : 0.0f;
+        }
+    }
+}
+
+AffineTransform::AffineTransform(const Transform& t) {
+    const Matrix4& M = t.getMatrix();
+    const Matrix4& invM = t.getInverse();
+    for (int i = 0; i < 3; ++i) {
+        for (int j = 0; j < 4; ++j) {
+            mToWorld[i][j] = M[i][j];
+            mToObject[i][j] = invM[i][j];
+        }
+    }
+}
+
+Vector3 AffineTransform::onPoint(const Vector3& p) const {
+    const float (*M)[4] = mToWorld;
+    return Vector3(
+        M[0][0] * p.x + M[0][1] * p.y + M[0][2] * p.z + M[0][3],
+        M[1][0] * p.x + M[1][1] * p.y + M[1][2] * p.z + M[1][3],
+        M[2][0] * p.x + M[2][1] * p.y + M[2][2] * p.z + M[2][3]);
+}
+
+// normal goes through the inverse transpose
+Vector3 AffineTransform::onNormal(const Vector3& n) const {
+    const float (*M)[4] = mToObject;
+    return Vector3(
+        M[0][0] * n.x + M[1][0] * n.y + M[2][0] * n.z,
+        M[0][1] * n.x + M[1][1] * n.y + M[2][1] * n.z,
+        M[0][2] * n.x + M[1][2] * n.y + M[2][2] * n.z);
+}
+
+Vector3 AffineTransform::onVector(const Vector3& v) const {
+    const float (*M)[4] = mToWorld;
+    return Vector3(
+        M[0][0] * v.x + M[0][1] * v.y + M[0][2] * v.z,
+        M[1][0] * v.x + M[1][1] * v.y + M[1][2] * v.z,
+        M[2][0] * v.x + M[2][1] * v.y + M[2][2] * v.z);
+}
+
+BBox AffineTransform::onBBox(const BBox& b) const {
+    BBox rv(onPoint(b.pMin));
+    rv.expand(onPoint(Vector3(b.pMax.x, b.pMin.y, b.pMin.z)));
+    rv.expand(onPoint(Vector3(b.pMin.x, b.pMax.y, b.pMin.z)));
+    rv.expand(onPoint(Vector3(b.pMin.x, b.pMin.y, b.pMax.z)));
+    rv.expand(onPoint(Vector3(b.pMax.x, b.pMax.y, b.pMin.z)));
+    rv.expand(onPoint(Vector3(b.pMax.x, b.pMin.y, b.pMax.z)));
+    rv.expand(onPoint(Vector3(b.pMin.x, b.pMax.y, b.pMax.z)));
+    rv.expand(onPoint(b.pMax));
+    return rv;
+}
+
+Vector3 AffineTransform::invertPoint(const Vector3& p) const {
+    const float (*M)[4] = mToObject;
+    return Vector3(
+        M[0][0] * p.x + M[0][1] * p.y + M[0][2] * p.z + M[0][3],
+        M[1][0] * p.x + M[1][1] * p.y + M[1][2] * p.z + M[1][3],
+        M[2][0] * p.x + M[2][1] * p.y + M[2][2] * p.z + M[2][3]);
+}
+
+Vector3 AffineTransform::invertVector(const Vector3& v) const {
+    const float (*M)[4] = mToObject;
+    return Vector3(
+        M[0][0] * v.x + M[0][1] * v.y + M[0][2] * v.z,
+        M[1][0] * v.x + M[1][1] * v.y + M[1][2] * v.z,
+        M[2][0] * v.x + M[2][1] * v.y + M[2][2] * v.z);
+}
+
+Ray AffineTransform::invertRay(const Ray& r) const {
+    return Ray(invertPoint(r.o), invertVector(r.d),
+        r.mint, r.maxt, r.depth);
+}
+
+}
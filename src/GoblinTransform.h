@@ -81,6 +81,34 @@ private:
     Vector3 mScale;
     mutable bool mIsUpdated;
 };
+
+// compact 3x4 snapshot of a Transform for the instance level, the last
+// row of the matrices Transform builds is always (0, 0, 0, 1) so it is
+// dropped, and nothing gets lazily recomputed during traversal
+class AffineTransform {
+public:
+    AffineTransform();
+
+    explicit AffineTransform(const Transform& t);
+
+    Vector3 onPoint(const Vector3& p) const;
+
+    Vector3 onNormal(const Vector3& n) const;
+
+    Vector3 onVector(const Vector3& v) const;
+
+    BBox onBBox(const BBox& b) const;
+
+    Vector3 invertPoint(const Vector3& p) const;
+
+    Vector3 invertVector(const Vector3& v) const;
+
+    Ray invertRay(const Ray& ray) const;
+
+private:
+    float mToWorld[3][4];
+    float mToObject[3][4];
+};
 }
 
 #endif //GOBLIN_TRANSFORM_H
\ No newline at end of file
@@ -0,0 +1,129 @@
+#ifndef GOBLIN_TRAVERSAL_STATS_H
+#define GOBLIN_TRAVERSAL_STATS_H
+
+#include <cstdint>
+
+// uncomment to count the BVH traversal work of every ray and write a
+// per pixel traversal cost heatmap next to the film output, the
+// counters compile to nothing without it
+//#define GOBLIN_TRAVERSAL_STATS
+
+namespace Goblin {
+
+struct TraversalStats {
+    TraversalStats(): raysNum(0), nodesVisited(0), boxesHit(0),
+        primitivesTested(0), closestHitUpdates(0) {}
+
+    TraversalStats& operator+=(const TraversalStats& rhs) {
+        raysNum += rhs.raysNum;
+        nodesVisited += rhs.nodesVisited;
+        boxesHit += rhs.boxesHit;
+        primitivesTested += rhs.primitivesTested;
+        closestHitUpdates += rhs.closestHitUpdates;
+        return *this;
+    }
+
+    TraversalStats operator-(const TraversalStats& rhs) const {
+        TraversalStats result;
+        result.raysNum = raysNum - rhs.raysNum;
+        result.nodesVisited = nodesVisited - rhs.nodesVisited;
+        result.boxesHit = boxesHit - rhs.boxesHit;
+        result.primitivesTested = primitivesTested - rhs.primitivesTested;
+        result.closestHitUpdates = closestHitUpdates - rhs.closestHitUpdates;
+        return result;
+    }
+
+    // what the heatmap shows, a node fetch and a primitive test are
+    // roughly the same price
+    uint64_t cost() const {
+        return nodesVisited + primitivesTested;
+    }
+
+    // scene level queries, the nested mesh traversals are not counted
+    uint64_t raysNum;
+    uint64_t nodesVisited;
+    // bounds the ray overlaps, a wide node counts each hit child
+    uint64_t boxesHit;
+    uint64_t primitivesTested;
+    uint64_t closestHitUpdates;
+};
+
+// running totals of the calling thread, the counters below add to it
+TraversalStats& threadTraversalStats();
+
+// scene queries of the calling thread for the progress report, always
+// on unlike the traversal stats, a thread local add is all they cost
+struct RayCounts {
+    RayCounts(): raysNum(0), shadowRaysNum(0) {}
+
+    RayCounts operator-(const RayCounts& rhs) const {
+        RayCounts result;
+        result.raysNum = raysNum - rhs.raysNum;
+        result.shadowRaysNum = shadowRaysNum - rhs.shadowRaysNum;
+        return result;
+    }
+
+    // intersect queries
+    uint64_t raysNum;
+    // occluded queries
+    uint64_t shadowRaysNum;
+};
+
+RayCounts& threadRayCounts();
+
+inline void countRays(uint64_t n) {
+#ifdef GOBLIN_TRAVERSAL_STATS
+    threadTraversalStats().raysNum += n;
+#endif
+}
+
+inline void countIntersectRays(uint64_t n) {
+    threadRayCounts().raysNum += n;
+    countRays(n);
+}
+
+inline void countShadowRays(uint64_t n) {
+    threadRayCounts().shadowRaysNum += n;
+    countRays(n);
+}
+
+inline void countNodeVisit() {
+#ifdef GOBLIN_TRAVERSAL_STATS
+    ++threadTraversalStats().nodesVisited;
+#endif
+}
+
+#ifdef GOBLIN_TRAVERSAL_STATS
+inline uint64_t bitsNum(uint32_t mask) {
+    uint64_t n = 0;
+    for (; mask; mask &= mask - 1) {
+        ++n;
+    }
+    return n;
+}
+#endif
+
+// one bound per bit of hitMask
+inline void countBoxesHit(uint32_t hitMask) {
+#ifdef GOBLIN_TRAVERSAL_STATS
+    threadTraversalStats().boxesHit += bitsNum(hitMask);
+#endif
+}
+
+// n primitives tested against each ray of a packet rayMask
+inline void countPrimitivesTested(uint32_t n, uint32_t rayMask = 1) {
+#ifdef GOBLIN_TRAVERSAL_STATS
+    threadTraversalStats().primitivesTested += n * bitsNum(rayMask);
+#endif
+}
+
+// one update per bit of rayMask
+inline void countClosestHitUpdate(uint32_t rayMask = 1) {
+#ifdef GOBLIN_TRAVERSAL_STATS
+    threadTraversalStats().closestHitUpdates += bitsNum(rayMask);
+#endif
+}
+
+}
+
+#endif //GOBLIN_TRAVERSAL_STATS_H
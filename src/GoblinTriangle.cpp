@@ -41,14 +41,9 @@ bool Triangle::intersect(const Ray& ray, float* epsilon,
     unsigned int i0 = ti->v[0];
     unsigned int i1 = ti->v[1];
     unsigned int i2 = ti->v[2];
-
-    const Vertex& v0 = *mParentMesh->getVertexPtr(i0);
-    const Vertex& v1 = *mParentMesh->getVertexPtr(i1);
-    const Vertex& v2 = *mParentMesh->getVertexPtr(i2);
-
-    const Vector3& p0 = v0.position;
-    const Vector3& p1 = v1.position;
-    const Vector3& p2 = v2.position;
+    const Vector3& p0 = mParentMesh->getVertexPtr(i0)->position;
+    const Vector3& p1 = mParentMesh->getVertexPtr(i1)->position;
+    const Vector3& p2 = mParentMesh->getVertexPtr(i2)->position;
 
     Vector3 e1 = p1 - p0;
     Vector3 e2 = p2 - p0;
@@ -76,51 +71,9 @@ bool Triangle::intersect(const Ray& ray, float* epsilon,
         return false;
     }
 
-    float b0 = 1.0f - b1 - b2;
     ray.maxt = t;
     *epsilon = 1e-3f * t;
-    // start collect intersection geometry info:
-    // position, normal, uv, dpdu, dpdv....
-    Vector3 position(ray(t));
-    Vector3 normal;
-    if (mParentMesh->hasNormal()) {
-        const Vector3& n0 = v0.normal;
-        const Vector3& n1 = v1.normal;
-        const Vector3& n2 = v2.normal;
-        normal = normalize(b0 * n0 + b1 * n1 + b2 * n2);
-    } else {
-        normal = normalize(cross(e1, e2));
-    }
-
-    Vector2 uvs[3];
-    if (mParentMesh->hasTexCoord()) {
-        uvs[0] = v0.texC;
-        uvs[1] = v1.texC;
-        uvs[2] = v2.texC;
-    } else {
-        uvs[0] = Vector2(0.0f, 0.0f);
-        uvs[1] = Vector2(1.0f, 0.0f);
-        uvs[2] = Vector2(0.0f, 1.0f);
-    }
-    Vector2 uv(b0 * uvs[0] + b1 * uvs[1] + b2 * uvs[2]);
-
-    float du1 = uvs[1].x - uvs[0].x;
-    float dv1 = uvs[1].y - uvs[0].y;
-    float du2 = uvs[2].x - uvs[0].x;
-    float dv2 = uvs[2].y - uvs[0].y;
-    float determinant = du1 * dv2 - dv1 * du2;
-    Vector3 dpdu, dpdv;
-    if (determinant == 0.0f) {
-        // form a random shading coordinate from normal then
-        dpdu = normalize(e1 - 
-            dot(fragment->getNormal(), e1) * fragment->getNormal());
-        dpdv = cross(fragment->getNormal(), fragment->getDPDV());
-    } else {
-        float invDet = 1.0f / determinant;
-        dpdu = invDet * (dv2 * e1 - dv1 * e2);
-        dpdv = invDet * (-du2 * e1 + du1 * e2);
-    }
-    *fragment = Fragment(position, normal, uv, dpdu, dpdv);
+    mParentMesh->computeFragment(mIndex, ray, t, b1, b2, fragment);
     return true;
 }
 
@@ -6,53 +6,47 @@
 
 #include <ctime>
 #include <limits>
-#include <random>
 
 namespace Goblin {
 
-typedef std::mt19937 RNGType;
-typedef std::uniform_real<float> RealDist;
-typedef std::uniform_int<uint32_t> UInt32Dist;
-
-class RNGImp {
-public:
-    RNGImp() :
-		mEngine(new RNGType(static_cast<uint32_t>(rand()))),
-		mRealDist(new std::uniform_real<float>(0.0f, 1.0f)),
-		mUInt32Dist(new std::uniform_int<uint32_t>(
-			0, std::numeric_limits<uint32_t>::max()))
-	{}
-
-	float randomFloat() const {
-		return (*mRealDist)(*mEngine);
-	}
-
-	uint32_t randomUInt() const {
-		return (*mUInt32Dist)(*mEngine);
-	}
-private:
-    std::unique_ptr<RNGType> mEngine;
-    std::unique_ptr<RealDist> mRealDist;
-    std::unique_ptr<UInt32Dist> mUInt32Dist;
-};
-
-RNG::RNG() {
-    mRNGImp = new RNGImp();
+void RNG::setSeed(uint64_t seed, uint64_t stream) {
+    // the increment has to be odd, it picks one of 2^63 streams
+    mState = 0u;
+    mInc = (stream << 1u) | 1u;
+    randomUInt();
+    mState += seed;
+    randomUInt();
 }
 
-RNG::~RNG() {
-    if (mRNGImp) {
-        delete mRNGImp;
-        mRNGImp = nullptr;
+void RNG::advance(uint64_t delta) {
+    // Brown 1994, "Random Number Generation with Arbitrary Strides",
+    // compose the lcg step with itself for each bit of delta
+    uint64_t curMult = sMultiplier;
+    uint64_t curPlus = mInc;
+    uint64_t accMult = 1u;
+    uint64_t accPlus = 0u;
+    while (delta > 0) {
+        if (delta & 1) {
+            accMult *= curMult;
+            accPlus = accPlus * curMult + curPlus;
+        }
+        curPlus = (curMult + 1) * curPlus;
+        curMult *= curMult;
+        delta >>= 1;
     }
+    mState = accMult * mState + accPlus;
 }
 
-float RNG::randomFloat() const {
-    return mRNGImp->randomFloat();
+// splitmix64 finalizer, neighbor keys end up on unrelated streams
+static uint64_t mix64(uint64_t x) {
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+    return x ^ (x >> 31);
 }
 
-uint32_t RNG::randomUInt() const {
-    return mRNGImp->randomUInt();
+void RNG::setSample(uint64_t key, uint64_t sampleIndex, uint64_t seed) {
+    setSeed(mix64(seed), mix64(key));
+    advance(sampleIndex << 32);
 }
 
 void coordinateAxises(const Vector3& a1, Vector3* a2, Vector3* a3) {
@@ -196,6 +190,20 @@ void drawPoint(const Vector2& p, Color* buffer, int xRes, int yRes,
     }
 }
 
+bool replaceFile(const std::string& tmpFilename,
+    const std::string& filename) {
+#if defined(_WIN32) || defined(_WIN64)
+    // rename doesn't overwrite here, for the moment filename is gone
+    // readCheckpoint falls back to the tmp file
+    std::remove(filename.c_str());
+#endif
+    if (std::rename(tmpFilename.c_str(), filename.c_str()) != 0) {
+        std::remove(tmpFilename.c_str());
+        return false;
+    }
+    return true;
+}
+
 void getPrimes(size_t N, std::vector<uint32_t>& primes) {
     primes.clear();
     if (N > 0) {
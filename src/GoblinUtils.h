@@ -182,21 +182,62 @@ void drawPoint(const Vector2& p, Color* buffer, int xRes, int yRes,
     const Color& color, int radius = 1);
 
 // random number generator utils
-class RNGImp;
-// TODO consider replacing this with PCG
+// PCG32 (O'Neill 2014, XSH RR output): 16 bytes of state, no heap, and
+// every stream can jump to any position, so the random numbers of a
+// pixel sample only depend on the pixel and the sample index
 class RNG {
 public:
-    RNG();
-    ~RNG();
-    float randomFloat() const;
-    uint32_t randomUInt() const;
+    RNG(uint64_t seed = 0, uint64_t stream = 0) {
+        setSeed(seed, stream);
+    }
+
+    void setSeed(uint64_t seed, uint64_t stream = 0);
+
+    // jump delta draws ahead in O(log(delta)), wrapping around the
+    // 2^64 period so a huge delta goes backward
+    void advance(uint64_t delta);
+
+    // the stream of key (hashed), positioned at sampleIndex. each
+    // sample index owns a 2^32 draws long window of the stream, the
+    // draws inside it are the sample dimensions in consumption order
+    void setSample(uint64_t key, uint64_t sampleIndex, uint64_t seed = 0);
+
+    // setSample keyed by pixel (x, y)
+    void setPixelSample(int x, int y, uint64_t sampleIndex,
+        uint64_t seed = 0) {
+        setSample(((uint64_t)(uint32_t)y << 32) | (uint32_t)x,
+            sampleIndex, seed);
+    }
+
+    float randomFloat() const {
+        // 24 high bits, exactly representable and strictly below 1
+        return (randomUInt() >> 8) * (1.0f / 16777216.0f);
+    }
+
+    uint32_t randomUInt() const {
+        uint64_t old = mState;
+        mState = old * sMultiplier + mInc;
+        uint32_t xorShifted = (uint32_t)(((old >> 18u) ^ old) >> 27u);
+        uint32_t rot = (uint32_t)(old >> 59u);
+        return (xorShifted >> rot) | (xorShifted << ((~rot + 1u) & 31u));
+    }
+
 private:
-    RNGImp* mRNGImp;
+    static const uint64_t sMultiplier = 6364136223846793005ULL;
+    // the draws are const for the callers that only hold a const RNG&
+    mutable uint64_t mState;
+    uint64_t mInc;
 };
 
 // get first N prime numbers sequence
 void getPrimes(size_t N, std::vector<uint32_t>& primes);
 
+// move a file written aside over filename, on POSIX the rename is
+// atomic so a preemption leaves either the old or the new file. tmp
+// gets removed when the move fails
+bool replaceFile(const std::string& tmpFilename,
+    const std::string& filename);
+
 inline unsigned int getMaxThreadNum() {
 	return std::thread::hardware_concurrency();
 }
@@ -1,12 +1,21 @@
 #include "GoblinRenderContext.h"
 #include "GoblinContextLoader.h"
+#include "GoblinFilm.h"
 #include <ctime>
 
 using namespace Goblin;
 
 int main(int argc, char** argv) {
+    // g_ray --merge out.exr a.gpf b.gpf ... sums the partial films the
+    // render processes wrote (film "partial_file") into one image
+    if (argc >= 4 && std::string(argv[1]) == "--merge") {
+        std::vector<std::string> inputs(argv + 3, argv + argc);
+        return mergePartialFilms(inputs, argv[2]) ? 0 : 1;
+    }
     if (argc != 2) {
         std::cout << "Usage: g_ray scene.json" << std::endl;
+        std::cout << "       g_ray --merge output partial_film..." <<
+            std::endl;
         return 0;
     }
     std::unique_ptr<RenderContext> renderContext(
@@ -22,6 +31,12 @@ int main(int argc, char** argv) {
         double seconds = difftime(afterRender, beforeRender);
         std::cout << "render complete in " << seconds << " seconds!" <<
 			std::endl;
+#ifdef GOBLIN_BVH_FETCH_STATS
+        uint64_t fetches, misses;
+        BVH::getNodeFetchStats(&fetches, &misses);
+        std::cout << "bvh node fetches " << fetches << " cache misses " <<
+            misses << std::endl;
+#endif
     }
     return 0;
 }